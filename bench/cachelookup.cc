@@ -0,0 +1,246 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+//
+// Cache lookups under a read-heavy, Zipf-distributed load, from 1 to 64
+// threads.  Each thread count runs twice: once against the cache as it
+// is, with lookups that take no lock and rely on epoch reclamation, and
+// once with every operation under one of 16 mutexes picked by the key,
+// as each of the cache's 16 shards used to be.  Writes are inserts of
+// keys from the same distribution, and go through the cache's own writer
+// lock in both runs.
+//
+// Usage: bench/cachelookup [-n names] [-s exponent] [-w writes per 1000]
+//                          [-d milliseconds per run] [-t max threads]
+//
+
+#include <dnscache.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Options
+{
+   int names;
+   double exponent;
+   int writes;          // per 1000 operations
+   int millis;
+   int maxThreads;
+
+   Options() : names(100000), exponent(1.0), writes(10), millis(1000), maxThreads(64) {}
+};
+
+struct alignas(64) Stripe
+{
+   std::mutex lock;
+};
+
+const int StripeCount = 16;
+
+// hostN.bench.example, in wire format and lowercase as keys want it.
+//
+std::vector<std::string>
+MakeNames(int n)
+{
+   std::vector<std::string> r;
+
+   for (int i = 0; i < n; ++i)
+   {
+      std::string label = "host" + std::to_string(i);
+      std::string name;
+
+      name.push_back(label.size());
+      name += label;
+      name += "\x05" "bench" "\x07" "example";
+      name.push_back(0);
+      r.push_back(name);
+   }
+
+   return r;
+}
+
+void
+MakeKey(const std::string &name, dns::CacheKey &key)
+{
+   key.Name = name.data();
+   key.NameLength = name.size();
+   key.Type = 1;
+   key.Class = 1;
+}
+
+uint32_t
+StripeHash(const std::string &name)
+{
+   uint32_t h = 2166136261U;
+   for (unsigned char ch : name)
+   {
+      h ^= ch;
+      h *= 16777619U;
+   }
+   return h;
+}
+
+double
+Run(
+   dns::Cache &cache,
+   const Options &opts,
+   const std::vector<std::string> &names,
+   const std::vector<double> &cdf,
+   int nthreads,
+   Stripe *stripes
+)
+{
+   std::atomic<bool> stop(false);
+   std::atomic<uint64_t> total(0);
+   std::vector<std::thread> threads;
+   static const char payload[64] = {0};
+
+   for (int t = 0; t < nthreads; ++t)
+   {
+      threads.emplace_back([&, t] {
+         std::mt19937_64 rng(t + 1);
+         std::uniform_real_distribution<double> uniform(0.0, 1.0);
+         std::vector<char> out;
+         uint64_t ops = 0;
+         error err;
+
+         out.reserve(sizeof(payload));
+
+         while (!stop.load(std::memory_order_relaxed))
+         {
+            size_t i = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+            if (i >= names.size())
+               i = names.size() - 1;
+
+            dns::CacheKey key;
+            MakeKey(names[i], key);
+
+            std::unique_lock<std::mutex> lock;
+            if (stripes)
+               lock = std::unique_lock<std::mutex>(stripes[StripeHash(names[i]) % StripeCount].lock);
+
+            if ((int)(rng() % 1000) < opts.writes)
+            {
+               dns::CacheEntryInfo info;
+               info.Time = 1;
+               info.Ttl = 1000000;
+               cache.Insert(key, info, payload, sizeof(payload), &err);
+            }
+            else
+            {
+               cache.Lookup(key, out, nullptr, &err);
+            }
+            error_clear(&err);
+            ++ops;
+         }
+
+         total += ops;
+      });
+   }
+
+   std::this_thread::sleep_for(std::chrono::milliseconds(opts.millis));
+   stop = true;
+   for (auto &t : threads)
+      t.join();
+
+   return total / (opts.millis / 1000.0);
+}
+
+} // end namespace
+
+int
+main(int argc, char **argv)
+{
+   Options opts;
+   int ch;
+
+   while ((ch = getopt(argc, argv, "n:s:w:d:t:")) != -1)
+   {
+      switch (ch)
+      {
+      case 'n': opts.names = atoi(optarg); break;
+      case 's': opts.exponent = atof(optarg); break;
+      case 'w': opts.writes = atoi(optarg); break;
+      case 'd': opts.millis = atoi(optarg); break;
+      case 't': opts.maxThreads = atoi(optarg); break;
+      default:
+         fprintf(stderr, "usage: %s [-n names] [-s exponent] [-w writes per 1000] [-d ms] [-t max threads]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (opts.names < 1 || opts.millis < 1 || opts.maxThreads < 1)
+   {
+      fprintf(stderr, "names, milliseconds and threads must be positive\n");
+      return 1;
+   }
+
+   auto names = MakeNames(opts.names);
+   std::vector<double> cdf(names.size());
+   double sum = 0;
+
+   for (size_t i = 0; i < cdf.size(); ++i)
+   {
+      sum += 1.0 / pow(i + 1, opts.exponent);
+      cdf[i] = sum;
+   }
+   for (auto &c : cdf)
+      c /= sum;
+
+   dns::Cache cache;
+   std::unique_ptr<Stripe[]> stripes(new Stripe[StripeCount]);
+   error err;
+
+   cache.SetBudget(0);
+   for (auto &name : names)
+   {
+      dns::CacheKey key;
+      dns::CacheEntryInfo info;
+      char payload[64] = {0};
+
+      MakeKey(name, key);
+      info.Time = 1;
+      info.Ttl = 1000000;
+      cache.Insert(key, info, payload, sizeof(payload), &err);
+      if (ERROR_FAILED(&err))
+      {
+         fprintf(stderr, "insert failed\n");
+         return 1;
+      }
+   }
+
+   printf(
+      "%d names, zipf %.2f, %d writes per 1000, %d ms per run, %u cpus\n",
+      opts.names, opts.exponent, opts.writes, opts.millis,
+      std::thread::hardware_concurrency()
+   );
+   printf("threads     epoch ops/s     mutex ops/s    ratio\n");
+
+   for (int n = 1; n <= opts.maxThreads; n *= 2)
+   {
+      double lockFree = Run(cache, opts, names, cdf, n, nullptr);
+      double locked = Run(cache, opts, names, cdf, n, stripes.get());
+
+      printf("%7d %15.0f %15.0f %8.2f\n", n, lockFree, locked, lockFree / locked);
+   }
+
+   return 0;
+}
@@ -0,0 +1,431 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+//
+// The native cache against the in-memory SQLite database it replaced,
+// over the same names, on insert and on hit.  The SQLite side is the old
+// schema and the old statements: a SELECT by name, type and class for a
+// hit, and a DELETE plus one INSERT per answer to fill an entry.  The
+// server prepared each statement afresh every time, so that's timed, and
+// so is the same with the statements prepared once and reset between
+// uses, which is the best SQLite could have done.
+//
+// "fill" is the first insert of every name, "refill" replaces each one,
+// as a refresh does, and "hit" is lookups of names picked at random.
+//
+// Only this benchmark links with SQLite, the system's.
+//
+// Usage: bench/cachevssqlite [-n names] [-a answers per name]
+//                            [-l lookups]
+//
+
+#include <dnscache.h>
+#include <dnsmsg.h>
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options
+{
+   int names;
+   int answers;
+   int lookups;
+
+   Options() : names(100000), answers(2), lookups(1000000) {}
+};
+
+struct Name
+{
+   std::string host;       // hostN.bench.example, as SQLite had it
+   std::string wire;       // folded wire format, as the cache keys it
+};
+
+struct Result
+{
+   double fill;            // ns per operation
+   double refill;
+   double hit;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double
+NsPer(Clock::time_point start, size_t n)
+{
+   std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+   return elapsed.count() / n;
+}
+
+void
+Die(const char *what, sqlite3 *db = nullptr)
+{
+   fprintf(stderr, "%s: %s\n", what, db ? sqlite3_errmsg(db) : "failed");
+   exit(1);
+}
+
+std::vector<Name>
+MakeNames(int n)
+{
+   std::vector<Name> r(n);
+
+   for (int i = 0; i < n; ++i)
+   {
+      std::string label = "host" + std::to_string(i);
+
+      r[i].host = label + ".bench.example";
+      r[i].wire.push_back(label.size());
+      r[i].wire += label;
+      r[i].wire += "\x05" "bench" "\x07" "example";
+      r[i].wire.push_back(0);
+   }
+
+   return r;
+}
+
+// The answer section the native cache holds: A records with a pointer to
+// the question's name.
+//
+std::vector<char>
+MakeAnswers(int answers)
+{
+   std::vector<char> r;
+
+   for (int i = 0; i < answers; ++i)
+   {
+      static const unsigned char rr[] =
+      {
+         0xc0, 0x0c,
+         0x00, 0x01, 0x00, 0x01,
+         0x00, 0x00, 0x0e, 0x10,
+         0x00, 0x04,
+      };
+      r.insert(r.end(), rr, rr + sizeof(rr));
+      r.push_back(10);
+      r.push_back(0);
+      r.push_back(0);
+      r.push_back(i + 1);
+   }
+
+   return r;
+}
+
+void
+MakeKey(const Name &name, dns::CacheKey &key)
+{
+   key.Name = name.wire.data();
+   key.NameLength = name.wire.size();
+   key.Type = (uint16_t)dns::Type::A;
+   key.Class = (uint16_t)dns::Class::IN;
+}
+
+Result
+RunNative(const Options &opts, const std::vector<Name> &names, const std::vector<size_t> &order)
+{
+   dns::Cache cache;
+   auto payload = MakeAnswers(opts.answers);
+   std::vector<char> out;
+   Result r;
+   error err;
+   int found = 0;
+
+   cache.SetBudget(0);
+
+   for (int pass = 0; pass < 2; ++pass)
+   {
+      auto start = Clock::now();
+      for (auto &name : names)
+      {
+         dns::CacheKey key;
+         dns::CacheEntryInfo info;
+
+         MakeKey(name, key);
+         info.Time = time(nullptr);
+         info.Ttl = 3600;
+         cache.Insert(key, info, payload.data(), payload.size(), &err);
+         if (ERROR_FAILED(&err))
+            Die("cache insert");
+      }
+      (pass ? r.refill : r.fill) = NsPer(start, names.size());
+   }
+
+   auto start = Clock::now();
+   for (auto i : order)
+   {
+      dns::CacheKey key;
+      dns::CacheEntryInfo info;
+
+      MakeKey(names[i], key);
+      if (cache.Lookup(key, out, &info, &err))
+         ++found;
+   }
+   r.hit = NsPer(start, order.size());
+
+   if (found != (int)order.size())
+      fprintf(stderr, "native: %d of %d lookups missed\n", (int)order.size() - found, (int)order.size());
+
+   return r;
+}
+
+class Sqlite
+{
+public:
+   Sqlite(bool reuse_) : db(nullptr), reuse(reuse_), select(nullptr), remove(nullptr), insert(nullptr)
+   {
+      static const char *schema[] =
+      {
+         "create table dns_cache("
+            "name STRING,"
+            "queried_type INTEGER,"
+            "queried_class INTEGER,"
+            "response_code INTEGER,"
+            "response_time INTEGER,"
+            "response_ttl INTEGER,"
+            "response_type INTEGER,"
+            "response_class INTEGER,"
+            "response BLOB"
+         ")",
+         "create index cache_by_string on dns_cache(name, response_type)",
+      };
+
+      if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+         Die("sqlite3_open_v2", db);
+      for (auto sql : schema)
+      {
+         if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK)
+            Die("schema", db);
+      }
+   }
+
+   Sqlite(const Sqlite&) = delete;
+
+   ~Sqlite()
+   {
+      sqlite3_finalize(select);
+      sqlite3_finalize(remove);
+      sqlite3_finalize(insert);
+      sqlite3_close(db);
+   }
+
+   void
+   Fill(const std::string &host, int answers)
+   {
+      int64_t now = time(nullptr);
+
+      Bind(Statement(remove, "DELETE FROM dns_cache WHERE name = ? AND queried_type = ? AND queried_class = ?"), host);
+      Step(remove);
+      Done(remove);
+
+      for (int i = 0; i < answers; ++i)
+      {
+         unsigned char addr[] = {10, 0, 0, (unsigned char)(i + 1)};
+
+         Bind(Statement(insert, "INSERT INTO dns_cache VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)"), host);
+         sqlite3_bind_int64(insert, 4, 0);
+         sqlite3_bind_int64(insert, 5, now);
+         sqlite3_bind_int64(insert, 6, 3600);
+         sqlite3_bind_int64(insert, 7, (int64_t)dns::Type::A);
+         sqlite3_bind_int64(insert, 8, (int64_t)dns::Class::IN);
+         sqlite3_bind_blob(insert, 9, addr, sizeof(addr), SQLITE_TRANSIENT);
+         Step(insert);
+         Done(insert);
+      }
+   }
+
+   // Returns the number of answers.
+   //
+   int
+   Lookup(const std::string &host, std::vector<char> &blob)
+   {
+      int rows = 0;
+
+      Bind(
+         Statement(
+            select,
+            "SELECT response_code, response_type, response_class, response_time, response_ttl, response "
+                    "FROM dns_cache "
+                    "WHERE name = ? AND queried_type = ? AND queried_class = ?"
+         ),
+         host
+      );
+
+      while (Step(select))
+      {
+         volatile int64_t rc = sqlite3_column_int64(select, 0);
+         volatile int64_t type = sqlite3_column_int64(select, 1);
+         volatile int64_t class_ = sqlite3_column_int64(select, 2);
+         volatile int64_t time = sqlite3_column_int64(select, 3);
+         volatile int64_t ttl = sqlite3_column_int64(select, 4);
+         auto p = (const char*)sqlite3_column_blob(select, 5);
+
+         (void)rc; (void)type; (void)class_; (void)time; (void)ttl;
+         blob.assign(p, p + sqlite3_column_bytes(select, 5));
+         ++rows;
+      }
+      Done(select);
+
+      return rows;
+   }
+
+private:
+   sqlite3 *db;
+   bool reuse;
+   sqlite3_stmt *select, *remove, *insert;
+
+   sqlite3_stmt *
+   Statement(sqlite3_stmt *&stmt, const char *sql)
+   {
+      if (!stmt && sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+         Die("sqlite3_prepare_v2", db);
+      return stmt;
+   }
+
+   void
+   Bind(sqlite3_stmt *stmt, const std::string &host)
+   {
+      sqlite3_bind_text(stmt, 1, host.data(), host.size(), SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 2, (int64_t)dns::Type::A);
+      sqlite3_bind_int64(stmt, 3, (int64_t)dns::Class::IN);
+   }
+
+   bool
+   Step(sqlite3_stmt *stmt)
+   {
+      switch (sqlite3_step(stmt))
+      {
+      case SQLITE_ROW:
+         return true;
+      case SQLITE_DONE:
+         return false;
+      default:
+         Die("sqlite3_step", db);
+         return false;
+      }
+   }
+
+   // Finished with the statement: reset it for next time, or throw it
+   // away as the server did.
+   //
+   void
+   Done(sqlite3_stmt *&stmt)
+   {
+      if (reuse)
+      {
+         sqlite3_reset(stmt);
+         sqlite3_clear_bindings(stmt);
+      }
+      else
+      {
+         sqlite3_finalize(stmt);
+         stmt = nullptr;
+      }
+   }
+};
+
+Result
+RunSqlite(const Options &opts, bool reuse, const std::vector<Name> &names, const std::vector<size_t> &order)
+{
+   Sqlite db(reuse);
+   std::vector<char> blob;
+   Result r;
+   int found = 0;
+
+   for (int pass = 0; pass < 2; ++pass)
+   {
+      auto start = Clock::now();
+      for (auto &name : names)
+         db.Fill(name.host, opts.answers);
+      (pass ? r.refill : r.fill) = NsPer(start, names.size());
+   }
+
+   auto start = Clock::now();
+   for (auto i : order)
+   {
+      if (db.Lookup(names[i].host, blob) == opts.answers)
+         ++found;
+   }
+   r.hit = NsPer(start, order.size());
+
+   if (found != (int)order.size())
+      fprintf(stderr, "sqlite: %d of %d lookups missed\n", (int)order.size() - found, (int)order.size());
+
+   return r;
+}
+
+void
+Print(const char *name, const Result &r)
+{
+   printf("%-22s %12.0f %12.0f %12.0f\n", name, r.fill, r.refill, r.hit);
+}
+
+} // end namespace
+
+int
+main(int argc, char **argv)
+{
+   Options opts;
+   int ch;
+
+   while ((ch = getopt(argc, argv, "n:a:l:")) != -1)
+   {
+      switch (ch)
+      {
+      case 'n': opts.names = atoi(optarg); break;
+      case 'a': opts.answers = atoi(optarg); break;
+      case 'l': opts.lookups = atoi(optarg); break;
+      default:
+         fprintf(stderr, "usage: %s [-n names] [-a answers per name] [-l lookups]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (opts.names < 1 || opts.answers < 1 || opts.answers > 100 || opts.lookups < 1)
+   {
+      fprintf(stderr, "names and lookups must be positive, and answers from 1 to 100\n");
+      return 1;
+   }
+
+   auto names = MakeNames(opts.names);
+   std::vector<size_t> order(opts.lookups);
+   std::mt19937_64 rng(1);
+
+   for (auto &i : order)
+      i = rng() % names.size();
+
+   printf("%d names, %d answers each, %d lookups\n", opts.names, opts.answers, opts.lookups);
+   printf("%-22s %12s %12s %12s\n", "ns per op", "fill", "refill", "hit");
+
+   Result native = RunNative(opts, names, order);
+   Print("native", native);
+
+   Result once = RunSqlite(opts, true, names, order);
+   Print("sqlite, prepared once", once);
+
+   Result each = RunSqlite(opts, false, names, order);
+   Print("sqlite, as the server", each);
+
+   printf(
+      "%-22s %12.1f %12.1f %12.1f\n",
+      "as the server / native",
+      each.fill / native.fill,
+      each.refill / native.refill,
+      each.hit / native.hit
+   );
+
+   return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+//
+// UDP load generator, for measuring how queries per second scale with the
+// "workers" setting, or how "io-uring" compares with poll.
+//
+// It first asks for every name once and waits for each answer, so that
+// what follows is all cache hits.  Then each thread keeps a window of
+// queries in flight against the server for the given time, over its own
+// socket, and the answers are counted.
+//
+// The server needs a forwarder that answers for the made-up names.  With
+// -U, this program is one: it answers every A query on port 53 of the
+// given address.  The server binds port 53 on every address, so run the
+// two in different network namespaces, for example:
+//
+//    ip netns add dnsup
+//    ip link add veth0 type veth peer name veth1 netns dnsup
+//    ip addr add 10.53.0.1/24 dev veth0; ip link set veth0 up
+//    ip netns exec dnsup ip addr add 10.53.0.2/24 dev veth1
+//    ip netns exec dnsup ip link set veth1 up
+//    ip netns exec dnsup bench/dnsload -U 10.53.0.2 &
+//
+// then, with "nameserver dns 10.53.0.2" and "workers N" in dns.conf next
+// to the binary:
+//
+//    ./dns &
+//    bench/dnsload -s 127.0.0.1 -t 8 -d 10
+//
+// Only the warm-up goes upstream, so the veth pair doesn't figure in the
+// result.  Give the load generator its own cores (taskset) when measuring
+// scaling, or it competes with the workers it is measuring.
+//
+// Scaling with workers 1, 2, 4 and 8 has not been measured yet.  So far
+// this has only been run against its own -U responder, on a one-CPU
+// machine, which checks the load generator and nothing about the server.
+//
+// Usage: bench/dnsload [-s server] [-t threads] [-n names] [-w window]
+//                      [-d seconds]
+//        bench/dnsload -U address
+//
+
+#include <dnsmsg.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Options
+{
+   const char *server;
+   const char *upstream;
+   int threads;
+   int names;
+   int window;
+   int seconds;
+
+   Options()
+      : server("127.0.0.1"),
+        upstream(nullptr),
+        threads(4),
+        names(10000),
+        window(64),
+        seconds(10)
+   {
+   }
+};
+
+struct Totals
+{
+   std::atomic<uint64_t> answers;
+   std::atomic<uint64_t> errors;      // answers other than NOERROR
+   std::atomic<uint64_t> lost;        // still outstanding at a timeout
+
+   Totals() : answers(0), errors(0), lost(0) {}
+};
+
+void
+Die(const char *what)
+{
+   perror(what);
+   exit(1);
+}
+
+int
+Socket(const char *host, bool bindIt, int timeoutMs)
+{
+   struct sockaddr_in addr;
+   struct timeval tv;
+   int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+   if (fd < 0)
+      Die("socket");
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(53);
+   if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+   {
+      fprintf(stderr, "bad address: %s\n", host);
+      exit(1);
+   }
+
+   if (bindIt ? bind(fd, (struct sockaddr*)&addr, sizeof(addr))
+              : connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+   {
+      Die(bindIt ? "bind" : "connect");
+   }
+
+   tv.tv_sec = timeoutMs / 1000;
+   tv.tv_usec = (timeoutMs % 1000) * 1000;
+   if (timeoutMs && setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+      Die("setsockopt");
+
+   return fd;
+}
+
+// hostN.bench.example, type A.
+//
+std::vector<std::string>
+MakeQueries(int n)
+{
+   std::vector<std::string> r;
+
+   for (int i = 0; i < n; ++i)
+   {
+      error err;
+      dns::MessageWriter writer;
+      char buf[512];
+
+      writer.Header->RecursionDesired = 1;
+      auto q = writer.AddQuestion(&err);
+      if (!ERROR_FAILED(&err))
+      {
+         q->Name = "host" + std::to_string(i) + ".bench.example";
+         q->Attrs->Type.Put((uint16_t)dns::Type::A);
+         q->Attrs->Class.Put((uint16_t)dns::Class::IN);
+      }
+      size_t len = ERROR_FAILED(&err) ? 0 : writer.Serialize(buf, sizeof(buf), &err);
+      if (ERROR_FAILED(&err))
+      {
+         fprintf(stderr, "could not build query\n");
+         exit(1);
+      }
+      r.emplace_back(buf, len);
+   }
+
+   return r;
+}
+
+void
+Count(const char *buf, ssize_t len, Totals &totals)
+{
+   auto hdr = (const dns::MessageHeader*)buf;
+
+   if (len < (ssize_t)sizeof(*hdr))
+      return;
+   ++totals.answers;
+   if (hdr->ResponseCode)
+      ++totals.errors;
+}
+
+// Ask for every name until each has been answered once.
+//
+void
+Warm(const Options &opts, const std::vector<std::string> &queries)
+{
+   int fd = Socket(opts.server, false, 2000);
+   char buf[4096];
+
+   for (size_t i = 0; i < queries.size(); ++i)
+   {
+      int tries = 0;
+
+      for (;;)
+      {
+         if (send(fd, queries[i].data(), queries[i].size(), 0) < 0)
+            Die("send");
+         if (recv(fd, buf, sizeof(buf), 0) >= (ssize_t)sizeof(dns::MessageHeader))
+            break;
+         if (++tries == 5)
+         {
+            fprintf(stderr, "no answer from %s; is it forwarding to a -U instance?\n", opts.server);
+            exit(1);
+         }
+      }
+   }
+
+   close(fd);
+}
+
+void
+Load(
+   const Options &opts,
+   const std::vector<std::string> &queries,
+   int seed,
+   const std::atomic<bool> &stop,
+   Totals &totals
+)
+{
+   int fd = Socket(opts.server, false, 200);
+   uint32_t next = seed * 2654435761U;
+   int outstanding = 0;
+   char buf[4096];
+
+   while (!stop.load(std::memory_order_relaxed))
+   {
+      while (outstanding < opts.window)
+      {
+         auto &q = queries[next++ % queries.size()];
+         char out[512];
+
+         // A fresh ID each time, so the server never takes one for a
+         // retransmit of another.
+         //
+         memcpy(out, q.data(), q.size());
+         out[0] = next >> 8;
+         out[1] = next;
+         if (send(fd, out, q.size(), 0) < 0)
+            break;
+         ++outstanding;
+      }
+
+      ssize_t r = recv(fd, buf, sizeof(buf), 0);
+      if (r < 0)
+      {
+         // Timed out; whatever hasn't come back isn't coming.
+         //
+         totals.lost += outstanding;
+         outstanding = 0;
+         continue;
+      }
+      Count(buf, r, totals);
+      --outstanding;
+   }
+
+   close(fd);
+}
+
+// Answers every query with one A record, good for a day.
+//
+void
+Upstream(const char *host)
+{
+   int fd = Socket(host, true, 0);
+   char buf[4096];
+   static const unsigned char answer[] =
+   {
+      0xc0, 0x0c,                   // the question's name
+      0x00, 0x01, 0x00, 0x01,       // A, IN
+      0x00, 0x01, 0x51, 0x80,       // 86400
+      0x00, 0x04,
+   };
+
+   fprintf(stderr, "answering on %s port 53\n", host);
+
+   for (;;)
+   {
+      struct sockaddr_storage from;
+      socklen_t fromLen = sizeof(from);
+      ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromLen);
+      dns::MessageView msg;
+      error err;
+
+      if (n < 0)
+         continue;
+
+      dns::ParseMessage(buf, n, &msg, &err);
+      if (ERROR_FAILED(&err) || msg.Header->Response || msg.QuestionCount != 1)
+         continue;
+
+      // Drop the OPT record, which is the only thing after the question
+      // in what the server sends.
+      //
+      size_t len = dns::TrailingOpt(buf, n, msg);
+      if (len != (size_t)n)
+         msg.Header->AdditionalRecordCount.Put(0);
+      if (len + sizeof(answer) + 4 > sizeof(buf))
+         continue;
+
+      msg.Header->Response = 1;
+      msg.Header->RecursionAvailable = 1;
+      msg.Header->AnswerCount.Put(1);
+      memcpy(buf + len, answer, sizeof(answer));
+      len += sizeof(answer);
+
+      // 10.x.y.z, from the query ID, so answers differ.
+      //
+      buf[len++] = 10;
+      buf[len++] = 0;
+      memcpy(buf + len, buf, 2);
+      len += 2;
+
+      sendto(fd, buf, len, 0, (struct sockaddr*)&from, fromLen);
+   }
+}
+
+} // end namespace
+
+int
+main(int argc, char **argv)
+{
+   Options opts;
+   Totals totals;
+   std::atomic<bool> stop(false);
+   std::vector<std::thread> threads;
+   int ch;
+
+   while ((ch = getopt(argc, argv, "s:t:n:w:d:U:")) != -1)
+   {
+      switch (ch)
+      {
+      case 's': opts.server = optarg; break;
+      case 't': opts.threads = atoi(optarg); break;
+      case 'n': opts.names = atoi(optarg); break;
+      case 'w': opts.window = atoi(optarg); break;
+      case 'd': opts.seconds = atoi(optarg); break;
+      case 'U': opts.upstream = optarg; break;
+      default:
+         fprintf(stderr, "usage: %s [-s server] [-t threads] [-n names] [-w window] [-d seconds]\n", argv[0]);
+         fprintf(stderr, "       %s -U address\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (opts.upstream)
+   {
+      Upstream(opts.upstream);
+      return 0;
+   }
+
+   if (opts.threads < 1 || opts.names < 1 || opts.window < 1 || opts.seconds < 1)
+   {
+      fprintf(stderr, "threads, names, window and seconds must be positive\n");
+      return 1;
+   }
+
+   auto queries = MakeQueries(opts.names);
+   Warm(opts, queries);
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (int i = 0; i < opts.threads; ++i)
+      threads.emplace_back([&, i] { Load(opts, queries, i + 1, stop, totals); });
+
+   std::this_thread::sleep_for(std::chrono::seconds(opts.seconds));
+   stop = true;
+   for (auto &t : threads)
+      t.join();
+
+   std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+   printf(
+      "%d threads, window %d, %d names: %.0f qps (%llu answers, %llu not NOERROR, %llu lost) in %.1f s\n",
+      opts.threads,
+      opts.window,
+      opts.names,
+      totals.answers / elapsed.count(),
+      (unsigned long long)totals.answers,
+      (unsigned long long)totals.errors,
+      (unsigned long long)totals.lost,
+      elapsed.count()
+   );
+
+   return 0;
+}
@@ -0,0 +1,300 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+//
+// The name kernels, each version the CPU can run, over a mix of name
+// lengths like that of real queries: mostly 12 to 64 bytes in wire
+// format, with a tail of long names up to the 255-byte limit.
+//
+// Before timing, every version is checked against a byte-at-a-time
+// reference, at every length up to 255 and at unaligned offsets:
+// folding must lowercase A-Z and leave every other byte alone, the hash
+// must match the plain version's and not depend on case, and comparison
+// must agree with folding both sides.  A mismatch is reported and the
+// exit status is non-zero.
+//
+// Usage: bench/namekernel [-n names] [-r rounds] [-t percent long names]
+//
+
+#include <dnsname.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options
+{
+   int names;
+   int rounds;
+   int tail;         // percent of names longer than 64 bytes
+
+   Options() : names(4096), rounds(500), tail(5) {}
+};
+
+struct Variant
+{
+   const char *name;
+   dns::internal::NameKernelLevel level;
+};
+
+const Variant Variants[] =
+{
+   {"scalar", dns::internal::NameKernelScalar},
+   {"sse2", dns::internal::NameKernelSse2},
+   {"avx2", dns::internal::NameKernelAvx2},
+};
+
+const size_t MaxName = 255;
+
+typedef std::chrono::steady_clock Clock;
+
+char
+FoldByte(char c)
+{
+   return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+char
+SwapCase(char c)
+{
+   if (c >= 'A' && c <= 'Z')
+      return c + ('a' - 'A');
+   if (c >= 'a' && c <= 'z')
+      return c - ('a' - 'A');
+   return c;
+}
+
+// A name in wire format: labels of letters in either case, digits and
+// hyphens, n bytes in all.
+//
+std::string
+MakeName(std::mt19937_64 &rng, size_t n)
+{
+   static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-";
+   std::string r;
+
+   while (r.size() + 1 < n)
+   {
+      size_t label = 1 + rng() % 20;
+      if (label > 63)
+         label = 63;
+      if (r.size() + 1 + label + 1 > n)
+         label = n - r.size() - 2;
+      if (!label)
+         break;
+      r.push_back(label);
+      for (size_t i = 0; i < label; ++i)
+         r.push_back(chars[rng() % (sizeof(chars) - 1)]);
+   }
+   r.resize(n - 1, 'x');
+   r.push_back(0);
+   return r;
+}
+
+size_t
+PickLength(std::mt19937_64 &rng, const Options &opts)
+{
+   if ((int)(rng() % 100) < opts.tail)
+      return 65 + rng() % (MaxName - 64);
+   return 12 + rng() % 53;
+}
+
+// Every length, every byte value, at offsets 0 to 3.
+//
+bool
+Check(const Variant &v, const dns::internal::NameKernels &k, const dns::internal::NameKernels &plain)
+{
+   std::mt19937_64 rng(7);
+   std::vector<char> in(MaxName + 8), out(MaxName + 8), ref(MaxName + 8), other(MaxName + 8);
+   bool ok = true;
+
+   for (size_t n = 1; n <= MaxName && ok; ++n)
+   {
+      for (int trial = 0; trial < 64 && ok; ++trial)
+      {
+         size_t off = trial % 4;
+         char *a = in.data() + off;
+
+         if (trial & 1)
+         {
+            for (size_t i = 0; i < n; ++i)
+               a[i] = (char)rng();
+         }
+         else
+         {
+            memcpy(a, MakeName(rng, n).data(), n);
+         }
+         for (size_t i = 0; i < n; ++i)
+            ref[i] = FoldByte(a[i]);
+
+         uint64_t h = k.Fold(a, out.data() + off, n, true);
+         if (memcmp(out.data() + off, ref.data(), n))
+         {
+            fprintf(stderr, "%s: fold wrong at length %zu\n", v.name, n);
+            ok = false;
+         }
+
+         uint64_t hPlain = plain.Fold(a, other.data(), n, true);
+         if (h != hPlain)
+         {
+            fprintf(stderr, "%s: hash differs from scalar at length %zu\n", v.name, n);
+            ok = false;
+         }
+
+         // The other case of every letter, and the same hash.
+         //
+         for (size_t i = 0; i < n; ++i)
+            other[i] = SwapCase(a[i]);
+         if (k.Fold(other.data(), out.data(), n, true) != h)
+         {
+            fprintf(stderr, "%s: hash depends on case at length %zu\n", v.name, n);
+            ok = false;
+         }
+         if (!k.Equals(a, other.data(), n))
+         {
+            fprintf(stderr, "%s: unequal ignoring case at length %zu\n", v.name, n);
+            ok = false;
+         }
+
+         // Change one byte; it should only still compare equal if folding
+         // makes it so.
+         //
+         size_t pos = rng() % n;
+         other[pos] ^= (char)(1 << (rng() % 8));
+         bool expect = FoldByte(other[pos]) == FoldByte(a[pos]);
+         if (k.Equals(a, other.data(), n) != expect)
+         {
+            fprintf(stderr, "%s: comparison wrong at length %zu, byte %zu\n", v.name, n, pos);
+            ok = false;
+         }
+      }
+   }
+
+   return ok;
+}
+
+double
+NsPerName(Clock::time_point start, size_t n)
+{
+   std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+   return elapsed.count() / n;
+}
+
+} // end namespace
+
+int
+main(int argc, char **argv)
+{
+   Options opts;
+   dns::internal::NameKernels plain;
+   std::mt19937_64 rng(1);
+   std::vector<std::string> names, upper;
+   size_t bytes = 0;
+   bool ok = true;
+   int ch;
+
+   while ((ch = getopt(argc, argv, "n:r:t:")) != -1)
+   {
+      switch (ch)
+      {
+      case 'n': opts.names = atoi(optarg); break;
+      case 'r': opts.rounds = atoi(optarg); break;
+      case 't': opts.tail = atoi(optarg); break;
+      default:
+         fprintf(stderr, "usage: %s [-n names] [-r rounds] [-t percent long names]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (opts.names < 1 || opts.rounds < 1 || opts.tail < 0 || opts.tail > 100)
+   {
+      fprintf(stderr, "names and rounds must be positive, and the tail a percentage\n");
+      return 1;
+   }
+
+   if (!dns::internal::GetNameKernels(dns::internal::NameKernelScalar, &plain))
+      return 1;
+
+   for (int i = 0; i < opts.names; ++i)
+   {
+      auto name = MakeName(rng, PickLength(rng, opts));
+      std::string up = name;
+
+      for (auto &c : up)
+         c = SwapCase(FoldByte(c));
+      bytes += name.size();
+      names.push_back(name);
+      upper.push_back(up);
+   }
+
+   printf(
+      "%d names, %.1f bytes average, %d%% over 64 bytes, %d rounds\n",
+      opts.names, (double)bytes / names.size(), opts.tail, opts.rounds
+   );
+   printf("%-8s %12s %12s %12s\n", "ns/name", "fold", "fold+hash", "equals");
+
+   for (auto &v : Variants)
+   {
+      dns::internal::NameKernels k;
+      std::vector<char> out(MaxName);
+      volatile uint64_t sink = 0;
+      double fold, hash, equals;
+
+      if (!dns::internal::GetNameKernels(v.level, &k))
+      {
+         printf("%-8s not supported here\n", v.name);
+         continue;
+      }
+      if (!Check(v, k, plain))
+      {
+         ok = false;
+         continue;
+      }
+
+      auto start = Clock::now();
+      for (int r = 0; r < opts.rounds; ++r)
+      {
+         for (auto &name : upper)
+            k.Fold(name.data(), out.data(), name.size(), false);
+         sink = sink + out[0];
+      }
+      fold = NsPerName(start, (size_t)opts.rounds * names.size());
+
+      start = Clock::now();
+      for (int r = 0; r < opts.rounds; ++r)
+      {
+         for (auto &name : upper)
+            sink = sink + k.Fold(name.data(), out.data(), name.size(), true);
+      }
+      hash = NsPerName(start, (size_t)opts.rounds * names.size());
+
+      // Equal names in different cases, so every byte is compared.
+      //
+      start = Clock::now();
+      for (int r = 0; r < opts.rounds; ++r)
+      {
+         for (size_t i = 0; i < names.size(); ++i)
+            sink = sink + k.Equals(names[i].data(), upper[i].data(), names[i].size());
+      }
+      equals = NsPerName(start, (size_t)opts.rounds * names.size());
+
+      printf("%-8s %12.2f %12.2f %12.2f\n", v.name, fold, hash, equals);
+   }
+
+   if (!ok)
+      printf("some versions gave wrong results\n");
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+//
+// Compares how Server::HandleMessage() used to parse a packet, into a
+// MessageView and then again into an arena-backed Message, with what it
+// does now, the view alone.  Reports time per parse, and heap allocations
+// per parse counting both operator new and arena chunks.
+//
+// Usage: bench/parse [iterations]
+//
+
+#include <dnsmsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <new>
+#include <string>
+
+static size_t allocations;
+
+void *
+operator new(size_t n)
+{
+   ++allocations;
+   void *p = malloc(n ? n : 1);
+   if (!p)
+      throw std::bad_alloc();
+   return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+   free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+   free(p);
+}
+
+//
+// A recursive query for www.example.com/A with an OPT record, as a stub
+// resolver sends it.
+//
+static const unsigned char query[] =
+{
+   0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+   3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+   0x00, 0x01, 0x00, 0x01,
+   0x00, 0x00, 0x29, 0x04, 0xd0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+//
+// The answer to it: a CNAME and two addresses, using compression.
+//
+static const unsigned char response[] =
+{
+   0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00,
+   3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+   0x00, 0x01, 0x00, 0x01,
+   0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x07,
+   4, 'e', 'd', 'g', 'e', 0xc0, 0x10,
+   0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+   192, 0, 2, 1,
+   0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+   192, 0, 2, 2,
+};
+
+template <typename Fn>
+static void
+Run(const char *label, size_t iterations, Fn fn)
+{
+   size_t before = allocations + dns::Arena::Counters.BlockMallocs;
+   auto start = std::chrono::steady_clock::now();
+
+   for (size_t i = 0; i < iterations; ++i)
+   {
+      if (!fn())
+      {
+         fprintf(stderr, "%s: parse failed\n", label);
+         exit(1);
+      }
+   }
+
+   std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+   printf(
+      "%-24s %8.1f ns/parse %6.2f allocs/parse\n",
+      label,
+      elapsed.count() / iterations,
+      (double)(allocations + dns::Arena::Counters.BlockMallocs - before) / iterations
+   );
+}
+
+static bool
+ParseOld(const void *buf, size_t len)
+{
+   error err;
+   dns::Arena arena;
+   dns::MessageView view;
+   dns::Message msg(&arena);
+   dns::ParseMessage(buf, len, &view, &err);
+   if (ERROR_FAILED(&err))
+      return false;
+   dns::ParseMessage(buf, len, &msg, &err);
+   return !ERROR_FAILED(&err) && msg.Questions.size() == 1;
+}
+
+//
+// The view, then the question name copied into a DomainName for the cache
+// and request map keys.
+//
+static bool
+ParseView(const void *buf, size_t len)
+{
+   error err;
+   dns::MessageView msg;
+   dns::DomainName name;
+   dns::ParseMessage(buf, len, &msg, &err);
+   return !ERROR_FAILED(&err) &&
+          msg.QuestionCount == 1 &&
+          msg.Questions[0].Name.ToDomainName(&name);
+}
+
+int
+main(int argc, char **argv)
+{
+   size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+
+   if (!iterations)
+      iterations = 1;
+
+   Run("query, view + Message", iterations, [] { return ParseOld(query, sizeof(query)); });
+   Run("query, view", iterations, [] { return ParseView(query, sizeof(query)); });
+   Run("response, view + Message", iterations, [] { return ParseOld(response, sizeof(response)); });
+   Run("response, view", iterations, [] { return ParseView(response, sizeof(response)); });
+
+   return 0;
+}
@@ -0,0 +1,339 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+//
+// RequestMap operations with a given number of requests in flight, 100k
+// by default.  Two kinds of key are tried: clients' queries, from many
+// addresses with random IDs, as udpDeDupe and the upstream response maps
+// see them; and forwardReqs's, with no address and the ID zeroed, so that
+// only the name tells requests apart.
+//
+// The map is filled to the given size, and then with it held there:
+// lookups of requests in it and of ones that aren't; removals, each found
+// by a lookup first as a response would be, alternating with inserts that
+// put the map back; and RequestHandle::Cancel() of requests inserted with
+// handles.  Queries are parsed ahead of each timed chunk, so parsing
+// isn't counted.
+//
+// Usage: bench/reqmap [-n requests] [-c chunk]
+//
+
+#include <dnsmsg.h>
+#include <dnsreqmap.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options
+{
+   int requests;
+   int chunk;
+
+   Options() : requests(100000), chunk(1000) {}
+};
+
+struct Query
+{
+   std::string wire;
+   struct sockaddr_in addr;
+};
+
+struct Result
+{
+   double fill;            // ns per operation
+   double insert;
+   double hit;
+   double miss;
+   double remove;
+   double cancel;
+   bool ok;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+class Timer
+{
+public:
+   Timer() : total(0), ops(0) {}
+
+   void
+   Start() { start = Clock::now(); }
+
+   void
+   Stop(size_t n)
+   {
+      std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+      total += elapsed.count();
+      ops += n;
+   }
+
+   double
+   NsPer() const { return ops ? total / ops : 0; }
+
+private:
+   Clock::time_point start;
+   double total;
+   size_t ops;
+};
+
+// Distinct names, hostN.zoneM.example, for 2n queries: the first n go in
+// the map and the rest are looked up as misses or inserted to replace
+// removals.
+//
+std::vector<Query>
+MakeQueries(int n, bool zeroId)
+{
+   std::vector<Query> r(n);
+   std::mt19937_64 rng(1);
+
+   for (int i = 0; i < n; ++i)
+   {
+      error err;
+      dns::MessageWriter writer;
+      char buf[512];
+      char name[64];
+
+      writer.Header->Id.Put(zeroId ? 0 : (uint16_t)rng());
+      writer.Header->RecursionDesired = 1;
+      auto q = writer.AddQuestion(&err);
+      if (!ERROR_FAILED(&err))
+      {
+         snprintf(name, sizeof(name), "host%d.zone%d.example", i, i % 97);
+         q->Name = name;
+         q->Attrs->Type.Put((uint16_t)dns::Type::A);
+         q->Attrs->Class.Put((uint16_t)dns::Class::IN);
+      }
+      size_t len = ERROR_FAILED(&err) ? 0 : writer.Serialize(buf, sizeof(buf), &err);
+      if (ERROR_FAILED(&err))
+      {
+         fprintf(stderr, "could not build query\n");
+         exit(1);
+      }
+      r[i].wire.assign(buf, len);
+
+      memset(&r[i].addr, 0, sizeof(r[i].addr));
+      r[i].addr.sin_family = AF_INET;
+      r[i].addr.sin_addr.s_addr = htonl(0x0a000000 + rng() % 5000);
+      r[i].addr.sin_port = htons(1024 + rng() % 60000);
+   }
+
+   return r;
+}
+
+class Bench
+{
+public:
+   Bench(const Options &opts_, bool zeroId_)
+      : opts(opts_),
+        zeroId(zeroId_),
+        map(zeroId_),
+        queries(MakeQueries(opts_.requests * 2, zeroId_)),
+        views(opts_.chunk),
+        handles(opts_.chunk)
+   {
+   }
+
+   Result
+   Run()
+   {
+      Timer fill, insert, hit, miss, remove, cancel;
+      std::mt19937_64 rng(2);
+      Result r;
+      int n = opts.requests;
+      int found = 0, missed = 0;
+
+      r.ok = true;
+
+      for (int i = 0; i < n; i += opts.chunk)
+      {
+         int count = Parse(Range(i, n));
+         fill.Start();
+         for (int j = 0; j < count; ++j)
+            Insert(i + j, j, nullptr);
+         fill.Stop(count);
+      }
+
+      for (int i = 0; i < n; i += opts.chunk)
+      {
+         picks.resize(std::min(opts.chunk, n - i));
+         for (auto &p : picks)
+            p = rng() % n;
+         int count = Parse(picks);
+         hit.Start();
+         for (int j = 0; j < count; ++j)
+            found += map.Lookup(Addr(picks[j]), views[j]) != nullptr;
+         hit.Stop(count);
+      }
+
+      for (int i = n; i < 2 * n; i += opts.chunk)
+      {
+         int count = Parse(Range(i, 2 * n));
+         miss.Start();
+         for (int j = 0; j < count; ++j)
+            missed += map.Lookup(Addr(i + j), views[j]) != nullptr;
+         miss.Stop(count);
+      }
+
+      // Swap each chunk of the first n out for the matching one of the
+      // second, which keeps the map within a chunk of n.
+      //
+      for (int i = 0; i < n; i += opts.chunk)
+      {
+         int count = Parse(Range(i, n));
+         remove.Start();
+         for (int j = 0; j < count; ++j)
+         {
+            size_t idx = 0;
+            if (map.Lookup(Addr(i + j), views[j], &idx))
+               map.Remove(idx);
+            else
+               r.ok = false;
+         }
+         remove.Stop(count);
+
+         count = Parse(Range(n + i, 2 * n));
+         insert.Start();
+         for (int j = 0; j < count; ++j)
+            Insert(n + i + j, j, nullptr);
+         insert.Stop(count);
+      }
+
+      for (int i = 0; i < n; i += opts.chunk)
+      {
+         int count = Parse(Range(i, n));
+         for (int j = 0; j < count; ++j)
+            Insert(i + j, j, &handles[j]);
+         cancel.Start();
+         for (int j = 0; j < count; ++j)
+            handles[j].Cancel();
+         cancel.Stop(count);
+      }
+
+      r.fill = fill.NsPer();
+      r.insert = insert.NsPer();
+      r.hit = hit.NsPer();
+      r.miss = miss.NsPer();
+      r.remove = remove.NsPer();
+      r.cancel = cancel.NsPer();
+      r.ok = r.ok && found == n && !missed && map.Size() == (size_t)n;
+      return r;
+   }
+
+private:
+   const Options &opts;
+   bool zeroId;
+   dns::RequestMap<int> map;
+   std::vector<Query> queries;
+   std::vector<dns::MessageView> views;
+   std::vector<dns::RequestHandle> handles;
+   std::vector<int> picks;
+
+   std::vector<int>
+   Range(int start, int end)
+   {
+      std::vector<int> r;
+      for (int i = start; i < end && i - start < opts.chunk; ++i)
+         r.push_back(i);
+      return r;
+   }
+
+   int
+   Parse(const std::vector<int> &which)
+   {
+      for (size_t j = 0; j < which.size(); ++j)
+      {
+         auto &q = queries[which[j]];
+         error err;
+
+         views[j] = dns::MessageView();
+         dns::ParseMessage(&q.wire[0], q.wire.size(), &views[j], &err);
+         if (ERROR_FAILED(&err))
+         {
+            fprintf(stderr, "could not parse query\n");
+            exit(1);
+         }
+      }
+      return which.size();
+   }
+
+   const struct sockaddr *
+   Addr(int i) { return zeroId ? nullptr : (const struct sockaddr*)&queries[i].addr; }
+
+   void
+   Insert(int i, int view, dns::RequestHandle *handle)
+   {
+      error err;
+
+      map.Insert(Addr(i), views[view], i, handle, &err);
+      if (ERROR_FAILED(&err))
+      {
+         fprintf(stderr, "insert failed\n");
+         exit(1);
+      }
+   }
+};
+
+void
+Print(const char *name, const Result &r)
+{
+   printf(
+      "%-10s %8.0f %8.0f %8.0f %8.0f %8.0f %8.0f%s\n",
+      name, r.fill, r.insert, r.hit, r.miss, r.remove, r.cancel,
+      r.ok ? "" : "  (wrong results)"
+   );
+}
+
+} // end namespace
+
+int
+main(int argc, char **argv)
+{
+   Options opts;
+   int ch;
+
+   while ((ch = getopt(argc, argv, "n:c:")) != -1)
+   {
+      switch (ch)
+      {
+      case 'n': opts.requests = atoi(optarg); break;
+      case 'c': opts.chunk = atoi(optarg); break;
+      default:
+         fprintf(stderr, "usage: %s [-n requests] [-c chunk]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (opts.requests < 1 || opts.chunk < 1)
+   {
+      fprintf(stderr, "requests and chunk must be positive\n");
+      return 1;
+   }
+
+   printf("%d requests in flight, ns per operation\n", opts.requests);
+   printf("%-10s %8s %8s %8s %8s %8s %8s\n", "", "fill", "insert", "hit", "miss", "remove", "cancel");
+
+   Result random = Bench(opts, false).Run();
+   Print("random id", random);
+
+   Result zero = Bench(opts, true).Run();
+   Print("zero id", zero);
+
+   return random.ok && zero.ok ? 0 : 1;
+}
@@ -0,0 +1,305 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+//
+// Datagrams per second through a UdpSocket echoing on loopback, served
+// first the ordinary way, with epoll on the socket and recvmmsg() and
+// sendmmsg() per wakeup, then through a UdpRing, with epoll on the ring's
+// descriptor.  The echo loop is the listener's: a batch per wakeup,
+// receiving until nothing is left and sending everything at the end.
+//
+// Client threads each keep a window of DNS-sized datagrams in flight over
+// their own socket.  Everything shares the machine, so pin the echo
+// thread away from the clients (taskset, -c) when there are cores enough
+// for the difference in system calls to show rather than be hidden by
+// the clients competing for the same CPU.
+//
+// Usage: bench/udpecho [-t client threads] [-w window] [-l length]
+//                      [-d seconds] [-c echo cpu]
+//
+
+#include <dnsudp.h>
+#include <dnsuring.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Options
+{
+   int threads;
+   int window;
+   int length;
+   int seconds;
+   int cpu;
+
+   Options() : threads(2), window(64), length(40), seconds(5), cpu(-1) {}
+};
+
+struct Result
+{
+   double rate;
+   uint64_t wakeups;
+   uint64_t in;
+   uint64_t reads;
+   uint64_t out;
+   uint64_t writes;
+};
+
+void
+Die(const char *what)
+{
+   perror(what);
+   exit(1);
+}
+
+int
+BoundSocket(struct sockaddr_in &addr)
+{
+   socklen_t len = sizeof(addr);
+   int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+   if (fd < 0)
+      Die("socket");
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+       getsockname(fd, (struct sockaddr*)&addr, &len))
+   {
+      Die("bind");
+   }
+
+   return fd;
+}
+
+void
+Echo(dns::UdpSocket &sock, int wakeFd, int cpu, const std::atomic<bool> &stop, uint64_t &wakeups)
+{
+   struct epoll_event ev;
+   int ep = epoll_create1(0);
+
+   if (cpu >= 0)
+   {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      sched_setaffinity(0, sizeof(set), &set);
+   }
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, wakeFd, &ev))
+      Die("epoll");
+
+   while (!stop.load(std::memory_order_relaxed))
+   {
+      error err;
+      size_t n = 0;
+
+      if (epoll_wait(ep, &ev, 1, 100) <= 0)
+         continue;
+      ++wakeups;
+
+      sock.BeginBatch();
+      while ((n = sock.Receive(&err)) > 0)
+      {
+         for (size_t i = 0; i < n; ++i)
+         {
+            auto &d = sock.Received()[i];
+            auto addr = d.addr;
+            sock.Send(&addr.sa, d.data, d.len, &err);
+         }
+      }
+      error_clear(&err);
+      sock.EndBatch(&err);
+   }
+
+   close(ep);
+}
+
+void
+Client(
+   const Options &opts,
+   const struct sockaddr_in &server,
+   const std::atomic<bool> &stop,
+   std::atomic<uint64_t> &total
+)
+{
+   struct sockaddr_in addr;
+   struct timeval tv;
+   int fd = BoundSocket(addr);
+   int outstanding = 0;
+   uint64_t echoed = 0;
+   std::vector<char> buf(opts.length);
+   char in[4096];
+
+   tv.tv_sec = 0;
+   tv.tv_usec = 100000;
+   if (connect(fd, (const struct sockaddr*)&server, sizeof(server)) ||
+       setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+   {
+      Die("client socket");
+   }
+
+   while (!stop.load(std::memory_order_relaxed))
+   {
+      while (outstanding < opts.window)
+      {
+         if (send(fd, buf.data(), buf.size(), 0) < 0)
+            break;
+         ++outstanding;
+      }
+
+      if (recv(fd, in, sizeof(in), 0) < 0)
+      {
+         // Timed out; the rest were dropped somewhere.
+         //
+         outstanding = 0;
+         continue;
+      }
+      ++echoed;
+      --outstanding;
+   }
+
+   total += echoed;
+   close(fd);
+}
+
+bool
+Run(const Options &opts, bool ring, Result &result)
+{
+   struct sockaddr_in addr;
+   auto fd = std::make_shared<common::SocketHandle>();
+   dns::UdpSocket sock;
+   std::atomic<bool> stop(false);
+   std::atomic<uint64_t> total(0);
+   std::vector<std::thread> clients;
+   uint64_t wakeups = 0;
+   int wakeFd = -1;
+   error err;
+
+   *fd = BoundSocket(addr);
+   if (fcntl(fd->Get(), F_SETFL, O_NONBLOCK))
+      Die("fcntl");
+   sock.Fd = fd;
+   wakeFd = fd->Get();
+
+   if (ring)
+   {
+      sock.Ring = std::make_shared<dns::UdpRing>();
+      sock.Ring->Start(fd, &err);
+      if (ERROR_FAILED(&err))
+         return false;
+      wakeFd = sock.Ring->Fd()->Get();
+   }
+
+   std::thread echo([&] { Echo(sock, wakeFd, opts.cpu, stop, wakeups); });
+   auto start = std::chrono::steady_clock::now();
+
+   for (int i = 0; i < opts.threads; ++i)
+      clients.emplace_back([&] { Client(opts, addr, stop, total); });
+
+   std::this_thread::sleep_for(std::chrono::seconds(opts.seconds));
+   stop = true;
+   for (auto &t : clients)
+      t.join();
+   echo.join();
+
+   std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+   result.rate = total / elapsed.count();
+   result.wakeups = wakeups;
+   result.in = sock.Counters.DatagramsIn;
+   result.reads = sock.Counters.Reads;
+   result.out = sock.Counters.DatagramsOut;
+   result.writes = sock.Counters.Writes;
+   return true;
+}
+
+void
+Print(const char *name, const Result &r)
+{
+   printf(
+      "%-8s %12.0f %12.1f %12.1f %12.1f\n",
+      name,
+      r.rate,
+      r.wakeups ? (double)r.in / r.wakeups : 0.0,
+      r.reads ? (double)r.in / r.reads : 0.0,
+      r.writes ? (double)r.out / r.writes : 0.0
+   );
+}
+
+} // end namespace
+
+int
+main(int argc, char **argv)
+{
+   Options opts;
+   Result poll, uring;
+   int ch;
+
+   while ((ch = getopt(argc, argv, "t:w:l:d:c:")) != -1)
+   {
+      switch (ch)
+      {
+      case 't': opts.threads = atoi(optarg); break;
+      case 'w': opts.window = atoi(optarg); break;
+      case 'l': opts.length = atoi(optarg); break;
+      case 'd': opts.seconds = atoi(optarg); break;
+      case 'c': opts.cpu = atoi(optarg); break;
+      default:
+         fprintf(stderr, "usage: %s [-t threads] [-w window] [-l length] [-d seconds] [-c echo cpu]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (opts.threads < 1 || opts.window < 1 || opts.seconds < 1 ||
+       opts.length < 1 || opts.length > dns::MaxUdpPayload)
+   {
+      fprintf(stderr, "threads, window and seconds must be positive, and length at most %d\n", (int)dns::MaxUdpPayload);
+      return 1;
+   }
+
+   printf(
+      "%d client threads, window %d, %d bytes, %d s per run, %u cpus\n",
+      opts.threads, opts.window, opts.length, opts.seconds,
+      std::thread::hardware_concurrency()
+   );
+   printf("           echoes/s   in/wakeup      in/read     out/send\n");
+
+   Run(opts, false, poll);
+   Print("epoll", poll);
+
+   if (!Run(opts, true, uring))
+   {
+      printf("io_uring unavailable\n");
+      return 0;
+   }
+   Print("io_uring", uring);
+   printf("ratio    %12.2f\n", uring.rate / poll.rate);
+
+   return 0;
+}
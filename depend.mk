@@ -3,23 +3,51 @@
 
 src/config.o: src/config.cc $(LIBCOMMON_ROOT)include/common/c++/linereader.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/refcnt.h include/config.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/main.o: src/main.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/path.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h $(LIBSQLITEWRAPPER_ROOT)include/sqlitewrapper.h include/config.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+src/main.o: src/main.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/path.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/cache.o: src/dns/cache.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/time.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h $(LIBSQLITEWRAPPER_ROOT)include/sqlitewrapper.h ${SQLITE_STATIC_HEADER} include/config.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+src/dns/arena.o: src/dns/arena.cc include/dnsarena.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/forward.o: src/dns/forward.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h $(LIBSQLITEWRAPPER_ROOT)include/sqlitewrapper.h include/config.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+src/dns/cache.o: src/dns/cache.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/time.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsrdata.h include/dnsreqmap.h include/dnsserver.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/localentry.o: src/dns/localentry.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h $(LIBSQLITEWRAPPER_ROOT)include/sqlitewrapper.h include/config.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+src/dns/cachefile.o: src/dns/cachefile.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnscache.h include/dnsepoch.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/parse.o: src/dns/parse.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnsmsg.h include/dnsproto.h
+src/dns/cachepolicy.o: src/dns/cachepolicy.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnscache.h include/dnsepoch.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/reqmap.o: src/dns/reqmap.cc $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h
+src/dns/cachetable.o: src/dns/cachetable.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnscache.h include/dnsepoch.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/server.o: src/dns/server.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h $(LIBSQLITEWRAPPER_ROOT)include/sqlitewrapper.h include/config.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+src/dns/edns.o: src/dns/edns.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnsarena.h include/dnsmsg.h include/dnsname.h include/dnsproto.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/tcp.o: src/dns/tcp.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h $(LIBSQLITEWRAPPER_ROOT)include/sqlitewrapper.h include/config.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+src/dns/epoch.o: src/dns/epoch.cc $(LIBCOMMON_ROOT)include/common/logger.h include/dnsepoch.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/udp.o: src/dns/udp.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h $(LIBSQLITEWRAPPER_ROOT)include/sqlitewrapper.h include/config.h include/dnsmsg.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+src/dns/forward.o: src/dns/forward.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
-src/dns/write.o: src/dns/write.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnsmsg.h include/dnsproto.h
+src/dns/localentry.o: src/dns/localentry.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/mailbox.o: src/dns/mailbox.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h include/dnsmailbox.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/name.o: src/dns/name.cc include/dnsname.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/namekernel.o: src/dns/namekernel.cc include/dnsname.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/parse.o: src/dns/parse.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnsarena.h include/dnsmsg.h include/dnsname.h include/dnsproto.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/rdata.o: src/dns/rdata.cc include/dnsproto.h include/dnsrdata.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/reqmap.o: src/dns/reqmap.cc $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h include/dnsarena.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/server.o: src/dns/server.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/stats.o: src/dns/stats.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h include/dnsudp.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/tcp.o: src/dns/tcp.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/udp.o: src/dns/udp.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h include/dnsudp.h include/dnsuring.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/upstream.o: src/dns/upstream.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h include/dnsudp.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/uring.o: src/dns/uring.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/dnsarena.h include/dnscounter.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsudp.h include/dnsuring.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/workers.o: src/dns/workers.cc $(LIBCOMMON_ROOT)include/common/c++/handle.h $(LIBCOMMON_ROOT)include/common/c++/refcount.h $(LIBCOMMON_ROOT)include/common/c++/stream.h $(LIBCOMMON_ROOT)include/common/crypto/rng.h $(LIBCOMMON_ROOT)include/common/error.h $(LIBCOMMON_ROOT)include/common/logger.h $(LIBCOMMON_ROOT)include/common/misc.h $(LIBCOMMON_ROOT)include/common/mutex.h $(LIBCOMMON_ROOT)include/common/refcnt.h $(LIBCOMMON_ROOT)include/common/size.h $(LIBPOLLSTER_ROOT)include/pollster/filter.h $(LIBPOLLSTER_ROOT)include/pollster/pollster.h $(LIBPOLLSTER_ROOT)include/pollster/sockapi.h $(LIBPOLLSTER_ROOT)include/pollster/socket.h $(LIBPOLLSTER_ROOT)include/pollster/ssl.h include/config.h include/dnsarena.h include/dnscache.h include/dnscounter.h include/dnsepoch.h include/dnsmailbox.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsreqmap.h include/dnsserver.h
+	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
+src/dns/write.o: src/dns/write.cc $(LIBCOMMON_ROOT)include/common/error.h include/dnsarena.h include/dnsmsg.h include/dnsname.h include/dnsproto.h include/dnsrdata.h
 	$(CXX) $(CXXFLAGS) $(CFLAGS) $(LATE_CXXFLAGS) $(LATE_CFLAGS) -c -o $@ $<
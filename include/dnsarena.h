@@ -0,0 +1,207 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnsarena_h_
+#define dnsarena_h_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+namespace dns {
+
+// Only arena chunks and FreeListAllocator blocks are counted.  Names are
+// still std::string and callbacks std::function; what they allocate on
+// the request path isn't seen here.
+//
+struct ArenaCounters
+{
+   uint64_t BlockMallocs;  // chunks and blocks that had to come from the heap
+   uint64_t BlockReuses;   // chunks and blocks recycled from a free list
+};
+
+//
+// Bump-pointer allocator for things that live exactly as long as one
+// request.  Memory comes in fixed-size chunks kept on a free list, and is
+// given back all at once when the arena is reset or destroyed; individual
+// frees do nothing.  Once the free list is warm, a request costs no heap
+// allocations for whatever it puts here.
+//
+// Free lists and counters are per thread, so that workers never contend
+// on them.
+//
+
+class Arena
+{
+public:
+   Arena() : chunks(nullptr), cur(nullptr), end(nullptr) {}
+   Arena(const Arena&) = delete;
+   ~Arena() { Reset(); }
+
+   // Throws std::bad_alloc, like operator new.
+   //
+   void *
+   Allocate(size_t n, size_t align)
+   {
+      auto p = (char*)(((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1));
+      if (!cur || n > (size_t)(end - p))
+         return AllocateSlow(n, align);
+      cur = p + n;
+      return p;
+   }
+
+   void
+   Reset();
+
+   static thread_local ArenaCounters Counters;
+
+private:
+   struct Chunk
+   {
+      Chunk *next;
+      size_t size;
+   };
+
+   enum
+   {
+      ChunkSize = 4096,
+      MaxFreeChunks = 256,
+      HeaderSize = (sizeof(Chunk) + 15) & ~15,
+   };
+
+   Chunk *chunks;
+   char *cur;
+   char *end;
+
+   static thread_local Chunk *freeList;
+   static thread_local size_t freeCount;
+
+   void *
+   AllocateSlow(size_t n, size_t align);
+};
+
+// STL allocator over an Arena.  With no arena it falls back to the heap,
+// so containers that use it still work when default-constructed.
+//
+template<typename T>
+class ArenaAllocator
+{
+public:
+   typedef T value_type;
+
+   ArenaAllocator(Arena *arena = nullptr) : arena(arena) {}
+
+   template<typename U>
+   ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+   T *
+   allocate(size_t n)
+   {
+      if (arena)
+         return (T*)arena->Allocate(n * sizeof(T), alignof(T));
+      return (T*)::operator new(n * sizeof(T));
+   }
+
+   void
+   deallocate(T *p, size_t)
+   {
+      if (!arena)
+         ::operator delete(p);
+   }
+
+   template<typename U>
+   bool
+   operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+
+   template<typename U>
+   bool
+   operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+
+   Arena *arena;
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Recycles single objects of one type through a free list, for state that
+// is created and destroyed with every request.
+//
+template<typename T>
+class FreeListAllocator
+{
+public:
+   typedef T value_type;
+
+   FreeListAllocator() {}
+
+   template<typename U>
+   FreeListAllocator(const FreeListAllocator<U> &) {}
+
+   T *
+   allocate(size_t n)
+   {
+      if (n == 1 && head)
+      {
+         auto p = head;
+         head = head->next;
+         --count;
+         ++Arena::Counters.BlockReuses;
+         return (T*)p;
+      }
+      ++Arena::Counters.BlockMallocs;
+      return (T*)::operator new(n == 1 ? BlockSize : n * sizeof(T));
+   }
+
+   void
+   deallocate(T *p, size_t n)
+   {
+      if (n == 1 && count < MaxFree)
+      {
+         auto node = (Node*)p;
+         node->next = head;
+         head = node;
+         ++count;
+         return;
+      }
+      ::operator delete(p);
+   }
+
+   template<typename U>
+   bool
+   operator==(const FreeListAllocator<U> &) const { return true; }
+
+   template<typename U>
+   bool
+   operator!=(const FreeListAllocator<U> &) const { return false; }
+
+private:
+   struct Node
+   {
+      Node *next;
+   };
+
+   enum
+   {
+      MaxFree = 1024,
+      BlockSize = sizeof(T) > sizeof(Node) ? sizeof(T) : sizeof(Node),
+   };
+
+   static thread_local Node *head;
+   static thread_local size_t count;
+};
+
+template<typename T>
+thread_local typename FreeListAllocator<T>::Node *FreeListAllocator<T>::head = nullptr;
+
+template<typename T>
+thread_local size_t FreeListAllocator<T>::count = 0;
+
+} // end namespace
+
+#endif
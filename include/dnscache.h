@@ -0,0 +1,437 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnscache_h_
+#define dnscache_h_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <common/error.h>
+
+#include "dnsepoch.h"
+
+namespace dns {
+
+enum CacheKind
+{
+   CacheResponse,          // a complete response, keyed on its question
+   CacheRRset,             // one RRset, keyed on its owner name
+
+   // Or'd into a response's kind when its query had DO set, since the
+   // answer then carries DNSSEC records that others didn't ask for.
+   //
+   CacheDnssecOk = 0x80,
+};
+
+struct CacheKey
+{
+   const char *Name;       // already folded to lowercase
+   size_t NameLength;
+   uint16_t Type;
+   uint16_t Class;
+   unsigned char Kind;     // CacheKind
+
+   CacheKey() : Name(nullptr), NameLength(0), Type(0), Class(0), Kind(CacheResponse) {}
+};
+
+struct CacheEntryInfo
+{
+   uint64_t Time;          // when the entry was written
+   uint32_t Ttl;           // seconds after Time at which the entry is stale
+   uint32_t Hits;          // lookups that found the entry, before this one
+   unsigned char ResponseCode;
+   unsigned char Flags;    // CacheFlags
+
+   CacheEntryInfo() : Time(0), Ttl(0), Hits(0), ResponseCode(0), Flags(0) {}
+};
+
+struct CacheStats
+{
+   size_t Entries;
+   size_t Bytes;           // held by live entries; this is what the budget limits
+   size_t Resident;        // allocated for entries, index and sketches
+   size_t Mapped;          // snapshot mapping, backed by the file
+   uint64_t Evictions;
+   uint64_t Rejections;    // inserts refused by the admission policy
+   uint64_t Expirations;   // removed by Sweep()
+};
+
+enum CacheFlags
+{
+   CachePrefetchPending = (1 << 0),   // a refresh has been sent
+   CachePrefetched      = (1 << 1),   // written by a prefetch
+};
+
+//
+// Native answer cache.  Keys hash to one of a fixed number of shards; each
+// shard is an open-addressing table (linear probing) whose slots refer to
+// entries packed into a single contiguous slab.  Replaced or removed
+// entries leave holes in the slab which are reclaimed by compacting the
+// shard once enough of it is dead.
+//
+// Since slots hold offsets rather than pointers, a shard can be written to
+// disk as-is.  Save() writes every shard to a snapshot file, and Map()
+// maps one back in without reading it; lookups that miss the live shards
+// then probe the mapped ones.
+//
+// With a budget set, each shard holds at most its share of that many bytes
+// of live entries.  Admission follows TinyLFU: every lookup is counted in a
+// per-shard count-min sketch, and a new entry that needs room only gets it
+// if it has been asked for more often than a victim chosen from a small
+// random sample of the shard.  Expired entries are always evicted first.
+// Entries in a snapshot mapping are backed by the file and not counted.
+//
+// Live entries are also filed by expiry time on a hashed timing wheel, so
+// that Sweep() can reclaim them in small steps instead of waiting for a
+// lookup or an eviction to run into them.  The wheel holds only hashes;
+// when a bucket comes due, the sweeper probes for each hash and removes
+// whatever entries under it have expired.
+//
+// Every method may be called from any thread.  Lookups take no locks at
+// all.  A shard's live table is published through an atomic pointer, and
+// writers only ever append entries to it, tombstone slots, or replace the
+// whole table, never move anything a reader might be looking at; tables
+// they replace, and snapshot mappings, are freed through Epoch once no
+// lookup can still see them.  Hit counts, flags and the sketches are
+// updated with relaxed atomics, so they may occasionally lose a count.
+//
+// Writers take the lock of the shard they change, so refreshing a name
+// only holds up writes to its own shard.  The wheel has a lock of its
+// own, which Sweep() holds while it takes shard locks, never the other
+// way round.  SetBudget() must be called before other threads use the
+// cache.  Sweep() must be called from one thread at a time, and so must
+// Save() and Map(), though a save can run alongside a sweep.
+//
+
+class Cache
+{
+public:
+   Cache()
+      : mapping(nullptr),
+        budget(0),
+        evictions(0),
+        rejections(0),
+        expirations(0),
+        wheelRefs(0),
+        sweepTick(0),
+        sweepPos(0)
+   {
+   }
+   Cache(const Cache&) = delete;
+   ~Cache();
+
+   bool
+   Lookup(
+      const CacheKey &key,
+      std::vector<char> &payload,
+      CacheEntryInfo *info,
+      error *err
+   );
+
+   void
+   Insert(
+      const CacheKey &key,
+      const CacheEntryInfo &info,
+      const void *payload,
+      size_t len,
+      error *err
+   );
+
+   void
+   Remove(const CacheKey &key);
+
+   // Like Lookup(), without copying the payload or counting a hit.
+   //
+   bool
+   GetInfo(const CacheKey &key, CacheEntryInfo *info);
+
+   void
+   SetFlags(const CacheKey &key, unsigned char flags);
+
+   void
+   ClearFlags(const CacheKey &key, unsigned char flags);
+
+   // Limit live entries to about this many bytes; 0 for no limit.
+   //
+   void
+   SetBudget(size_t bytes);
+
+   void
+   GetStats(CacheStats *stats);
+
+   // Remove entries that expired before now, looking at no more than
+   // about maxSteps wheel entries.  Returns the number removed.
+   //
+   size_t
+   Sweep(uint64_t now, size_t maxSteps);
+
+   // Write all unexpired entries to path, via a temporary file that is
+   // renamed into place.
+   //
+   void
+   Save(const char *path, uint64_t now, error *err);
+
+   // Map a file written by Save().  Only the header is validated here;
+   // entries are checked as lookups reach them.  Returns false with no
+   // error if there is no usable snapshot at path.
+   //
+   bool
+   Map(const char *path, error *err);
+
+private:
+   struct Entry
+   {
+      uint32_t Size;       // total size in slab, including this header
+      uint32_t Hash;
+      uint64_t Time;
+      uint32_t Ttl;
+      uint32_t PayloadLength;
+      uint16_t Type;
+      uint16_t Class;
+      uint16_t NameLength;
+      unsigned char ResponseCode;
+      unsigned char Flags;
+      uint32_t Hits;
+      unsigned char Kind;
+      unsigned char Reserved[3];
+      // followed by name, then payload
+
+      const char *
+      Name() const { return (const char*)(this + 1); }
+
+      const char *
+      Payload() const { return Name() + NameLength; }
+   };
+
+   struct SnapshotHeader;
+
+   struct WheelRef
+   {
+      uint32_t Hash;
+      uint32_t Expiry;
+   };
+
+   struct Slot
+   {
+      uint32_t Hash;
+      uint32_t Offset;     // into slab; 0 for empty
+   };
+
+   struct Table
+   {
+      Slot *Slots;         // power of two in count
+      size_t SlotCount;
+      const char *Slab;
+      size_t SlabLength;
+
+      Table() : Slots(nullptr), SlotCount(0), Slab(nullptr), SlabLength(0) {}
+   };
+
+   // One generation of a shard's live table.  Once it is published, the
+   // slot array never moves and the slab never reallocates: entries are
+   // appended within the slab's capacity, and a slot only points at one
+   // after it is written.  Anything more takes a new version.
+   //
+   struct Version : public Epoch::Retired
+   {
+      std::vector<Slot> slots;
+      std::vector<char> slab;
+
+      Table
+      Readable()
+      {
+         Table t;
+         t.Slots = slots.data();
+         t.SlotCount = slots.size();
+         t.Slab = slab.data();
+         t.SlabLength = slab.capacity();
+         return t;
+      }
+   };
+
+   struct Shard
+   {
+      std::atomic<Version*> live;   // nullptr until the first insert
+      size_t used;         // occupied slots, including tombstones
+      size_t count;        // live entries
+      size_t deadBytes;
+      std::unique_ptr<std::atomic<unsigned char>[]> sketch;
+      size_t sketchWidth;
+      std::atomic<size_t> sketchAdds;  // since the sketch was last aged
+      uint32_t rng;
+      std::mutex lock;     // for writers; guards everything above but the sketch
+
+      Shard()
+         : live(nullptr),
+           used(0),
+           count(0),
+           deadBytes(0),
+           sketchWidth(0),
+           sketchAdds(0),
+           rng(2463534242U)
+      {
+      }
+
+      ~Shard() { delete live.load(); }
+
+      // With the lock held.
+      //
+      size_t
+      LiveBytes() const
+      {
+         auto v = live.load(std::memory_order_relaxed);
+         size_t n = v ? v->slab.size() : 0;
+         return n > (size_t)EntryAlign ? n - EntryAlign - deadBytes : 0;
+      }
+
+      Table
+      Live() const
+      {
+         auto v = live.load(std::memory_order_acquire);
+         return v ? v->Readable() : Table();
+      }
+   };
+
+   enum
+   {
+      ShardCount = 16,
+      InitialSlots = 64,
+      EntryAlign = 8,
+      Tombstone = 0xffffffffU,
+      SketchRows = 4,
+      SketchMax = 15,
+      EvictionSamples = 8,
+      WheelSize = 4096,    // buckets
+      WheelShift = 3,      // log2 of seconds per bucket
+   };
+
+   // A snapshot file mapped by Map(); unmapped when deleted.
+   //
+   struct Mapping : public Epoch::Retired
+   {
+      void *Base;
+      size_t Length;
+      Table Tables[ShardCount];
+
+      Mapping() : Base(nullptr), Length(0) {}
+      ~Mapping();
+   };
+
+   Shard shards[ShardCount];
+   std::atomic<Mapping*> mapping;
+   size_t budget;
+   std::atomic<uint64_t> evictions;
+   std::atomic<uint64_t> rejections;
+   std::atomic<uint64_t> expirations;
+   std::mutex wheelLock;   // guards the wheel and sweep state below
+   std::vector<WheelRef> wheel[WheelSize];
+   size_t wheelRefs;
+   uint64_t sweepTick;     // next bucket to sweep, in units of 1 << WheelShift seconds
+   size_t sweepPos;        // progress within that bucket
+
+   static size_t
+   AlignEntry(size_t n)
+   {
+      return (n + EntryAlign - 1) & ~(size_t)(EntryAlign - 1);
+   }
+
+   static uint32_t
+   Hash(const CacheKey &key);
+
+   static Shard &
+   ShardFor(Shard *shards, uint32_t hash)
+   {
+      return shards[(hash >> 28) % ShardCount];
+   }
+
+   // Entries and slots are plain data, since they go to disk as they are,
+   // but fields that change while readers may be looking go through this.
+   //
+   template<typename T>
+   static std::atomic<T> &
+   Atomic(const T &field)
+   {
+      static_assert(sizeof(std::atomic<T>) == sizeof(T), "atomic has a different size");
+      return *(std::atomic<T>*)&field;
+   }
+
+   static void
+   GetInfo(const Entry *e, CacheEntryInfo *info);
+
+   // Copy an entry to the end of a slab, reading the fields that lookups
+   // update atomically.
+   //
+   static void
+   AppendEntry(std::vector<char> &slab, const Entry *e);
+
+   static const Entry *
+   Find(const Table &table, const CacheKey &key, uint32_t hash, Slot **slot);
+
+   // The shard's part of the snapshot mapping.  Callers hold a guard.
+   //
+   Table
+   Mapped(const Shard &shard) const
+   {
+      auto m = mapping.load(std::memory_order_acquire);
+      return m ? m->Tables[&shard - shards] : Table();
+   }
+
+   // Find in the live shard, then in the mapped one.  Callers hold a
+   // guard.
+   //
+   const Entry *
+   Find(Shard &shard, const CacheKey &key, uint32_t hash, Slot **slot);
+
+   void
+   Unmap();
+
+   // Copy the live entries into a new version with this many slots and
+   // room for at least extra more bytes of entries, and publish it.
+   //
+   static void
+   Rebuild(Shard &shard, size_t nslots, size_t extra, error *err);
+
+   // Remove() with the shard locked and a guard held.
+   //
+   void
+   Remove(Shard &shard, const CacheKey &key, uint32_t hash);
+
+   size_t
+   ShardBudget() const { return budget / ShardCount; }
+
+   // Count-min sketch of lookups, for admission.
+   //
+   static void
+   Touch(Shard &shard, uint32_t hash);
+
+   static unsigned
+   Estimate(const Shard &shard, uint32_t hash);
+
+   // Evict until an entry of the given size fits in the shard's budget.
+   // Returns false if the candidate loses to a victim and should not be
+   // admitted.  If the candidate replaces the entry in slot replacing,
+   // that entry's space counts as free and it is never evicted here.
+   //
+   bool
+   MakeRoom(Shard &shard, uint32_t hash, size_t size, uint64_t now, const Slot *replacing);
+
+   void
+   Schedule(uint32_t hash, uint64_t expiry);
+
+   size_t
+   Expire(uint32_t hash, uint64_t now);
+};
+
+} // end namespace
+
+#endif
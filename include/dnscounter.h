@@ -0,0 +1,54 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnscounter_h_
+#define dnscounter_h_ 1
+
+#include <stdint.h>
+#include <atomic>
+
+namespace dns {
+
+//
+// A statistics counter with one writer, the thread that owns it, that
+// other threads may read at any time.  Since only one thread writes,
+// increments need no atomic read-modify-write; relaxed loads and stores
+// are enough to keep readers from seeing torn values.
+//
+
+class Counter
+{
+public:
+   Counter() : value(0) {}
+   Counter(const Counter&) = delete;
+
+   operator uint64_t() const { return value.load(std::memory_order_relaxed); }
+
+   Counter &
+   operator=(uint64_t n)
+   {
+      value.store(n, std::memory_order_relaxed);
+      return *this;
+   }
+
+   Counter &
+   operator+=(uint64_t n) { return *this = *this + n; }
+
+   Counter &
+   operator++() { return *this += 1; }
+
+   void
+   operator++(int) { *this += 1; }
+
+private:
+   std::atomic<uint64_t> value;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnsepoch_h_
+#define dnsepoch_h_ 1
+
+#include <stdint.h>
+
+namespace dns {
+
+//
+// Epoch-based reclamation, for structures that readers walk without
+// taking locks.  Readers hold a Guard while they look.  Writers, which
+// still serialize among themselves, unlink whatever they replace and pass
+// it to Retire(), which deletes it once no reader can still be looking.
+//
+// There is one global epoch.  A thread inside a guard publishes the epoch
+// it entered at, and the epoch only advances when every such thread has
+// entered at the current one.  So anything retired at epoch e is out of
+// every reader's reach by the time the epoch reaches e+2.  Entering and
+// leaving cost a store each, and readers never wait; only writers, in
+// Retire() and Collect(), look at the other threads.
+//
+
+class Epoch
+{
+public:
+   class Guard
+   {
+   public:
+      Guard() { Enter(); }
+      Guard(const Guard&) = delete;
+      ~Guard() { Leave(); }
+   };
+
+   // Base for anything passed to Retire(), so that retiring never has to
+   // allocate.
+   //
+   struct Retired
+   {
+      Retired *NextRetired;
+      uint64_t RetiredAt;
+
+      Retired() : NextRetired(nullptr), RetiredAt(0) {}
+      virtual ~Retired() {}
+   };
+
+   // Delete p once no reader can still see it.
+   //
+   static void
+   Retire(Retired *p);
+
+   // Delete whatever is due.  Retire() does this too; calling it now and
+   // then means nothing waits on the next write to be freed.
+   //
+   static void
+   Collect();
+
+   // Wait until no reader can see anything unlinked before the call.  The
+   // caller must not be inside a guard.
+   //
+   static void
+   Synchronize();
+
+private:
+   static void
+   Enter();
+
+   static void
+   Leave();
+};
+
+} // end namespace
+
+#endif
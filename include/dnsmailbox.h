@@ -0,0 +1,60 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnsmailbox_h_
+#define dnsmailbox_h_ 1
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <common/c++/handle.h>
+#include <common/error.h>
+
+#include <pollster/pollster.h>
+
+namespace dns {
+
+//
+// Hands work to the thread running another event loop.  Post() may be
+// called from any thread; the functions run in the order they were
+// posted, on the loop given to Start(), which a pipe wakes up.  A wakeup
+// is only written when the queue goes from empty to non-empty, so a burst
+// of posts costs one.
+//
+
+class Mailbox : public std::enable_shared_from_this<Mailbox>
+{
+public:
+   typedef std::function<void(error *err)> Function;
+
+   Mailbox() : writeFd(-1) {}
+   Mailbox(const Mailbox&) = delete;
+   ~Mailbox();
+
+   void
+   Start(pollster::waiter *loop, error *err);
+
+   void
+   Post(Function &&fn, error *err);
+
+private:
+   std::mutex lock;
+   std::vector<Function> pending;
+   int writeFd;
+   std::shared_ptr<common::SocketHandle> readFd;
+   common::Pointer<pollster::socket_event> event;
+
+   void
+   Drain(error *err);
+};
+
+} // end namespace
+
+#endif
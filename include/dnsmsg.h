@@ -9,12 +9,15 @@
 #ifndef dnsmsg_h_
 #define dnsmsg_h_
 
+#include <stddef.h>
 #include <string>
 #include <vector>
 
 #include <common/error.h>
 
 #include "dnsproto.h"
+#include "dnsarena.h"
+#include "dnsname.h"
 
 namespace dns
 {
@@ -23,6 +26,7 @@ struct Question
 {
    std::string Name;
    QuestionAttrs *Attrs;
+   DomainName Domain;      // filled in by ParseMessage, not by MessageWriter
 };
 
 struct Record
@@ -31,14 +35,22 @@ struct Record
    RecordAttrs *Attrs;
 };
 
+// Given an arena, everything the message allocates other than names comes
+// out of it, and the message must not outlive it.
+//
 struct Message
 {
    MessageHeader *Header;
-   std::vector<Question> Questions;
+   ArenaVector<Question> Questions;
    Record *Answers, *AuthorityNames, *AdditionalRecords;
-   std::vector<Record> Records;
+   ArenaVector<Record> Records;
 
-   Message() : Answers(nullptr), AuthorityNames(nullptr), AdditionalRecords(nullptr)
+   Message(Arena *arena = nullptr)
+      : Questions(arena),
+        Answers(nullptr),
+        AuthorityNames(nullptr),
+        AdditionalRecords(nullptr),
+        Records(arena)
    {
    }
 
@@ -49,20 +61,41 @@ struct Message
 class MessageWriter : public Message
 {
    MessageHeader headerStorage;
-   std::vector<QuestionAttrs> qattrs;
-   std::vector<char> rattrs;
-   std::vector<Record> answerReqs, authorityReqs, additlRecs;
+   ArenaVector<QuestionAttrs> qattrs;
+   ArenaVector<char> rattrs;
+   ArenaVector<Record> answerReqs, authorityReqs, additlRecs;
+   Arena *arena;
 
    Record *
-   AddRecord(Record *&ptr, std::vector<Record> &vec, I16 &count, uint16_t payload, error *err);
+   AddRecord(Record *&ptr, ArenaVector<Record> &vec, I16 &count, uint16_t payload, error *err);
 
 public:
-   MessageWriter()
+   MessageWriter(Arena *arena = nullptr)
+      : Message(arena),
+        qattrs(arena),
+        rattrs(arena),
+        answerReqs(arena),
+        authorityReqs(arena),
+        additlRecs(arena),
+        arena(arena)
    {
       Header = &headerStorage;
    }
 
-   std::vector<char>
+   // Writes the message to buf, compressing names.  Returns its length,
+   // or 0 with err set if it doesn't fit.
+   //
+   size_t
+   Serialize(char *buf, size_t len, error *err);
+
+   // At least as much as Serialize() could ever need.
+   //
+   size_t
+   SerializedSizeBound() const;
+
+   // As above, into a buffer from the writer's arena, if it has one.
+   //
+   ArenaVector<char>
    Serialize(error *err);
 
    Question *
@@ -87,6 +120,139 @@ public:
    }
 };
 
+//
+// Non-owning views of a message, for code that only needs to look at one.
+// Names are left where they are in the packet and decoded a label at a
+// time, and questions and records are indexed in fixed arrays, so parsing
+// into a MessageView never allocates.  The packet must outlive the view.
+//
+
+class NameView
+{
+public:
+   NameView() : base(nullptr), len(0), offset(0) {}
+   NameView(const void *base, size_t len, size_t offset)
+      : base((const unsigned char*)base), len(len), offset(offset)
+   {
+   }
+
+   class LabelIterator
+   {
+   public:
+      LabelIterator(const unsigned char *base, size_t len, size_t offset)
+         : base(base), len(len), offset(offset), jumps(0)
+      {
+      }
+
+      // Returns false after the last label.
+      //
+      bool
+      Next(const char **label, size_t *length);
+
+   private:
+      const unsigned char *base;
+      size_t len;
+      size_t offset;
+      int jumps;
+   };
+
+   LabelIterator
+   Labels() const { return LabelIterator(base, len, offset); }
+
+   size_t
+   Offset() const { return offset; }
+
+   // Uncompressed wire format in out[255], optionally folded to lowercase.
+   // Returns the length, or 0 if it doesn't fit.
+   //
+   size_t
+   ToWire(char *out, bool fold) const;
+
+   // Dotted, as ParseLabel() would give it.
+   //
+   void
+   ToString(std::string &out, error *err) const;
+
+   // Returns false if the name doesn't fit.
+   //
+   bool
+   ToDomainName(DomainName *out) const
+   {
+      char buf[DomainName::MaxLength];
+      size_t n = ToWire(buf, false);
+      return n && out->AssignWire(buf, n);
+   }
+
+private:
+   const unsigned char *base;
+   size_t len;
+   size_t offset;
+};
+
+struct QuestionView
+{
+   NameView Name;
+   const QuestionAttrs *Attrs;
+};
+
+struct RecordView
+{
+   NameView Name;
+   const RecordAttrs *Attrs;
+};
+
+struct MessageView
+{
+   enum
+   {
+      MaxQuestions = 4,
+      MaxRecords = 128,
+   };
+
+   MessageHeader *Header;
+   QuestionView Questions[MaxQuestions];
+   RecordView Records[MaxRecords];
+   size_t QuestionCount;   // indexed, at most MaxQuestions
+   size_t RecordCount;     // indexed, at most MaxRecords
+
+   // All of the message was checked, but if this is false some of it
+   // didn't fit in the arrays above.
+   //
+   bool Complete;
+
+   // The EDNS OPT pseudo-record in the additional section, indexed or
+   // not, or nullptr.
+   //
+   const RecordAttrs *Opt;
+
+   MessageView() : Header(nullptr), QuestionCount(0), RecordCount(0), Complete(true), Opt(nullptr) {}
+
+   // Start of each section within Records, or nullptr if the section is
+   // empty or wasn't indexed.
+   //
+   const RecordView *
+   Answers() const { return Section(0, Header->AnswerCount.Get()); }
+
+   const RecordView *
+   AuthorityNames() const { return Section(Header->AnswerCount.Get(), Header->AuthorityNameCount.Get()); }
+
+   const RecordView *
+   AdditionalRecords() const
+   {
+      return Section(
+         Header->AnswerCount.Get() + Header->AuthorityNameCount.Get(),
+         Header->AdditionalRecordCount.Get()
+      );
+   }
+
+private:
+   const RecordView *
+   Section(size_t start, size_t count) const
+   {
+      return (count && start + count <= RecordCount) ? Records + start : nullptr;
+   }
+};
+
 void
 ParseMessage(
    const void *buf,
@@ -95,6 +261,87 @@ ParseMessage(
    error *err
 );
 
+void
+ParseMessage(
+   const void *buf,
+   size_t len,
+   MessageView *m,
+   error *err
+);
+
+//
+// EDNS(0) (RFC 6891).  The OPT record's class is the largest UDP payload
+// its sender can take.  It describes one hop, so we strip it from what we
+// relay or cache and add our own on the way out.
+//
+
+const uint16_t MinUdpPayload = 512;
+const uint16_t MaxUdpPayload = 4096;
+
+const size_t OptRecordLength = 1 + offsetof(RecordAttrs, Data);
+
+// The DO bit (RFC 3225), in the flags that make up the low half of the
+// OPT record's TTL.
+//
+const uint16_t OptDnssecOk = 0x8000;
+
+// What the sender of msg advertised, clamped to [MinUdpPayload,
+// MaxUdpPayload], or 0 if it didn't send an OPT record.
+//
+uint16_t
+AdvertisedPayload(const MessageView &msg);
+
+// As above, for a packet that hasn't been parsed yet.  Responses give 0.
+//
+uint16_t
+QueryPayload(const void *buf, size_t len);
+
+// Whether the sender of msg set DO, asking for DNSSEC records.
+//
+bool
+DnssecOk(const MessageView &msg);
+
+// Where the OPT record starts if it's the last thing in the packet, which
+// is where everyone puts it, or len.  One anywhere else is left alone,
+// since what follows it could hold compression pointers past it.
+//
+size_t
+TrailingOpt(const void *buf, size_t len, const MessageView &msg);
+
+// Drops a trailing OPT record in place.  Returns the new length.
+//
+size_t
+StripOpt(void *buf, size_t len, const MessageView &msg);
+
+// Writes an OPT record advertising payload to out[OptRecordLength] and
+// counts it in hdr.  out is expected to be the end of the message.
+//
+void
+WriteOpt(MessageHeader *hdr, char *out, uint16_t payload, bool dnssecOk = false);
+
+// Works out how much of the response in buf[len] to send in at most room
+// bytes, cutting only between records.  Additional records go first, an
+// RRset at a time, then the whole authority section; only if the
+// answers themselves don't fit is everything after the question dropped
+// and TC set.  With minimal, answers that have records lose the other
+// two sections regardless.  Anything in buf past len, such as an OPT
+// record the caller has set aside, isn't counted.  Returns the length of
+// the prefix of buf to send, with *hdr as the header to send in place of
+// its own.  *trimmed says whether records were dropped to fit room, not
+// counting what minimal drops; *truncated says whether TC was set.
+//
+size_t
+FitResponse(
+   const void *buf,
+   size_t len,
+   const MessageView &msg,
+   size_t room,
+   bool minimal,
+   MessageHeader *hdr,
+   bool *trimmed,
+   bool *truncated
+);
+
 const char *TypeToString(uint16_t type);
 const char *ClassToString(uint16_t cl);
 const char *ResponseCodeToString(unsigned char response);
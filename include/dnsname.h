@@ -0,0 +1,156 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnsname_h_
+#define dnsname_h_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+namespace dns {
+
+// Bulk name kernels; see namekernel.cc.
+//
+// Copy n bytes from in to out with ASCII letters folded to lowercase.  in
+// and out may be the same.
+//
+void
+FoldName(const char *in, char *out, size_t n);
+
+// As above, also returning a hash of the folded bytes.
+//
+uint64_t
+FoldNameAndHash(const char *in, char *out, size_t n);
+
+bool
+NameEqualsIgnoringCase(const char *a, const char *b, size_t n);
+
+namespace internal
+{
+   enum NameKernelLevel
+   {
+      NameKernelScalar,
+      NameKernelSse2,
+      NameKernelAvx2,
+   };
+
+   // hash says whether to return the hash or 0.
+   //
+   struct NameKernels
+   {
+      uint64_t (*Fold)(const char *in, char *out, size_t n, bool hash);
+      bool (*Equals)(const char *a, const char *b, size_t n);
+   };
+
+   // One version in particular, rather than the one picked for this CPU,
+   // for benchmarks; false if it isn't built or the CPU can't run it.
+   //
+   bool
+   GetNameKernels(NameKernelLevel level, NameKernels *out);
+}
+
+//
+// A domain name in uncompressed wire format, kept alongside an ASCII
+// lowercase copy and a hash of that copy.  All three are worked out once,
+// when the name is assigned, so that lookups keyed on names compare and
+// hash without folding or allocating.
+//
+// Equality is case-insensitive, as DNS names are; SameCase() compares the
+// name exactly as it was given.
+//
+
+class DomainName
+{
+public:
+   enum
+   {
+      MaxLength = 255,
+   };
+
+   DomainName() : length(0), hash(0) {}
+
+   // Both of these return false and leave the name empty if the input
+   // isn't a valid name.  A trailing dot on a dotted name is optional.
+   //
+   bool
+   Assign(const char *dotted, size_t len);
+
+   bool
+   Assign(const std::string &dotted) { return Assign(dotted.data(), dotted.length()); }
+
+   // Reads up to len bytes of an uncompressed wire-format name.
+   //
+   bool
+   AssignWire(const void *wire, size_t len);
+
+   void
+   Clear() { length = 0; hash = 0; }
+
+   bool
+   Empty() const { return !length; }
+
+   // Length of the wire format, including the terminating empty label.
+   //
+   size_t
+   Length() const { return length; }
+
+   const char *
+   Wire() const { return wire; }
+
+   const char *
+   Folded() const { return folded; }
+
+   uint64_t
+   Hash() const { return hash; }
+
+   // Dotted, as ParseLabel() would give it.  Throws std::bad_alloc.
+   //
+   std::string
+   ToString() const;
+
+   bool
+   operator==(const DomainName &other) const
+   {
+      return hash == other.hash &&
+             length == other.length &&
+             !memcmp(folded, other.folded, length);
+   }
+
+   bool
+   operator!=(const DomainName &other) const { return !(*this == other); }
+
+   bool
+   SameCase(const DomainName &other) const
+   {
+      return hash == other.hash &&
+             length == other.length &&
+             !memcmp(wire, other.wire, length);
+   }
+
+   struct Hasher
+   {
+      size_t
+      operator()(const DomainName &name) const { return (size_t)name.Hash(); }
+   };
+
+private:
+   uint16_t length;
+   uint64_t hash;
+   char wire[MaxLength];
+   char folded[MaxLength];
+
+   void
+   Finish();
+};
+
+} // end namespace
+
+#endif
@@ -108,7 +108,16 @@ enum class Type
    MINFO   = 14,
    MX      = 15,
    TXT     = 16,
+   RP      = 17,
+   AFSDB   = 18,
+   RT      = 21,
+   PX      = 26,
    AAAA    = 28,
+   SRV     = 33,
+   KX      = 36,
+   DNAME   = 39,
+   OPT     = 41,
+   RRSIG   = 46,
 };
 
 enum class QType
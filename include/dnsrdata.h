@@ -0,0 +1,107 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnsrdata_h_
+#define dnsrdata_h_ 1
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "dnsproto.h"
+
+namespace dns {
+
+//
+// RDATA layouts for the record types that embed domain names: a fixed
+// prefix, some names, and a fixed suffix.  A name inside RDATA can point
+// anywhere in the packet it came in, so it has to be expanded before the
+// RDATA can be kept, and can be compressed again when it is written out.
+//
+// Only the types RFC 1035 defined may be compressed on the way out
+// (RFC 3597 section 4).  Later ones are read the same way, in case a
+// server compressed them anyway, but always written in full.
+//
+
+template<size_t Prefix, int Names, size_t Suffix, bool Compressible>
+struct NameRdata
+{
+   static const size_t PrefixLength = Prefix;
+   static const int NameCount = Names;
+   static const size_t SuffixLength = Suffix;
+   static const bool Compress = Compressible;
+};
+
+// Only the types with names in them have a format.
+//
+template<Type T>
+struct RdataFormat;
+
+template<> struct RdataFormat<Type::NS>    : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::MD>    : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::MF>    : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::CNAME> : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::SOA>   : NameRdata<0, 2, 20, true> {};
+template<> struct RdataFormat<Type::MB>    : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::MG>    : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::MR>    : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::PTR>   : NameRdata<0, 1, 0, true> {};
+template<> struct RdataFormat<Type::MINFO> : NameRdata<0, 2, 0, true> {};
+template<> struct RdataFormat<Type::MX>    : NameRdata<2, 1, 0, true> {};
+template<> struct RdataFormat<Type::RP>    : NameRdata<0, 2, 0, false> {};
+template<> struct RdataFormat<Type::AFSDB> : NameRdata<2, 1, 0, false> {};
+template<> struct RdataFormat<Type::RT>    : NameRdata<2, 1, 0, false> {};
+template<> struct RdataFormat<Type::PX>    : NameRdata<2, 2, 0, false> {};
+template<> struct RdataFormat<Type::SRV>   : NameRdata<6, 1, 0, false> {};
+template<> struct RdataFormat<Type::KX>    : NameRdata<2, 1, 0, false> {};
+template<> struct RdataFormat<Type::DNAME> : NameRdata<0, 1, 0, false> {};
+
+// Calls v.template Visit<RdataFormat<T>>() for the record type, or
+// v.Opaque() if its RDATA has no names in it.
+//
+template<typename Visitor>
+bool
+VisitRdata(uint16_t type, Visitor &v)
+{
+   switch ((Type)type)
+   {
+#define FORMAT(X) case Type::X: return v.template Visit<RdataFormat<Type::X>>()
+   FORMAT(NS);
+   FORMAT(MD);
+   FORMAT(MF);
+   FORMAT(CNAME);
+   FORMAT(SOA);
+   FORMAT(MB);
+   FORMAT(MG);
+   FORMAT(MR);
+   FORMAT(PTR);
+   FORMAT(MINFO);
+   FORMAT(MX);
+   FORMAT(RP);
+   FORMAT(AFSDB);
+   FORMAT(RT);
+   FORMAT(PX);
+   FORMAT(SRV);
+   FORMAT(KX);
+   FORMAT(DNAME);
+#undef FORMAT
+   default:
+      return v.Opaque();
+   }
+}
+
+// Append a record's RDATA to out with any names expanded, so that it no
+// longer depends on the rest of msg.  Returns false if the RDATA doesn't
+// parse.  Throws std::bad_alloc.
+//
+bool
+ExpandRdata(const void *msg, size_t len, const RecordAttrs *attrs, std::vector<char> &out);
+
+} // end namespace
+
+#endif
@@ -10,10 +10,12 @@
 #define dns_reqmap_h_
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
-#include <map>
+#include <functional>
 #include <memory>
-#include <string>
 #include <vector>
 
 #include "dnsmsg.h"
@@ -26,187 +28,424 @@ namespace internal
 {
    bool
    ParseAddr(const struct sockaddr *addr, int &off, size_t &len);
+
+   // Mixes the rest of a request's key into the hash of its name.
+   //
+   uint64_t
+   RequestFingerprint(
+      uint64_t nameHash,
+      uint16_t id,
+      uint16_t type,
+      uint16_t cls,
+      uint16_t flags,
+      const unsigned char *addr,
+      size_t addrLength
+   );
+}
+
+class RequestMapBase;
+
+//
+// Names one request in a RequestMap, by its entry and that entry's
+// generation, so that it can be cancelled later.  A handle holds none of
+// the key, only the map's liveness cell, so copying one allocates
+// nothing.  Cancelling after the request is gone, or the map is, does
+// nothing.
+//
+
+class RequestHandle
+{
+public:
+   RequestHandle() : index(0), generation(0) {}
+
+   explicit operator bool() const { return owner.get() != nullptr; }
+
+   // Remove the request, if it's still there.
+   //
+   void
+   Cancel();
+
+   void
+   Reset() { owner.reset(); }
+
+private:
+   template<typename Value> friend class RequestMap;
+
+   std::shared_ptr<RequestMapBase*> owner;
+   uint32_t index;
+   uint32_t generation;
+};
+
+class RequestMapBase
+{
+public:
+   RequestMapBase() {}
+   RequestMapBase(const RequestMapBase&) = delete;
+
+   virtual ~RequestMapBase()
+   {
+      if (cell)
+         *cell = nullptr;
+   }
+
+protected:
+   friend class RequestHandle;
+
+   std::shared_ptr<RequestMapBase*> cell;    // made with the first handle
+
+   virtual void
+   Cancel(uint32_t index, uint32_t generation) = 0;
+};
+
+inline void
+RequestHandle::Cancel()
+{
+   if (owner && *owner)
+      (*owner)->Cancel(index, generation);
+   owner.reset();
 }
 
+//
+// Requests in flight, keyed on (ID, address, type, class, name), and the
+// DO bit if the map was made to key on it.  Each
+// key is reduced to a 64-bit fingerprint once, up front; the table is open
+// addressing over those, with linear probing, and the full key is only
+// compared when fingerprints match.  Removal backward-shifts the probe run,
+// so there are no tombstones, and every operation is O(1) on average.
+//
+// Entries keep their place in a vector that slots index into; a removed
+// one goes on a free list and its generation moves on, which is what
+// makes RequestHandles to it stale.
+//
+// Value pointers returned by Lookup() are good until the next Insert() or
+// Remove().  The entry index it gives, for Remove() and Handle(), is good
+// until that entry is removed.
+//
+
 template<typename Value>
-class RequestMap
+class RequestMap : public RequestMapBase
 {
 private:
+   struct Key
+   {
+      uint64_t Fingerprint;
+      uint16_t Id;
+      uint16_t Type;
+      uint16_t Class;
+      uint16_t Flags;         // OptDnssecOk, if keyed on
+      uint16_t AddrLength;
+      unsigned char Addr[16];
+   };
+
    struct RequestData
    {
-      std::vector<char> sockaddr;
-      uint16_t type;
-      std::string name;
+      Key key;
+      DomainName name;
       Value value;
+      uint32_t generation;
+      bool live;
+
+      RequestData() : generation(0), live(false) {}
    };
-   std::shared_ptr<RequestMap<Value>*> weakThis;
 
-   std::map<uint16_t, std::vector<RequestData>> map;
+   struct Slot
+   {
+      uint64_t Fingerprint;
+      uint32_t Index;      // into entries, plus one; 0 for empty
+   };
 
-   Value *
-   Lookup(const void *addr, size_t len, uint16_t id, uint16_t type, const std::string &name)
+   enum : size_t
    {
-      auto p = map.find(id);
-      if (p == map.end())
-         return nullptr;
-      auto &resList = p->second;
-      for (auto &res : resList)
+      MinSlots = 16,
+      NotFound = (size_t)-1,
+   };
+
+   std::vector<RequestData> entries;
+   std::vector<uint32_t> freeEntries;     // capacity kept at entries.size()
+   std::vector<Slot> slots;               // power of two in count, at most half full
+   size_t count;
+   bool keyOnDnssecOk;
+
+   void
+   MakeKey(
+      const struct sockaddr *addr,
+      const MessageView &msg,
+      const DomainName &name,
+      Key &key
+   ) const
+   {
+      auto attrs = msg.Questions[0].Attrs;
+      int off = 0;
+      size_t len = 0;
+
+      memset(&key, 0, sizeof(key));
+      if (internal::ParseAddr(addr, off, len) && len <= sizeof(key.Addr))
       {
-         if (type != res.type)
-            continue;
-         if (len != res.sockaddr.size())
-            continue;
-         if (len && memcmp(addr, res.sockaddr.data(), len))
-            continue;
-         if (name != res.name)
-            continue;
-         return &res.value;
+         memcpy(key.Addr, (const char*)addr + off, len);
+         key.AddrLength = len;
       }
-      return nullptr;
+      key.Id = msg.Header->Id.Get();
+      key.Type = attrs->Type.Get();
+      key.Class = attrs->Class.Get();
+      key.Flags = (keyOnDnssecOk && DnssecOk(msg)) ? OptDnssecOk : 0;
+      key.Fingerprint = internal::RequestFingerprint(
+         name.Hash(),
+         key.Id,
+         key.Type,
+         key.Class,
+         key.Flags,
+         key.Addr,
+         key.AddrLength
+      );
    }
 
-public:
+   static bool
+   SameKey(const Key &a, const Key &b)
+   {
+      return a.Fingerprint == b.Fingerprint &&
+             a.Id == b.Id &&
+             a.Type == b.Type &&
+             a.Class == b.Class &&
+             a.Flags == b.Flags &&
+             a.AddrLength == b.AddrLength &&
+             !memcmp(a.Addr, b.Addr, a.AddrLength);
+   }
 
-   ~RequestMap()
+   size_t
+   Find(const Key &key, const DomainName &name) const
    {
-      if (weakThis)
-         *weakThis = nullptr;
+      size_t mask = slots.size() - 1;
+
+      if (!slots.size())
+         return NotFound;
+
+      for (size_t i = key.Fingerprint & mask;; i = (i + 1) & mask)
+      {
+         auto &slot = slots[i];
+         if (!slot.Index)
+            return NotFound;
+         if (slot.Fingerprint != key.Fingerprint)
+            continue;
+         auto &res = entries[slot.Index - 1];
+         if (SameKey(res.key, key) && name.SameCase(res.name))
+            return slot.Index - 1;
+      }
    }
 
-   Value *
-   Lookup(const struct sockaddr *addr, const Message &msg)
+   // The slot pointing at entries[idx].
+   //
+   size_t
+   SlotFor(size_t idx) const
    {
-      auto id = msg.Header->Id.Get();
-      if (msg.Questions.size() != 1)
-         return nullptr;
-      const void *addrp = nullptr;
-      int off = 0;
-      size_t len = 0;
-      if (internal::ParseAddr(addr, off, len))
-         addrp = (const char*)addr + off;
-      auto type = msg.Questions[0].Attrs->Type.Get();
-      const auto &name = msg.Questions[0].Name;
-      return Lookup(addrp, len, id, type, name);
+      size_t mask = slots.size() - 1;
+      size_t i = entries[idx].key.Fingerprint & mask;
+
+      while (slots[i].Index != idx + 1)
+         i = (i + 1) & mask;
+      return i;
    }
 
-   void
-   Insert(const struct sockaddr *addr, const Message &msg, const Value &value, error *err)
+   static void
+   Place(std::vector<Slot> &table, uint64_t fingerprint, size_t idx)
    {
-      auto id = msg.Header->Id.Get();
-      RequestData state;
+      size_t mask = table.size() - 1;
+      size_t i = fingerprint & mask;
 
-      if (msg.Questions.size() != 1)
-         ERROR_SET(err, unknown, "Expected question");
+      while (table[i].Index)
+         i = (i + 1) & mask;
+      table[i].Fingerprint = fingerprint;
+      table[i].Index = idx + 1;
+   }
 
-      try
-      {
-         int off = 0;
-         size_t len = 0;
-         if (internal::ParseAddr(addr, off, len))
-         {
-            auto p = (const char *)addr + off;
-            state.sockaddr.insert(state.sockaddr.begin(), p, p+len);
-         }
-         state.type = msg.Questions[0].Attrs->Type.Get();
-         state.name = msg.Questions[0].Name;
-         state.value = value;
-         map[id].push_back(std::move(state));
-      }
-      catch (const std::bad_alloc&)
+   // Throws std::bad_alloc.
+   //
+   void
+   Rehash(size_t n)
+   {
+      std::vector<Slot> next(n, Slot());
+
+      for (size_t i = 0; i < entries.size(); ++i)
       {
-         ERROR_SET(err, nomem);
+         if (entries[i].live)
+            Place(next, entries[i].key.Fingerprint, i);
       }
-   exit:;
+      slots.swap(next);
    }
 
+   // Empty the slot, pulling later members of its probe run back so that
+   // none is left past a hole.
+   //
    void
-   Insert(const struct sockaddr *addr, const Message &msg, const Value &value, std::function<void()> *cancel, error *err)
+   EraseSlot(size_t hole)
    {
-      if (cancel)
+      size_t mask = slots.size() - 1;
+
+      for (size_t j = (hole + 1) & mask; slots[j].Index; j = (j + 1) & mask)
       {
-         if (!msg.Header->QuestionCount.Get())
-            ERROR_SET(err, unknown, "Expected question");
-         try
+         size_t home = slots[j].Fingerprint & mask;
+         if (((j - home) & mask) >= ((j - hole) & mask))
          {
-            *cancel = CreateCancel(addr, msg);
-         }
-         catch (const std::bad_alloc&)
-         {
-            ERROR_SET(err, nomem);
+            slots[hole] = slots[j];
+            hole = j;
          }
       }
-      Insert(addr, msg, value, err);
-   exit:
-      if (ERROR_FAILED(err) && cancel)
-         *cancel = std::function<void()>();
+      slots[hole] = Slot();
    }
 
    void
-   Remove(uint16_t id, Value *value)
+   Cancel(uint32_t index, uint32_t generation)
    {
-      auto it = map.find(id);
-      if (it == map.end())
-         return;
+      if (index < entries.size() &&
+          entries[index].live &&
+          entries[index].generation == generation)
+      {
+         Remove(index);
+      }
+   }
+
+public:
+
+   // Upstream answers needn't echo DO, so only maps of queries should
+   // key on it.
+   //
+   explicit RequestMap(bool keyOnDnssecOk = false) : count(0), keyOnDnssecOk(keyOnDnssecOk) {}
+
+   size_t
+   Size() const { return count; }
 
-      Remove(it->second, value);
+   // index, if given, is set to the entry's index.
+   //
+   Value *
+   Lookup(const struct sockaddr *addr, const MessageView &msg, size_t *index = nullptr)
+   {
+      Key key;
+      DomainName name;
+      size_t idx = 0;
+      if (msg.QuestionCount != 1 || !msg.Complete)
+         return nullptr;
+      if (!msg.Questions[0].Name.ToDomainName(&name))
+         return nullptr;
+      MakeKey(addr, msg, name, key);
+      idx = Find(key, name);
+      if (idx == NotFound)
+         return nullptr;
+      if (index)
+         *index = idx;
+      return &entries[idx].value;
    }
 
+   // handle, if given, is set to name the new request.
+   //
    void
-   Remove(Value *value)
+   Insert(
+      const struct sockaddr *addr,
+      const MessageView &msg,
+      const Value &value,
+      RequestHandle *handle,
+      error *err
+   )
    {
-      for (auto &pair : map)
+      size_t idx = 0;
+      DomainName name;
+
+      if (handle)
+         handle->Reset();
+
+      if (msg.QuestionCount != 1 || !msg.Complete)
+         ERROR_SET(err, unknown, "Expected question");
+      if (!msg.Questions[0].Name.ToDomainName(&name))
+         ERROR_SET(err, unknown, "Invalid name");
+
+      try
       {
-         auto &list = pair->second;
-         if (InVec(list, value))
+         if (handle && !cell)
+            cell = std::make_shared<RequestMapBase*>(this);
+
+         if ((count + 1) * 2 > slots.size())
+            Rehash(slots.size() ? slots.size() * 2 : (size_t)MinSlots);
+
+         if (!freeEntries.size())
          {
-            Remove(list, value);
-            break;
+            freeEntries.reserve(entries.size() + 1);
+            entries.emplace_back();
+            freeEntries.push_back(entries.size() - 1);
          }
+
+         idx = freeEntries.back();
+
+         auto &res = entries[idx];
+         res.name = name;
+         MakeKey(addr, msg, name, res.key);
+         res.value = value;
       }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(err, nomem);
+      }
+
+      freeEntries.pop_back();
+      entries[idx].live = true;
+      Place(slots, entries[idx].key.Fingerprint, idx);
+      ++count;
+
+      if (handle)
+         Handle(idx, handle);
+   exit:;
    }
 
-   std::function<void()>
-   CreateCancel(const struct sockaddr *addr, const Message &msg)
+   void
+   Insert(const struct sockaddr *addr, const MessageView &msg, const Value &value, error *err)
    {
-      std::vector<char> sockaddr;
-      int off = 0;
-      size_t len = 0;
-      if (internal::ParseAddr(addr, off, len))
-         sockaddr.insert(sockaddr.begin(), (char*)addr+off, (char*)addr+len);
-      auto id = msg.Header->Id.Get();
-      auto type = msg.Questions[0].Attrs->Type.Get();
-      const auto &name = msg.Questions[0].Name;
-
-      if (!weakThis.get())
-         weakThis = std::make_shared<RequestMap*>(this);
-      auto weakThis_ = weakThis;
+      Insert(addr, msg, value, nullptr, err);
+   }
 
-      return [weakThis_, id, sockaddr, type, name] () -> void
+   // Set handle to name the request at this entry index.
+   //
+   void
+   Handle(size_t idx, RequestHandle *handle, error *err)
+   {
+      try
+      {
+         if (!cell)
+            cell = std::make_shared<RequestMapBase*>(this);
+      }
+      catch (const std::bad_alloc&)
       {
-         auto t = *weakThis_;
-         if (!t)
-            return;
-         auto p = t->Lookup(sockaddr.data(), sockaddr.size(), id, type, name);
-         if (p)
-            t->Remove(id, p);
-      };
+         ERROR_SET(err, nomem);
+      }
+      Handle(idx, handle);
+   exit:;
    }
 
-private:
-
-   template<typename T>
-   static bool
-   InVec(const std::vector<T> &list, void *p)
+   void
+   Remove(size_t idx)
    {
-      return list.size() && list.data() <= p && p < list.data()+list.size();
+      assert(idx < entries.size() && entries[idx].live);
+
+      auto res = &entries[idx];
+
+      EraseSlot(SlotFor(idx));
+
+      // Whatever the value held goes last, once the map is whole again:
+      // dead is only here to be destroyed on the way out.
+      //
+      Value dead = std::move(res->value);
+      res->value = Value();
+      res->live = false;
+      ++res->generation;
+      freeEntries.push_back(idx);
+      --count;
+      (void)dead;
    }
 
-   static void
-   Remove(std::vector<RequestData> &list, Value *value)
+private:
+
+   void
+   Handle(size_t idx, RequestHandle *handle)
    {
-      assert(InVec(list, value));
-      auto res = (RequestData*)((char*)value - offsetof(RequestData, value));
-      list.erase(list.begin() + (res - list.data()));
+      handle->owner = cell;
+      handle->index = idx;
+      handle->generation = entries[idx].generation;
    }
 };
 
@@ -216,7 +455,7 @@ public:
    typedef std::function<void(
       const void *buf,
       size_t len,
-      Message &msg,
+      MessageView &msg,
       error *err
    )> Callback;
 
@@ -225,16 +464,16 @@ public:
       const struct sockaddr *,
       const void *buf,
       size_t len,
-      Message &msg,
+      MessageView &msg,
       error *err
    );
 
    void
    OnRequest(
       const struct sockaddr *addr,
-      const Message &msg,
+      const MessageView &msg,
       const Callback &cb,
-      std::function<void()> *cancel,
+      RequestHandle *cancel,
       error *err
    );
 
@@ -243,9 +482,9 @@ public:
       const struct sockaddr *addr,
       const void *buf,
       size_t len,
-      const Message *msg,
+      const MessageView *msg,
       const Callback &cb,
-      std::function<void()> *cancel,
+      RequestHandle *cancel,
       error *err
    );
 
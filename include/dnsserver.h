@@ -10,23 +10,34 @@
 #define dnsserver_h_ 1
 
 #include <stddef.h>
+#include <string.h>
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <common/c++/handle.h>
 #include <common/error.h>
 #include <common/crypto/rng.h>
 
+#include <pollster/pollster.h>
 #include <pollster/sockapi.h>
-#include <sqlitewrapper.h>
-
+#include <dnsarena.h>
+#include <dnscache.h>
+#include <dnscounter.h>
 #include <dnsreqmap.h>
 #include <config.h>
 
 namespace dns {
 
 struct Message;
+struct MessageView;
+class MessageWriter;
+class Mailbox;
+class UdpSocket;
 
 enum class MessageMode
 {
@@ -41,18 +52,75 @@ enum class Protocol
    DnsOverTls,
 };
 
+struct ServerStats
+{
+   Counter PrefetchIssued;
+   Counter PrefetchWasted;       // prefetched entries that were never hit
+   Counter SweepTicks;
+   Counter SweepMicros;          // total time spent in expiry sweeps
+   Counter SweepMaxMicros;       // longest single sweep
+   Counter UpstreamLargeUdp;     // upstream UDP answers over 512 bytes, which would have needed TCP
+   Counter UpstreamTruncated;    // upstream UDP answers that still fell back to TCP
+   Counter UpstreamQueries;      // queries sent upstream, retransmits included
+   Counter UpstreamRetransmits;  // sent again, to the same or the next server, after no usable answer
+   Counter ClientTrimmed;        // UDP answers that fit once extra records were dropped, not counting minimal-responses
+   Counter ClientTruncated;      // UDP answers too big for the client
+};
+
 struct LocalEntry
 {
    std::vector<std::pair<Type, std::vector<char>>> Addrs;
 };
 
+//
+// With workers configured, the server that main() creates is the primary.
+// StartWorkers() gives each extra worker a Server of its own, sharing the
+// primary's configuration and cache, with its own event loop on its own
+// thread and its own UDP listeners bound to the same port with
+// SO_REUSEPORT, so that the kernel spreads clients over them.  Everything
+// else a worker has, from request maps to sockets, is its own and only
+// touched from its thread.  TCP listeners, snapshots, sweeps and stats stay
+// with the primary, and workers hand their upstream TCP queries to it.
+//
+
 class Server : public std::enable_shared_from_this<Server>
 {
 public:
-   Server() : rng(nullptr) {}
+   Server()
+      : Server(std::make_shared<Cache>())
+   {
+      cache.SetBudget(32 * 1024 * 1024);
+   }
+
+   // A server sharing another's cache.
+   //
+   explicit Server(const std::shared_ptr<Cache> &cache_)
+      : forwardReqs(true),
+        rng(nullptr),
+        sharedCache(cache_),
+        cache(*sharedCache),
+        cacheSaveInterval(5 * 60),
+        cacheSaving(false),
+        staleWindow(0),
+        staleTtl(30),
+        servfailTtl(5),
+        prefetchPercent(0),
+        prefetchMinHits(2),
+        statsInterval(0),
+        ednsBufferSize(1232),
+        minimalResponses(false),
+        ioUring(false),
+        upstreamSockets(4),
+        upstreamBatchDepth(0),
+        workerCount(1),
+        primary(nullptr),
+        stopping(false)
+   {
+   }
    Server(const Server&) = delete;
    ~Server()
    {
+      StopWorkers();
       if (rng) rng_close(rng);
    }
 
@@ -71,6 +139,48 @@ public:
    void
    StartTcp(pollster::Certificate *cert, error *err);
 
+   // Start the extra worker threads, if more than one worker is
+   // configured.  Call after the primary's UDP listeners are up.
+   //
+   void
+   StartWorkers(error *err);
+
+   // Stop the worker threads and wait for them, so that nothing is still
+   // using the cache when it's saved or torn down.  Workers finish what
+   // their loop is doing and see the request when their mailbox wakes
+   // them.
+   //
+   void
+   StopWorkers();
+
+   // Map the cache snapshot, if one is configured, and start saving it
+   // periodically.
+   //
+   void
+   StartCacheSnapshots(error *err);
+
+   // Write the snapshot from the calling thread, after any save already
+   // in progress.  The periodic saves run on a thread of their own.
+   //
+   void
+   SaveCache(error *err);
+
+   // Reclaim expired cache entries a little at a time.
+   //
+   void
+   StartCacheSweep(error *err);
+
+   void
+   SweepCache();
+
+   // Log counters every stats-interval seconds, if configured.
+   //
+   void
+   StartStats(error *err);
+
+   void
+   LogStats();
+
    void
    AddForwardServer(
       const char *hostname,
@@ -82,6 +192,17 @@ public:
    void
    ClearForwardServers();
 
+   // UDP payload size advertised with EDNS, or 0 if EDNS is off.
+   //
+   uint16_t
+   EdnsBufferSize() const { return ednsBufferSize; }
+
+   // Whether positive answers go out without authority and additional
+   // records.
+   //
+   bool
+   MinimalResponses() const { return minimalResponses; }
+
    // XXX this was private before, and makes more sense like that.
    void
    HandleMessage(
@@ -106,39 +227,124 @@ private:
       ForwardServerState() : tcpMap(nullptr), proto(Protocol::Plaintext) {}
    };
 
+   // Lives as long as the upstream request.  The arena must come first so
+   // that it outlives the vectors allocated from it.
+   //
    struct ForwardClientState : public std::enable_shared_from_this<ForwardClientState>
    {
-      std::vector<std::function<void(const void *, size_t, error *)>> reply;
-      std::vector<std::function<void()>> cancel;
-      std::vector<char> request;
+      Arena arena;
+      ArenaVector<std::function<void(const void *, size_t, error *)>> reply;
+      ArenaVector<RequestHandle> cancel;
+      ArenaVector<char> request;
+      bool dnssecOk;             // the client set DO; keys the cached reply
       bool udpExhausted;
       int idx;
       int timeoutIdx;
-
-      ForwardClientState() : udpExhausted(false), idx(0), timeoutIdx(0) {}
+      int attempts;
+
+      // The retransmit timer for the latest attempt; there's never more
+      // than one.  A handler that finds the generation moved on belongs
+      // to a timer that was cancelled after it was already due.
+      //
+      common::Pointer<pollster::event> timer;
+      uint32_t timerGeneration;
+
+      ForwardClientState()
+         : reply(&arena),
+           cancel(&arena),
+           request(&arena),
+           dnssecOk(false),
+           udpExhausted(false),
+           idx(0),
+           timeoutIdx(0),
+           attempts(0),
+           timerGeneration(0)
+      {
+      }
 
       void
       Reply(const void *buf, size_t len);
 
       void
       Cancel();
+
+      void
+      CancelTimer();
+   };
+
+   // A socket connected to one upstream, bound to a random port, so that
+   // the kernel hands it only that upstream's answers to queries sent from
+   // it.  They're matched against its own map and never reach
+   // HandleMessage().
+   //
+   struct UpstreamSocket
+   {
+      std::shared_ptr<UdpSocket> sock;
+      ResponseMap map;
+   };
+
+   struct UpstreamPool
+   {
+      std::shared_ptr<ForwardServerState> server;    // keeps the key alive
+      std::vector<std::shared_ptr<UpstreamSocket>> sockets;
+      size_t next;
+
+      UpstreamPool() : next(0) {}
    };
 
-   std::shared_ptr<common::SocketHandle> udpSocket, udp6Socket;
+   std::shared_ptr<UdpSocket> udpSocket, udp6Socket;
    ResponseMap udpResp, udp6Resp;
    std::vector<std::shared_ptr<ForwardServerState>> forwardServers;
+   std::unordered_map<const ForwardServerState*, UpstreamPool> upstreamPools;
    RequestMap<bool> udpDeDupe;
-   RequestMap<std::shared_ptr<ForwardClientState>> forwardReqs;
+   RequestMap<std::shared_ptr<ForwardClientState>> forwardReqs;   // keyed on DO too
    struct rng_state *rng;
    std::string searchPath;
-   sqlite::sqlite cacheDb;
-   std::map<std::string, LocalEntry> localEntries;
+   std::shared_ptr<Cache> sharedCache;
+   Cache &cache;
+   std::vector<char> cachePayload;
+   std::string cacheFile;
+   int cacheSaveInterval;
+   common::Pointer<pollster::event> cacheSaveTimer;
+   std::mutex cacheSaveLock;        // held for the length of a Save()
+   std::atomic<bool> cacheSaving;   // a periodic save is running
+   common::Pointer<pollster::event> cacheSweepTimer;
+   uint32_t staleWindow;
+   uint32_t staleTtl;
+   uint32_t servfailTtl;
+   uint32_t prefetchPercent;
+   uint32_t prefetchMinHits;
+   int statsInterval;
+   common::Pointer<pollster::event> statsTimer;
+   ServerStats stats;
+   uint16_t ednsBufferSize;      // 0 if EDNS is off
+   bool minimalResponses;
+   bool ioUring;                 // UDP through io_uring, where the kernel has it
+   int upstreamSockets;          // per upstream, per worker
+   int upstreamBatchDepth;
+   std::vector<std::shared_ptr<UdpSocket>> upstreamBatch;   // pool sockets batching until it ends
+   std::mutex upstreamIoLock;    // guards upstreamIo, which the primary reads for stats
+   std::vector<std::shared_ptr<UdpSocket>> upstreamIo;      // every pool socket opened
+   std::unordered_map<DomainName, LocalEntry, DomainName::Hasher> localEntries;
+   int workerCount;
+   std::vector<std::shared_ptr<Server>> workers;
+   std::vector<std::thread> workerThreads;
+   Server *primary;              // for workers; outlives them
+   std::atomic<bool> stopping;   // for workers: leave the loop
+   common::Pointer<pollster::waiter> workerLoop;
+   std::shared_ptr<Mailbox> mailbox;
+   ResponseMap primaryResp;      // for workers: TCP answers posted back by the primary
+
+   // The worker's own event loop, or the common one.
+   //
+   void
+   GetLoop(pollster::waiter **loop, error *err);
 
    void
    TryForwardPacket(
       const struct sockaddr *addr,
       void *buf, size_t len,
-      const Message &msg,
+      const MessageView &msg,
       const std::function<void(const void *, size_t, error *)> &reply,
       error *err      
    );
@@ -146,28 +352,66 @@ private:
    void
    TryForwardPacket(const std::shared_ptr<ForwardClientState> &state, error *err);
 
-   void
-   InitializeCache(error *err);
+   bool
+   TryCache(
+      const void *buf,
+      size_t len,
+      const std::function<void(const void *, size_t, error *)> &reply
+   );
 
    bool
    TryCache(
-      const Message &msg,
+      const MessageView &msg,
       const std::function<void(const void *, size_t, error *)> &reply
    );
 
+   bool
+   ReplayCached(
+      const CacheKey &key,
+      const MessageHeader *query,
+      const void *question,
+      size_t questionLen,
+      const std::function<void(const void *, size_t, error *)> &reply
+   );
+
+   void
+   RefreshCached(const void *response, size_t len, bool dnssecOk);
+
+   // dnssecOk says whether the query asked for DNSSEC records; answers
+   // to DO queries are kept apart from the rest.
+   //
    void
-   CacheReply(const void *buf, size_t len);
+   CacheReply(const void *buf, size_t len, bool dnssecOk);
+
+   // RRset layer; see cache.cc.
+   //
+   bool
+   TryCacheRRsets(
+      const MessageView &msg,
+      const DomainName &name,
+      const std::function<void(const void *, size_t, error *)> &reply
+   );
 
-   std::string
-   SanitizeHost(const std::string &str, error *err);
+   bool
+   AppendCachedRRset(
+      const CacheKey &key,
+      uint64_t now,
+      const DomainName &owner,
+      MessageWriter &response,
+      DomainName *target,
+      error *err
+   );
+
+   void
+   CacheRRsets(const void *buf, size_t len, const MessageView &msg);
 
    LocalEntry
    ParseLocalEntry(int argc, char **argv, error *err);
 
    bool
    TryLocalEntry(
-      const std::string sanitizedHostname,
-      const Message &msg,
+      const DomainName &name,
+      const MessageView &msg,
       const std::function<void(const void *, size_t, error *)> &reply
    );
 
@@ -176,20 +420,67 @@ private:
       const std::shared_ptr<ForwardServerState> &state,
       const void *buf,
       size_t len,
-      const Message *msg,
+      const MessageView *msg,
       const ResponseMap::Callback &cb,
-      std::function<void()> *cancel,
+      RequestHandle *cancel,
+      error *err
+   );
+
+   // The next socket in this upstream's pool, opening another if the pool
+   // isn't full yet.
+   //
+   void
+   GetUpstreamSocket(
+      const std::shared_ptr<ForwardServerState> &state,
+      std::shared_ptr<UpstreamSocket> *out,
+      error *err
+   );
+
+   void
+   OpenUpstreamSocket(
+      const struct sockaddr *addr,
+      std::shared_ptr<UpstreamSocket> *out,
       error *err
    );
 
+   void
+   HandleUpstreamReplies(UpstreamSocket &up, error *err);
+
+   // While an upstream batch is open, as it is for each wakeup of a
+   // listener, upstream queries queue on their pool sockets, and each of
+   // those flushes once when the batch ends.
+   //
+   void
+   BeginUpstreamBatch() { ++upstreamBatchDepth; }
+
+   void
+   EndUpstreamBatch(error *err);
+
+   void
+   BatchUpstream(const std::shared_ptr<UdpSocket> &sock);
+
    void
    SendTcp(
       const std::shared_ptr<ForwardServerState> &state,
       const void *buf,
       size_t len,
-      const Message *msg,
+      const MessageView *msg,
+      const ResponseMap::Callback &cb,
+      RequestHandle *cancel,
+      error *err
+   );
+
+   // SendTcp() for workers: the primary owns upstream connections, so the
+   // query is posted to it, and the answer posted back to be matched in
+   // primaryResp like any other.
+   //
+   void
+   SendTcpViaPrimary(
+      const std::shared_ptr<ForwardServerState> &state,
+      const void *buf,
+      size_t len,
       const ResponseMap::Callback &cb,
-      std::function<void()> *cancel,
+      RequestHandle *cancel,
       error *err
    );
 
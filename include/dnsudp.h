@@ -0,0 +1,123 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnsudp_h_
+#define dnsudp_h_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include <common/c++/handle.h>
+#include <common/error.h>
+
+#include <pollster/sockapi.h>
+
+#include "dnscounter.h"
+#include "dnsmsg.h"
+
+namespace dns {
+
+class UdpRing;
+
+struct UdpCounters
+{
+   Counter Reads;          // receive syscalls, or io_uring reaps, that returned datagrams
+   Counter DatagramsIn;
+   Counter Writes;         // send syscalls
+   Counter DatagramsOut;
+   Counter DatagramsDropped;  // queued replies the kernel refused
+};
+
+//
+// A UDP socket with batched I/O.  Receive() reads as many datagrams as
+// one call will give, up to MaxBatch, with recvmmsg() on Linux.  While a
+// batch is open, as it is for each wakeup of the listener, Send() only
+// queues, and everything queued goes out when the batch ends, in one
+// sendmmsg() on Linux.  Elsewhere both fall back to a syscall per
+// datagram.  Sends outside of a batch, from timers and TCP callbacks, go
+// out at once.
+//
+// With a Ring, receives and batched sends go through io_uring instead;
+// see UdpRing.
+//
+
+class UdpSocket
+{
+public:
+   enum
+   {
+      MaxBatch = 32,
+   };
+
+   union Address
+   {
+      struct sockaddr sa;
+      struct sockaddr_in sin;
+      struct sockaddr_in6 sin6;
+   };
+
+   struct Datagram
+   {
+      Address addr;           // AF_UNSPEC if queued on a connected socket
+      size_t len;
+      char data[MaxUdpPayload];
+
+      // The destination to hand the kernel, null for a connected socket.
+      //
+      const struct sockaddr *
+      Name() const { return addr.sa.sa_family == AF_UNSPEC ? nullptr : &addr.sa; }
+
+      socklen_t
+      NameLength() const { return addr.sa.sa_family == AF_UNSPEC ? 0 : pollster::socklen(&addr.sa); }
+   };
+
+   std::shared_ptr<common::SocketHandle> Fd;
+   std::shared_ptr<UdpRing> Ring;
+   UdpCounters Counters;
+
+   UdpSocket() : depth(0), queued(0) {}
+   UdpSocket(const UdpSocket&) = delete;
+
+   void
+   BeginBatch() { ++depth; }
+
+   void
+   EndBatch(error *err)
+   {
+      if (!--depth)
+         Flush(err);
+   }
+
+   // addr is null on a connected socket.
+   //
+   void
+   Send(const struct sockaddr *addr, const void *buf, size_t len, error *err);
+
+   void
+   Flush(error *err);
+
+   // Returns how many datagrams were read into Received(), or 0 if none
+   // were waiting.
+   //
+   size_t
+   Receive(error *err);
+
+   Datagram *
+   Received() { return in.data(); }
+
+private:
+   int depth;
+   size_t queued;
+   std::vector<Datagram> in, out;    // MaxBatch each, allocated on first use
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#ifndef dnsuring_h_
+#define dnsuring_h_ 1
+
+#include <stddef.h>
+#include <memory>
+
+#include <common/c++/handle.h>
+#include <common/error.h>
+
+#include "dnsudp.h"
+
+namespace dns {
+
+//
+// io_uring I/O for a UdpSocket, on Linux.  One multishot recvmsg stays
+// armed on the socket, with the kernel picking buffers from a provided
+// buffer ring, so datagrams arrive as completions without a receive call
+// per wakeup.  Sends are queued as sendmsg submissions and go to the
+// kernel together in one io_uring_enter().  The ring's own descriptor is
+// what goes to the event loop; it's readable when completions wait.
+//
+// This talks to the kernel directly rather than through liburing, and
+// needs Linux 6.0 or later.  Start() fails where the kernel can't do it,
+// and the socket is then served the ordinary way.
+//
+
+class UdpRing
+{
+public:
+   enum
+   {
+      Entries = 256,          // submission queue; completions get twice that
+      BufferCount = 256,      // provided receive buffers, a power of two
+      SendSlots = 128,        // sends in flight
+   };
+
+   UdpRing();
+   UdpRing(const UdpRing&) = delete;
+   ~UdpRing();
+
+   void
+   Start(const std::shared_ptr<common::SocketHandle> &sock, error *err);
+
+   const std::shared_ptr<common::SocketHandle> &
+   Fd() const { return fd; }
+
+   // Take up to max received datagrams from the completion queue, and
+   // re-arm the receive if the kernel stopped it.  Needs no system call
+   // unless it has to re-arm.
+   //
+   size_t
+   Receive(UdpSocket::Datagram *out, size_t max, error *err);
+
+   // Queue these for sending and submit them.  Returns the number of
+   // system calls made.
+   //
+   size_t
+   Send(const UdpSocket::Datagram *d, size_t n, error *err);
+
+private:
+   struct Rings;
+
+   std::shared_ptr<common::SocketHandle> fd;
+   std::unique_ptr<Rings> rings;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnsarena.h>
+
+#include <stdlib.h>
+
+thread_local dns::ArenaCounters dns::Arena::Counters;
+thread_local dns::Arena::Chunk *dns::Arena::freeList = nullptr;
+thread_local size_t dns::Arena::freeCount = 0;
+
+void *
+dns::Arena::AllocateSlow(size_t n, size_t align)
+{
+   Chunk *chunk = nullptr;
+   char *p = nullptr;
+
+   // Anything that would take up most of a chunk gets one of its own,
+   // and the current chunk stays open.
+   //
+   if (n + align > (ChunkSize - HeaderSize) / 2)
+   {
+      size_t size = HeaderSize + n + align;
+      chunk = (Chunk*)malloc(size);
+      if (!chunk)
+         throw std::bad_alloc();
+      ++Counters.BlockMallocs;
+      chunk->size = size;
+      chunk->next = chunks;
+      chunks = chunk;
+
+      p = (char*)chunk + HeaderSize;
+      return (void*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+   }
+
+   if (freeList)
+   {
+      chunk = freeList;
+      freeList = chunk->next;
+      --freeCount;
+      ++Counters.BlockReuses;
+   }
+   else
+   {
+      chunk = (Chunk*)malloc(ChunkSize);
+      if (!chunk)
+         throw std::bad_alloc();
+      ++Counters.BlockMallocs;
+      chunk->size = ChunkSize;
+   }
+   chunk->next = chunks;
+   chunks = chunk;
+
+   cur = (char*)chunk + HeaderSize;
+   end = (char*)chunk + ChunkSize;
+   return Allocate(n, align);
+}
+
+void
+dns::Arena::Reset()
+{
+   while (chunks)
+   {
+      auto chunk = chunks;
+      chunks = chunk->next;
+
+      if (chunk->size == ChunkSize && freeCount < MaxFreeChunks)
+      {
+         chunk->next = freeList;
+         freeList = chunk;
+         ++freeCount;
+      }
+      else
+      {
+         free(chunk);
+      }
+   }
+
+   cur = end = nullptr;
+}
@@ -6,297 +6,1015 @@
  copyright notice and this permission notice appear in all copies.
 */
 
+#include <pollster/pollster.h>
+
 #include <dnsserver.h>
 #include <dnsmsg.h>
+#include <dnsrdata.h>
 
-#include <sqlite3.h>
-
+#include <common/logger.h>
 #include <common/time.h>
 
+#include <chrono>
+#include <system_error>
+#include <thread>
+
+//
+// Cached answers live in a dns::Cache, keyed on the raw question: the
+// name in wire format, folded to lowercase, plus the queried type and
+// class.  The payload of each entry is the complete upstream response,
+// preceded by a table of offsets to every TTL field inside it.  A hit
+// copies the response, patches the ID and counts the TTLs down, so it
+// needs neither a full parse of the query nor any re-serialization.
+// The cache can be backed by a snapshot file, written periodically and at
+// shutdown, and mapped on startup so that restarts don't begin cold.
+//
+// Payload layout:
+//
+//    uint16_t count;
+//    uint16_t ttlOffsets[count];
+//    char response[];
 //
-// For now, the cache is an in-memory sqlite database.  It is written that way
-// with the idea that perhaps later it persists on-disk between server restarts.
+// Positive answers are also split into RRsets, each cached under its own
+// owner name and type, so that a CNAME and its target are stored once no
+// matter how many aliases lead to them.  When a question misses above,
+// the answer is assembled from these by following CNAMEs.  Names inside
+// RDATA are stored uncompressed (see dnsrdata.h), so each RRset stands on
+// its own, and MessageWriter compresses them again on the way out:
 //
+//    uint16_t count;
+//    struct { uint16_t length; char rdata[length]; } records[count];
+//
+
+namespace {
+
+const size_t MaxNameLength = 255;
+
+// RFC 2308 section 5 suggests holding negative answers no longer than one
+// to three hours, and section 7.1 caps server failures at five minutes.
+//
+const uint32_t MaxNegativeTtl = 3 * 60 * 60;
+const uint32_t MaxServerFailureTtl = 5 * 60;
+
+const int MaxCnameChain = 8;
 
-std::string
-dns::Server::SanitizeHost(const std::string &str, error *err)
+// Expiry sweeps run often and stop early, so that none of them holds up
+// the loop for long.
+//
+const int SweepIntervalMs = 100;
+const size_t SweepSteps = 1024;
+
+// Fill in key from the first question of a packet, copying the name into
+// name[MaxNameLength].  Returns the offset just past the question, or 0 if
+// the question can't be used as a key.
+//
+size_t
+QuestionKey(const void *buf, size_t len, char *name, dns::CacheKey &key)
 {
-   // Force ASCII lowercase to do locale-insensitive folding for caching
-   // purposes.  No fancy localization.
+   auto p = (const unsigned char*)buf;
+   size_t off = sizeof(dns::MessageHeader);
+   size_t n = 0;
+   const dns::QuestionAttrs *attrs = nullptr;
+
+   for (;;)
+   {
+      if (off >= len)
+         return 0;
+
+      unsigned char l = p[off++];
+
+      // A compression pointer in the first name of a packet would
+      // have nothing to point at.
+      //
+      if ((l & 0xc0) || off + l > len || n + 1 + l > MaxNameLength)
+         return 0;
+
+      name[n++] = l;
+      if (!l)
+         break;
+
+      memcpy(name + n, p + off, l);
+      n += l;
+      off += l;
+   }
+
+   if (off + sizeof(*attrs) > len)
+      return 0;
+
+   // Length bytes are below 64, so folding the whole thing only touches
+   // the labels.
    //
-   try
+   dns::FoldName(name, name, n);
+
+   attrs = (const dns::QuestionAttrs*)(p + off);
+
+   key.Name = name;
+   key.NameLength = n;
+   key.Type = attrs->Type.Get();
+   key.Class = attrs->Class.Get();
+
+   return off + sizeof(*attrs);
+}
+
+// Marks key for DO if the query in buf has it.  off is just past the
+// question.  Only a lone OPT record right after the question is looked
+// at; anything else there returns false, for the parsed path to handle.
+//
+bool
+OptKey(const void *buf, size_t len, size_t off, dns::CacheKey &key)
+{
+   auto hdr = (const dns::MessageHeader*)buf;
+   auto p = (const unsigned char*)buf;
+   dns::RecordAttrs attrs;
+
+   if (!hdr->AdditionalRecordCount.Get())
+      return true;
+
+   if (hdr->AnswerCount.Get() ||
+       hdr->AuthorityNameCount.Get() ||
+       hdr->AdditionalRecordCount.Get() != 1 ||
+       off + 1 + offsetof(dns::RecordAttrs, Data) > len ||
+       p[off])
    {
-      std::string r;
-      for (auto ch : str)
-      {
-         r.push_back(ch >= 'A' && ch <= 'Z' ? ch + 'a'-'A' : ch);
-      }
-      return r;
+      return false;
    }
-   catch (const std::bad_alloc &)
+
+   memcpy(&attrs, p + off + 1, offsetof(dns::RecordAttrs, Data));
+   if (attrs.Type.Get() != (uint16_t)dns::Type::OPT)
+      return false;
+
+   if (attrs.Ttl.Get() & dns::OptDnssecOk)
+      key.Kind |= dns::CacheDnssecOk;
+   return true;
+}
+
+// Same as the first QuestionKey(), for a question whose name has already
+// been read.  The key refers to name.
+//
+bool
+QuestionKey(const dns::DomainName &name, const dns::QuestionAttrs *attrs, dns::CacheKey &key)
+{
+   if (name.Empty())
+      return false;
+
+   key.Name = name.Folded();
+   key.NameLength = name.Length();
+   key.Type = attrs->Type.Get();
+   key.Class = attrs->Class.Get();
+   return true;
+}
+
+inline uint16_t
+ReadOffset(const char *p)
+{
+   uint16_t r;
+   memcpy(&r, p, sizeof(r));
+   return r;
+}
+
+inline void
+WriteOffset(char *p, uint16_t off)
+{
+   memcpy(p, &off, sizeof(off));
+}
+
+} // end namespace
+
+bool
+dns::Server::TryCache(
+   const void *buf,
+   size_t len,
+   const std::function<void(const void *, size_t, error *)> &reply
+)
+{
+   auto hdr = (const MessageHeader*)buf;
+   char name[MaxNameLength];
+   CacheKey key;
+   size_t qlen = 0;
+
+   if (len < sizeof(*hdr) ||
+       hdr->Response ||
+       hdr->Opcode ||
+       hdr->QuestionCount.Get() != 1)
    {
-      error_set_nomem(err);
-      return std::string();
+      return false;
    }
+
+   qlen = QuestionKey(buf, len, name, key);
+   if (!qlen || !OptKey(buf, len, qlen, key))
+      return false;
+
+   // Local entries override anything cached or loaded from a snapshot;
+   // leave those names to the parsed path, which checks them first.
+   //
+   if (localEntries.size())
+   {
+      DomainName domain;
+
+      if (!domain.AssignWire(name, key.NameLength) || localEntries.count(domain))
+         return false;
+   }
+
+   return ReplayCached(key, hdr, (const char*)buf + sizeof(*hdr), qlen - sizeof(*hdr), reply);
 }
 
-void
-dns::Server::InitializeCache(error *err)
+bool
+dns::Server::TryCache(
+   const MessageView &msg,
+   const std::function<void(const void *, size_t, error *)> &reply
+)
 {
-   static const char *schema[] =
-   {
-      "create table dns_cache("
-         "name STRING,"
-         "queried_type INTEGER,"
-         "queried_class INTEGER,"
-         "response_code INTEGER,"
-         "response_time INTEGER,"
-         "response_ttl INTEGER,"
-         "response_type INTEGER,"
-         "response_class INTEGER,"
-         "response BLOB"
-      ")",
-      "create index cache_by_string on dns_cache(name, response_type)",
-      NULL,
-   };
+   bool found = false;
+   CacheKey key;
+   DomainName name;
 
-   if (cacheDb.is_open())
+   if (!msg.Header ||
+       msg.QuestionCount != 1 ||
+       !msg.Questions[0].Name.ToDomainName(&name))
+   {
       goto exit;
+   }
 
-   cacheDb.open(":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr, err);
-   ERROR_CHECK(err);
+   if (TryLocalEntry(name, msg, reply))
+   {
+      found = true;
+      goto exit;
+   }
 
-   cacheDb.exec(schema, err);
-   ERROR_CHECK(err);
+   if (!QuestionKey(name, msg.Questions[0].Attrs, key))
+      goto exit;
 
-exit:;
+   // RRSIGs aren't kept with RRsets, so DO queries only get whole
+   // responses.
+   //
+   if (DnssecOk(msg))
+   {
+      key.Kind |= CacheDnssecOk;
+      found = ReplayCached(key, msg.Header, nullptr, 0, reply);
+   }
+   else
+   {
+      found = ReplayCached(key, msg.Header, nullptr, 0, reply) ||
+              TryCacheRRsets(msg, name, reply);
+   }
+
+exit:
+   return found;
 }
 
 bool
-dns::Server::TryCache(
-   const Message &msg,
+dns::Server::TryCacheRRsets(
+   const MessageView &msg,
+   const DomainName &name,
    const std::function<void(const void *, size_t, error *)> &reply
 )
 {
    error errStorage;
    error *err = &errStorage;
    bool found = false;
-   sqlite::statement stmt;
-   std::string host;
-
-   if (!msg.Header || msg.Questions.size() != 1)
+   Arena arena;
+   MessageWriter response(&arena);
+   Question *q = nullptr;
+   CacheKey key;
+   uint16_t type = msg.Questions[0].Attrs->Type.Get();
+   uint64_t now = get_current_time();
+   DomainName owner = name;
+   DomainName target;
+
+   // A cached RRset is never the whole answer to ANY.
+   //
+   if ((QType)type == QType::ALL ||
+       !QuestionKey(owner, msg.Questions[0].Attrs, key))
+   {
       goto exit;
+   }
+   key.Kind = CacheRRset;
 
-   host = SanitizeHost(msg.Questions[0].Name, err);
-   ERROR_CHECK(err);
+   for (int depth = 0; depth <= MaxCnameChain; ++depth)
+   {
+      key.Type = type;
+      if (AppendCachedRRset(key, now, owner, response, nullptr, err))
+      {
+         found = true;
+         break;
+      }
+      ERROR_CHECK(err);
 
-   if (TryLocalEntry(host, msg, reply))
+      // Not here; maybe it's an alias.  Follow it, and look for the
+      // target under the same key in the next pass.
+      //
+      key.Type = (uint16_t)Type::CNAME;
+      if (type == key.Type ||
+          !AppendCachedRRset(key, now, owner, response, &target, err))
+      {
+         goto exit;
+      }
+
+      owner = target;
+      key.Name = owner.Folded();
+      key.NameLength = owner.Length();
+   }
+   if (!found)
       goto exit;
 
-   InitializeCache(err);
+   // Strings only from here, now that there's an answer to write.
+   //
+   q = response.AddQuestion(err);
    ERROR_CHECK(err);
-
-   cacheDb.prepare(
-      "SELECT response_code, response_type, response_class, response_time, response_ttl, response "
-              "FROM dns_cache "
-              "WHERE name = ? AND queried_type = ? AND queried_class = ?",
-      stmt,
-      err
-   );
+   msg.Questions[0].Name.ToString(q->Name, err);
    ERROR_CHECK(err);
+   *q->Attrs = *msg.Questions[0].Attrs;
 
-   stmt.bind_multi(
-      err,
-      0,
-      host,
-      (int64_t)msg.Questions[0].Attrs->Type.Get(),
-      (int64_t)msg.Questions[0].Attrs->Class.Get()
-   );
-   ERROR_CHECK(err);
+   response.Header->Id.Put(msg.Header->Id.Get());
+   response.Header->Response = 1;
+   response.Header->RecursionDesired = msg.Header->RecursionDesired;
+   response.Header->RecursionAvailable = 1;
 
-   if (stmt.step(err))
    {
-      MessageWriter response;
-
-      response.Header->Id = msg.Header->Id;
-      response.Header->Response = 1;
+      auto blob = response.Serialize(err);
+      ERROR_CHECK(err);
 
-      auto q = response.AddQuestion(err);
+      reply(blob.data(), blob.size(), err);
       ERROR_CHECK(err);
+   }
+
+exit:
+   return found && !ERROR_FAILED(err);
+}
+
+bool
+dns::Server::AppendCachedRRset(
+   const CacheKey &key,
+   uint64_t now,
+   const DomainName &owner,
+   MessageWriter &response,
+   DomainName *target,
+   error *err
+)
+{
+   bool found = false;
+   CacheEntryInfo info;
+   std::vector<char> &payload = cachePayload;
+   const char *p = nullptr, *end = nullptr;
+   size_t count = 0;
+
+   if (!cache.Lookup(key, payload, &info, err) ||
+       info.Time > now ||
+       info.Time + info.Ttl < now ||
+       payload.size() < sizeof(uint16_t))
+   {
+      goto exit;
+   }
+
+   p = payload.data();
+   end = p + payload.size();
+   count = ReadOffset(p);
+   p += sizeof(uint16_t);
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      uint16_t rdlen = 0;
+
+      if (p + sizeof(rdlen) > end)
+         goto exit;
+      rdlen = ReadOffset(p);
+      p += sizeof(rdlen);
+      if (p + rdlen > end)
+         goto exit;
 
+      auto rec = response.AddAnswer(rdlen, err);
+      ERROR_CHECK(err);
       try
       {
-         q->Name = msg.Questions[0].Name;
+         rec->Name = owner.ToString();
       }
-      catch (const std::bad_alloc &)
+      catch (const std::bad_alloc&)
       {
          ERROR_SET(err, nomem);
       }
-      *q->Attrs = *msg.Questions[0].Attrs;
+      rec->Attrs->Type.Put(key.Type);
+      rec->Attrs->Class.Put(key.Class);
+      rec->Attrs->Ttl.Put(info.Ttl - (now - info.Time));
+      memcpy(rec->Attrs->Data, p, rdlen);
 
-      uint64_t current_time = get_current_time();
-      std::vector<char> blob;
-      do
+      // Names in cached RDATA are stored whole.
+      //
+      if (target && !i && !target->AssignWire(p, rdlen))
+         goto exit;
+
+      p += rdlen;
+   }
+
+   found = (count != 0);
+exit:
+   return found;
+}
+
+void
+dns::Server::CacheRRsets(const void *buf, size_t len, const MessageView &msg)
+{
+   error errStorage;
+   error *err = &errStorage;
+   size_t nanswers = msg.Header->AnswerCount.Get();
+   std::vector<char> &payload = cachePayload;
+   std::vector<bool> done;
+   char owner[MaxNameLength], other[MaxNameLength];
+   CacheKey key;
+   CacheEntryInfo info;
+   DomainName chain[MaxCnameChain + 1];
+   size_t chainLength = 0;
+   DomainName name;
+
+   auto onChain = [&] (const char *folded, size_t n) -> bool
+   {
+      for (size_t i = 0; i < chainLength; ++i)
       {
-         int64_t rc, type, class_, time, ttl;
+         if (chain[i].Length() == n && !memcmp(chain[i].Folded(), folded, n))
+            return true;
+      }
+      return false;
+   };
+
+   // Answers to ANY can be partial RRsets (RFC 8482).
+   //
+   if ((QType)msg.Questions[0].Attrs->Type.Get() == QType::ALL)
+      goto exit;
 
-         stmt.column_multi(err, 0, rc, type, class_, time, ttl, blob);
-         ERROR_CHECK(err);
+   // Only the question name, and the aliases it leads to, are answers to
+   // this question.  Anything else in the section is the upstream
+   // vouching for names it wasn't asked about, which is how caches get
+   // poisoned.  CNAMEs may come in any order, so each step searches the
+   // whole section.
+   //
+   if (!msg.Questions[0].Name.ToDomainName(&chain[chainLength]))
+      goto exit;
+   ++chainLength;
 
-         if (time && (time > current_time || time + ttl < current_time))
-         {
-            // Stale TTL anywhere should mean discard cache.
-            //
-            goto exit;
-         }
-         else if (!time)
-         {
-            // Use TTL field from cache, but we don't have a write time for
-            // this cache record
-            //
-            time = current_time;
+   for (bool more = true; more && chainLength < MaxCnameChain + 1; )
+   {
+      more = false;
 
-            if (!ttl)
-               ttl = 5 * 60;
-         }
+      for (size_t i = 0; i < nanswers; ++i)
+      {
+         auto &rec = msg.Answers()[i];
+         size_t rdata = (const char*)rec.Attrs->Data - (const char*)buf;
 
-         if (rc != (int)ResponseCode::NoError)
+         if (rec.Attrs->Type.Get() != (uint16_t)Type::CNAME ||
+             !rec.Name.ToDomainName(&name) ||
+             name != chain[chainLength - 1])
          {
-            response.Header->ResponseCode = rc;
-            break;
+            continue;
          }
 
-         if (blob.size())
+         // The target can only be compressed against what came before
+         // it, so nothing past the RDATA is needed.
+         //
+         NameView target(buf, rdata + rec.Attrs->Length.Get(), rdata);
+         if (target.ToDomainName(&chain[chainLength]))
          {
-            auto answer = response.AddAnswer((uint16_t)blob.size(), err);
-            ERROR_CHECK(err);
+            ++chainLength;
+            more = true;
+         }
+         break;
+      }
+   }
 
-            try
-            {
-               answer->Name = msg.Questions[0].Name;
-            }
-            catch (const std::bad_alloc &)
+   try
+   {
+      done.resize(nanswers);
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   key.Kind = CacheRRset;
+   key.Name = owner;
+   info.Time = get_current_time();
+
+   for (size_t i = 0; i < nanswers; ++i)
+   {
+      auto &rec = msg.Answers()[i];
+      auto type = rec.Attrs->Type.Get();
+      auto cls = rec.Attrs->Class.Get();
+      size_t count = 0;
+      bool ok = true;
+
+      if (done[i])
+         continue;
+
+      key.NameLength = rec.Name.ToWire(owner, true);
+      key.Type = type;
+      key.Class = cls;
+
+      // Signatures for several types share an owner, so they don't make
+      // up an RRset by themselves.
+      //
+      if (!key.NameLength ||
+          type == (uint16_t)Type::RRSIG ||
+          !onChain(owner, key.NameLength))
+      {
+         continue;
+      }
+
+      try
+      {
+         payload.resize(sizeof(uint16_t));
+
+         for (size_t j = i; j < nanswers && ok; ++j)
+         {
+            auto &member = msg.Answers()[j];
+            if (done[j] ||
+                member.Attrs->Type.Get() != type ||
+                member.Attrs->Class.Get() != cls ||
+                member.Name.ToWire(other, false) != key.NameLength ||
+                !NameEqualsIgnoringCase(owner, other, key.NameLength))
             {
-               ERROR_SET(err, nomem);
+               continue;
             }
-            answer->Attrs->Type.Put(type);
-            answer->Attrs->Class.Put(class_);
-            answer->Attrs->Ttl.Put(time + ttl - current_time);
-            memcpy(answer->Attrs->Data, blob.data(), blob.size());
+            done[j] = true;
+
+            auto ttl = member.Attrs->Ttl.Get();
+            if (!count || ttl < info.Ttl)
+               info.Ttl = ttl;
+
+            size_t lenOff = payload.size();
+            payload.resize(lenOff + sizeof(uint16_t));
+            ok = ExpandRdata(buf, len, member.Attrs, payload) &&
+                 payload.size() - lenOff - sizeof(uint16_t) <= 0xffff;
+            if (ok)
+               WriteOffset(payload.data() + lenOff, payload.size() - lenOff - sizeof(uint16_t));
+            ++count;
          }
-      } while (stmt.step(err));
-      ERROR_CHECK(err);
+      }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(err, nomem);
+      }
 
-      blob = response.Serialize(err);
-      ERROR_CHECK(err);
+      if (!ok || count > 0xffff)
+         continue;
+      WriteOffset(payload.data(), count);
 
-      reply(blob.data(), blob.size(), err);
+      cache.Insert(key, info, payload.data(), payload.size(), err);
       ERROR_CHECK(err);
-      found = true;
    }
+
+exit:;
+}
+
+bool
+dns::Server::ReplayCached(
+   const CacheKey &key,
+   const MessageHeader *query,
+   const void *question,
+   size_t questionLen,
+   const std::function<void(const void *, size_t, error *)> &reply
+)
+{
+   error errStorage;
+   error *err = &errStorage;
+   bool found = false;
+   CacheEntryInfo info;
+   std::vector<char> &payload = cachePayload;
+   uint64_t current_time = 0;
+   uint64_t elapsed = 0;
+   size_t nttl = 0;
+   char *response = nullptr;
+   size_t responseLen = 0;
+   MessageHeader *hdr = nullptr;
+   bool stale = false;
+
+   if (!cache.Lookup(key, payload, &info, err))
+      goto exit;
+
+   current_time = get_current_time();
+   if (info.Time > current_time ||
+       info.Time + info.Ttl + staleWindow < current_time)
+   {
+      if ((info.Flags & CachePrefetched) && !info.Hits)
+         stats.PrefetchWasted++;
+      cache.Remove(key);
+      goto exit;
+   }
+   elapsed = current_time - info.Time;
+
+   // Past its TTL but inside the serve-stale window (RFC 8767): answer
+   // with a short TTL now, and refresh in the background.
+   //
+   stale = (info.Time + info.Ttl < current_time);
+
+   if (payload.size() < sizeof(uint16_t))
+      goto exit;
+   nttl = ReadOffset(payload.data());
+   response = payload.data() + sizeof(uint16_t) * (1 + nttl);
+   if (response + sizeof(*hdr) > payload.data() + payload.size())
+      goto exit;
+   responseLen = payload.data() + payload.size() - response;
+
+   hdr = (MessageHeader*)response;
+   hdr->Id = query->Id;
+   hdr->RecursionDesired = query->RecursionDesired;
+
+   // Echo the question back as the client spelled it.
+   //
+   if (question && sizeof(*hdr) + questionLen <= responseLen)
+      memcpy(response + sizeof(*hdr), question, questionLen);
+
+   for (size_t i = 0; i < nttl; ++i)
+   {
+      auto off = ReadOffset(payload.data() + sizeof(uint16_t) * (1 + i));
+      if (off + sizeof(I32) > responseLen)
+         continue;
+      auto ttl = (I32*)(response + off);
+      auto value = ttl->Get();
+      if (stale)
+         ttl->Put(staleTtl);
+      else
+         ttl->Put(value > elapsed ? value - elapsed : 0);
+   }
+
+   reply(response, responseLen, err);
    ERROR_CHECK(err);
+   found = true;
+
+   if (stale)
+   {
+      RefreshCached(response, responseLen, key.Kind & CacheDnssecOk);
+   }
+   else if (!(info.Flags & CachePrefetchPending) &&
+            prefetchPercent &&
+            info.Hits + 1 >= prefetchMinHits &&
+            (info.Time + info.Ttl - current_time) * 100 < (uint64_t)info.Ttl * prefetchPercent)
+   {
+      // Popular and about to expire: refresh it before anyone has to
+      // wait on upstream for it.
+      //
+      cache.SetFlags(key, CachePrefetchPending);
+      stats.PrefetchIssued++;
+      RefreshCached(response, responseLen, key.Kind & CacheDnssecOk);
+   }
 
 exit:
    return found;
 }
 
 void
-dns::Server::CacheReply(const void *buf, size_t len)
+dns::Server::RefreshCached(const void *response, size_t len, bool dnssecOk)
 {
-   Message msg;
    error errStorage;
    error *err = &errStorage;
-   sqlite::statement stmt;
-   uint64_t current_time = get_current_time();
-   std::string host;
+   char name[MaxNameLength];
+   CacheKey key;
+   size_t qlen = 0;
+   MessageHeader *hdr = nullptr;
+   Arena arena;
+   MessageView msg;
+   ArenaVector<char> query(&arena);
+
+   qlen = QuestionKey(response, len, name, key);
+   if (!qlen)
+      goto exit;
+   if (dnssecOk)
+      key.Kind |= CacheDnssecOk;
 
-   InitializeCache(err);
-   ERROR_CHECK(err);
+   try
+   {
+      query.insert(query.end(), (const char*)response, (const char*)response + qlen);
+      if (dnssecOk)
+         query.resize(qlen + OptRecordLength);
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
 
-   ParseMessage(buf, len, &msg, err);
-   ERROR_CHECK(err);
+   hdr = (MessageHeader*)query.data();
+   *hdr = MessageHeader();
+   hdr->RecursionDesired = 1;
+   hdr->QuestionCount.Put(1);
 
-   if (!msg.Header || msg.Questions.size() != 1)
-      goto exit;
+   // The forwarder puts in its own payload size, but keeps DO.
+   //
+   if (dnssecOk)
+      WriteOpt(hdr, query.data() + qlen, MinUdpPayload, true);
 
-   host = SanitizeHost(msg.Questions[0].Name, err);
+   ParseMessage(query.data(), query.size(), &msg, err);
    ERROR_CHECK(err);
 
-   cacheDb.prepare(
-      "DELETE FROM dns_cache WHERE name = ? AND queried_type = ? AND queried_class = ?",
-      stmt,
+   // No client address, so this joins any refresh already in flight via
+   // forwardReqs.  The reply is cached by the forwarding code.
+   //
+   TryForwardPacket(
+      nullptr,
+      query.data(), query.size(),
+      msg,
+      [] (const void *, size_t, error *) -> void {},
       err
    );
-
-   stmt.bind_multi(
-      err, 0,
-      host,
-      (int64_t)msg.Questions[0].Attrs->Type.Get(),
-      (int64_t)msg.Questions[0].Attrs->Class.Get()
-   );
    ERROR_CHECK(err);
 
-   stmt.step(err);
+exit:
+   // Never sent, so no answer will come along to clear it.
+   //
+   if (ERROR_FAILED(err) && key.NameLength)
+      cache.ClearFlags(key, CachePrefetchPending);
+}
+
+void
+dns::Server::CacheReply(const void *buf, size_t len, bool dnssecOk)
+{
+   MessageView msg;
+   error errStorage;
+   error *err = &errStorage;
+   char name[MaxNameLength];
+   CacheKey key;
+   CacheEntryInfo info, old;
+   std::vector<char> &payload = cachePayload;
+   size_t nttl = 0;
+   bool haveOld = false;
+   bool negative = false;
+   bool haveTtl = false;
+   const RecordView *soa = nullptr;
+
+   ParseMessage(buf, len, &msg, err);
    ERROR_CHECK(err);
 
-   if (!msg.Header->AnswerCount.Get())
-   {
-      cacheDb.prepare(
-         "INSERT INTO dns_cache VALUES (?, ?, ?, ?, ?, ?, NULL, NULL, NULL)",
-         stmt,
-         err
-      );
-      ERROR_CHECK(err);
-      stmt.bind_multi(
-         err, 0,
-         host,
-         (int64_t)msg.Questions[0].Attrs->Type.Get(),
-         (int64_t)msg.Questions[0].Attrs->Class.Get(),
-         (int64_t)msg.Header->ResponseCode,
-
-         // XXX: cache errors for 5 minutes.
-         // This is kind of arbitrary.
-         //
-         current_time,
-         (int64_t)(5*60)
-      );
-      ERROR_CHECK(err);
+   if (msg.QuestionCount != 1 || !msg.Complete || len > 0xffff)
+      goto exit;
 
-      stmt.step(err);
-      ERROR_CHECK(err);
-   }
-   else
+   key.Name = name;
+   key.NameLength = msg.Questions[0].Name.ToWire(name, true);
+   key.Type = msg.Questions[0].Attrs->Type.Get();
+   key.Class = msg.Questions[0].Attrs->Class.Get();
+   if (!key.NameLength)
+      goto exit;
+   if (dnssecOk)
+      key.Kind |= CacheDnssecOk;
+
+   info.Time = get_current_time();
+   info.ResponseCode = msg.Header->ResponseCode;
+
+   haveOld = cache.GetInfo(key, &old);
+
+   switch ((ResponseCode)msg.Header->ResponseCode)
    {
-      Record *rec, *end;
+   case ResponseCode::NoError:
+      negative = !msg.Header->AnswerCount.Get();
+      break;
+   case ResponseCode::NameError:
+      negative = true;
+      break;
+   case ResponseCode::ServerFailure:
+      // We only see these once every forwarder has failed.  Hold them
+      // down briefly, but never in place of an answer we can still
+      // serve stale.
+      //
+      if (!servfailTtl || (haveOld && old.ResponseCode != msg.Header->ResponseCode))
+         goto exit;
+      info.Ttl = servfailTtl < MaxServerFailureTtl ? servfailTtl : MaxServerFailureTtl;
+      haveTtl = true;
+      break;
+   default:
+      goto exit;
+   }
 
-      for (rec = msg.Answers, end = rec+msg.Header->AnswerCount.Get(); rec < end; ++rec)
+   // NXDOMAIN and NODATA are held for as long as the SOA in the authority
+   // section says (RFC 2308 section 5); without one, they aren't cached.
+   //
+   if (negative)
+   {
+      for (int i=0; i<msg.Header->AuthorityNameCount.Get(); ++i)
       {
-         cacheDb.prepare(
-            "INSERT INTO dns_cache VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
-            stmt,
-            err
-         );
-
-         stmt.bind_multi(
-            err, 0,
-            host,
-            (int64_t)msg.Questions[0].Attrs->Type.Get(),
-            (int64_t)msg.Questions[0].Attrs->Class.Get(),
-            (int64_t)msg.Header->ResponseCode,
-            current_time,
-            (int64_t)rec->Attrs->Ttl.Get(),
-            (int64_t)rec->Attrs->Type.Get(),
-            (int64_t)rec->Attrs->Class.Get()
-         );
-         ERROR_CHECK(err);
-
-         stmt.bind(8, rec->Attrs->Data, rec->Attrs->Length.Get(), err);
-         ERROR_CHECK(err);
-
-         stmt.step(err);
-         ERROR_CHECK(err);
+         auto &rec = msg.AuthorityNames()[i];
+         if (rec.Attrs->Type.Get() == (uint16_t)Type::SOA &&
+             rec.Attrs->Length.Get() >= 22)
+         {
+            soa = &rec;
+            break;
+         }
       }
+      if (!soa)
+         goto exit;
+
+      // MINIMUM is the last field of the RDATA, after two names that may
+      // be compressed.
+      //
+      I32 minimum;
+      memcpy(&minimum, soa->Attrs->Data + soa->Attrs->Length.Get() - sizeof(minimum), sizeof(minimum));
+
+      info.Ttl = soa->Attrs->Ttl.Get();
+      if (minimum.Get() < info.Ttl)
+         info.Ttl = minimum.Get();
+      if (MaxNegativeTtl < info.Ttl)
+         info.Ttl = MaxNegativeTtl;
+      haveTtl = true;
+   }
+
+   // An OPT record's TTL field holds EDNS flags rather than a time, so
+   // it's neither counted down nor allowed to bound the entry.
+   //
+   for (size_t i = 0; i < msg.RecordCount; ++i)
+   {
+      if (msg.Records[i].Attrs->Type.Get() != (uint16_t)Type::OPT)
+         ++nttl;
    }
 
+   try
+   {
+      payload.resize(sizeof(uint16_t) * (1 + nttl));
+      payload.insert(payload.end(), (const char*)buf, (const char*)buf + len);
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   WriteOffset(payload.data(), nttl);
+
+   for (size_t i = 0, j = 0; i < msg.RecordCount; ++i)
+   {
+      auto &rec = msg.Records[i];
+      auto ttl = rec.Attrs->Ttl.Get();
+      size_t off = (const char*)&rec.Attrs->Ttl - (const char*)buf;
+
+      if (rec.Attrs->Type.Get() == (uint16_t)Type::OPT)
+         continue;
+
+      if (!haveTtl || ttl < info.Ttl)
+         info.Ttl = ttl;
+      haveTtl = true;
+
+      WriteOffset(payload.data() + sizeof(uint16_t) * (1 + j++), off);
+   }
+
+   // The SOA's TTL in a negative answer is how long the negative answer
+   // lasts, which is what clients should count down from.
+   //
+   if (soa)
+   {
+      size_t off = (const char*)&soa->Attrs->Ttl - (const char*)buf;
+      I32 ttl;
+      ttl.Put(info.Ttl);
+      memcpy(payload.data() + sizeof(uint16_t) * (1 + nttl) + off, &ttl, sizeof(ttl));
+   }
+
+   if (!haveTtl)
+      goto exit;
+
+   if (haveOld)
+   {
+      if (old.Flags & CachePrefetchPending)
+         info.Flags |= CachePrefetched;
+      if ((old.Flags & CachePrefetched) && !old.Hits)
+         stats.PrefetchWasted++;
+   }
+
+   cache.Insert(key, info, payload.data(), payload.size(), err);
+   ERROR_CHECK(err);
+
+   if (!negative && info.ResponseCode == (unsigned)ResponseCode::NoError)
+      CacheRRsets(buf, len, msg);
+
+exit:
+   // Whether or not this answer replaced it, the refresh is over.  Timed
+   // out and failed ones end up here too, as SERVFAIL.  An entry that
+   // was replaced has no flags to clear.
+   //
+   if (haveOld && (old.Flags & CachePrefetchPending))
+      cache.ClearFlags(key, CachePrefetchPending);
+}
+
+void
+dns::Server::StartCacheSnapshots(error *err)
+{
+   common::Pointer<pollster::waiter> loop;
+   std::weak_ptr<Server> weak;
+
+   if (!cacheFile.size())
+      goto exit;
+
+   if (!cache.Map(cacheFile.c_str(), err))
+   {
+      ERROR_CHECK(err);
+      log_printf("cache: no usable snapshot at %s", cacheFile.c_str());
+   }
+
+   if (cacheSaveInterval <= 0 || cacheSaveTimer.Get())
+      goto exit;
+
+   weak = shared_from_this();
+
+   pollster::get_common_queue(loop.GetAddressOf(), err);
+   ERROR_CHECK(err);
+
+   loop->add_timer(
+      cacheSaveInterval * 1000,
+      true,
+      [weak] (pollster::event *ev, error *err) -> void
+      {
+         ev->on_signal = [weak] (error *err) -> void
+         {
+            auto rc = weak.lock();
+            if (!rc.get())
+               return;
+
+            // A save takes as long as the cache is big, so it runs on
+            // its own thread rather than holding up queries.  If the
+            // last one still hasn't finished, this one is skipped.
+            //
+            if (rc->cacheSaving.exchange(true))
+               return;
+
+            try
+            {
+               std::thread(
+                  [rc] () -> void
+                  {
+                     error err;
+
+                     rc->SaveCache(&err);
+                     if (ERROR_FAILED(&err))
+                        log_printf("cache: failed to write %s", rc->cacheFile.c_str());
+                     rc->cacheSaving.store(false);
+                  }
+               ).detach();
+            }
+            catch (const std::system_error&)
+            {
+               rc->cacheSaving.store(false);
+               log_printf("cache: could not start thread to write %s", rc->cacheFile.c_str());
+            }
+         };
+      },
+      cacheSaveTimer.GetAddressOf(),
+      err
+   );
+   ERROR_CHECK(err);
+
+exit:;
+}
+
+void
+dns::Server::SaveCache(error *err)
+{
+   std::lock_guard<std::mutex> lock(cacheSaveLock);
+
+   // Keep entries that can still be served stale.
+   //
+   if (cacheFile.size())
+      cache.Save(cacheFile.c_str(), get_current_time() - staleWindow, err);
+}
+
+void
+dns::Server::StartCacheSweep(error *err)
+{
+   common::Pointer<pollster::waiter> loop;
+   std::weak_ptr<Server> weak;
+
+   if (cacheSweepTimer.Get())
+      goto exit;
+
+   weak = shared_from_this();
+
+   pollster::get_common_queue(loop.GetAddressOf(), err);
+   ERROR_CHECK(err);
+
+   loop->add_timer(
+      SweepIntervalMs,
+      true,
+      [weak] (pollster::event *ev, error *err) -> void
+      {
+         ev->on_signal = [weak] (error *err) -> void
+         {
+            auto rc = weak.lock();
+            if (rc.get())
+               rc->SweepCache();
+         };
+      },
+      cacheSweepTimer.GetAddressOf(),
+      err
+   );
+   ERROR_CHECK(err);
+
 exit:;
 }
+
+void
+dns::Server::SweepCache()
+{
+   auto start = std::chrono::steady_clock::now();
+
+   // Entries that can still be served stale aren't due yet.
+   //
+   cache.Sweep(get_current_time() - staleWindow, SweepSteps);
+
+   uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start
+   ).count();
+
+   stats.SweepTicks++;
+   stats.SweepMicros += us;
+   if (us > stats.SweepMaxMicros)
+      stats.SweepMaxMicros = us;
+}
@@ -0,0 +1,426 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnscache.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+
+#if defined(_WINDOWS)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//
+// Snapshot file layout: a SnapshotHeader, followed by each shard's slot
+// array and slab exactly as they sit in memory.  The file is only ever
+// read by the host that wrote it, so rather than byte-swapping we refuse
+// files whose byte order, entry layout or version differ from ours.
+//
+
+struct dns::Cache::SnapshotHeader
+{
+   char Magic[8];
+   uint32_t Version;
+   uint32_t ByteOrder;
+   uint32_t NumShards;
+   uint32_t EntrySize;
+   struct
+   {
+      uint64_t SlotsOffset;
+      uint64_t SlotCount;
+      uint64_t SlabOffset;
+      uint64_t SlabLength;
+   } Shards[Cache::ShardCount];
+};
+
+namespace {
+
+const char SnapshotMagic[8] = { 'd', 'n', 's', 'c', 'a', 'c', 'h', 'e' };
+const uint32_t SnapshotVersion = 3;
+const uint32_t SnapshotByteOrder = 0x01020304;
+
+bool
+WriteAll(FILE *file, const void *buf, size_t len, error *err)
+{
+   if (len && fwrite(buf, 1, len, file) != len)
+   {
+      error_set_errno(err, errno);
+      return false;
+   }
+   return true;
+}
+
+bool
+PadTo(FILE *file, uint64_t &off, size_t align, error *err)
+{
+   static const char zeroes[16] = {0};
+   size_t pad = (align - off % align) % align;
+   off += pad;
+   return WriteAll(file, zeroes, pad, err);
+}
+
+} // end namespace
+
+dns::Cache::~Cache()
+{
+   Unmap();
+}
+
+dns::Cache::Mapping::~Mapping()
+{
+   if (Base)
+   {
+#if defined(_WINDOWS)
+      UnmapViewOfFile(Base);
+#else
+      munmap(Base, Length);
+#endif
+   }
+}
+
+void
+dns::Cache::Unmap()
+{
+   auto m = mapping.exchange(nullptr, std::memory_order_acq_rel);
+
+   // Wait out lookups that might still be in it, rather than retiring it:
+   // Windows won't replace the file until it is really gone.
+   //
+   if (m)
+   {
+      Epoch::Synchronize();
+      delete m;
+   }
+}
+
+bool
+dns::Cache::Map(const char *path, error *err)
+{
+   const SnapshotHeader *hdr = nullptr;
+   std::unique_ptr<Mapping> m(new (std::nothrow) Mapping());
+   bool r = false;
+
+   Unmap();
+
+#if defined(_WINDOWS)
+   HANDLE file = INVALID_HANDLE_VALUE, section = nullptr;
+   LARGE_INTEGER size;
+
+   if (!m)
+      ERROR_SET(err, nomem);
+
+   file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+   if (file == INVALID_HANDLE_VALUE)
+   {
+      if (GetLastError() == ERROR_FILE_NOT_FOUND)
+         goto exit;
+      ERROR_SET(err, win32, GetLastError());
+   }
+   if (!GetFileSizeEx(file, &size))
+      ERROR_SET(err, win32, GetLastError());
+   if (size.QuadPart < sizeof(*hdr) || size.QuadPart > SIZE_MAX)
+      goto exit;
+
+   section = CreateFileMapping(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+   if (!section)
+      ERROR_SET(err, win32, GetLastError());
+   m->Base = MapViewOfFile(section, FILE_MAP_COPY, 0, 0, 0);
+   if (!m->Base)
+      ERROR_SET(err, win32, GetLastError());
+   m->Length = size.QuadPart;
+#else
+   int fd = -1;
+   struct stat st;
+
+   if (!m)
+      ERROR_SET(err, nomem);
+
+   fd = open(path, O_RDONLY);
+   if (fd < 0)
+   {
+      if (errno == ENOENT)
+         goto exit;
+      ERROR_SET(err, errno, errno);
+   }
+   if (fstat(fd, &st))
+      ERROR_SET(err, errno, errno);
+   if ((uint64_t)st.st_size < sizeof(*hdr))
+      goto exit;
+
+   // Private and writable, so that lookups can drop expired entries
+   // without touching the file.
+   //
+   m->Base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   if (m->Base == MAP_FAILED)
+   {
+      m->Base = nullptr;
+      ERROR_SET(err, errno, errno);
+   }
+   m->Length = st.st_size;
+#endif
+
+   hdr = (const SnapshotHeader*)m->Base;
+
+   if (memcmp(hdr->Magic, SnapshotMagic, sizeof(SnapshotMagic)) ||
+       hdr->Version != SnapshotVersion ||
+       hdr->ByteOrder != SnapshotByteOrder ||
+       hdr->NumShards != ShardCount ||
+       hdr->EntrySize != sizeof(Entry))
+   {
+      goto exit;
+   }
+
+   for (size_t i=0; i<ShardCount; ++i)
+   {
+      auto &desc = hdr->Shards[i];
+
+      if (desc.SlotCount & (desc.SlotCount - 1) ||
+          desc.SlotsOffset % sizeof(Slot) ||
+          desc.SlotsOffset > m->Length ||
+          desc.SlotCount > (m->Length - desc.SlotsOffset) / sizeof(Slot) ||
+          desc.SlabOffset % EntryAlign ||
+          desc.SlabOffset > m->Length ||
+          desc.SlabLength > m->Length - desc.SlabOffset)
+      {
+         goto exit;
+      }
+   }
+
+   for (size_t i=0; i<ShardCount; ++i)
+   {
+      auto &desc = hdr->Shards[i];
+      auto &table = m->Tables[i];
+
+      table.Slots = (Slot*)((char*)m->Base + desc.SlotsOffset);
+      table.SlotCount = desc.SlotCount;
+      table.Slab = (const char*)m->Base + desc.SlabOffset;
+      table.SlabLength = desc.SlabLength;
+   }
+
+   mapping.store(m.release(), std::memory_order_release);
+   r = true;
+exit:
+#if defined(_WINDOWS)
+   if (section)
+      CloseHandle(section);
+   if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+#else
+   if (fd >= 0)
+      close(fd);
+#endif
+   return r;
+}
+
+void
+dns::Cache::Save(const char *path, uint64_t now, error *err)
+{
+   SnapshotHeader hdr;
+   std::string tmpPath;
+#if defined(_WINDOWS)
+   std::string oldPath;
+#endif
+   FILE *file = nullptr;
+   uint64_t off = sizeof(hdr);
+   std::vector<Slot> slots;
+   std::vector<char> slab;
+   bool renamed = false;
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.Magic, SnapshotMagic, sizeof(SnapshotMagic));
+   hdr.Version = SnapshotVersion;
+   hdr.ByteOrder = SnapshotByteOrder;
+   hdr.NumShards = ShardCount;
+   hdr.EntrySize = sizeof(Entry);
+
+   try
+   {
+      tmpPath = path;
+      tmpPath += ".tmp";
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   file = fopen(tmpPath.c_str(), "wb");
+   if (!file)
+      ERROR_SET(err, errno, errno);
+
+   if (!WriteAll(file, &hdr, sizeof(hdr), err))
+      goto exit;
+
+   for (size_t i=0; i<ShardCount; ++i)
+   {
+      auto &shard = shards[i];
+      Epoch::Guard guard;
+      std::unique_lock<std::mutex> lock(shard.lock);
+      auto live = shard.Live();
+      auto mapped = Mapped(shard);
+      size_t count = 0;
+      size_t nslots = InitialSlots;
+
+      // Entries still in the mapping are written out too, unless the
+      // live shard has superseded them or there is no budget left.
+      //
+      auto forEach = [&] (const std::function<void(const Slot &, const Entry *)> &fn) -> void
+      {
+         size_t bytes = 0;
+
+         for (auto table : {&live, &mapped})
+         {
+            for (size_t j=0; j<table->SlotCount; ++j)
+            {
+               auto &slot = table->Slots[j];
+               if (!slot.Offset || slot.Offset == Tombstone)
+                  continue;
+
+               auto e = (const Entry*)(table->Slab + slot.Offset);
+               if (slot.Offset + sizeof(*e) > table->SlabLength ||
+                   slot.Offset + e->Size > table->SlabLength ||
+                   e->Time + e->Ttl < now)
+               {
+                  continue;
+               }
+
+               if (table == &mapped)
+               {
+                  CacheKey key;
+                  key.Name = e->Name();
+                  key.NameLength = e->NameLength;
+                  key.Type = e->Type;
+                  key.Class = e->Class;
+                  key.Kind = e->Kind;
+                  if (Find(live, key, slot.Hash, nullptr))
+                     continue;
+                  if (budget && bytes + e->Size > ShardBudget())
+                     continue;
+               }
+
+               bytes += e->Size;
+               fn(slot, e);
+            }
+         }
+      };
+
+      forEach([&] (const Slot &, const Entry *) -> void { ++count; });
+      while (count * 2 > nslots)
+         nslots *= 2;
+
+      try
+      {
+         slots.resize(0);
+         slots.resize(nslots);
+         slab.resize(EntryAlign);
+         forEach(
+            [&] (const Slot &slot, const Entry *e) -> void
+            {
+               size_t mask = nslots - 1;
+               size_t k = slot.Hash & mask;
+               while (slots[k].Offset)
+                  k = (k+1) & mask;
+               slots[k].Hash = slot.Hash;
+               slots[k].Offset = slab.size();
+               AppendEntry(slab, e);
+            }
+         );
+      }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(err, nomem);
+      }
+
+      // The copy is ours; don't hold up lookups while it's written.
+      //
+      lock.unlock();
+
+      if (!PadTo(file, off, sizeof(Slot), err))
+         goto exit;
+      hdr.Shards[i].SlotsOffset = off;
+      hdr.Shards[i].SlotCount = nslots;
+      if (!WriteAll(file, slots.data(), nslots * sizeof(Slot), err))
+         goto exit;
+      off += nslots * sizeof(Slot);
+
+      if (!PadTo(file, off, EntryAlign, err))
+         goto exit;
+      hdr.Shards[i].SlabOffset = off;
+      hdr.Shards[i].SlabLength = slab.size();
+      if (!WriteAll(file, slab.data(), slab.size(), err))
+         goto exit;
+      off += slab.size();
+   }
+
+   if (fseek(file, 0, SEEK_SET))
+      ERROR_SET(err, errno, errno);
+   if (!WriteAll(file, &hdr, sizeof(hdr), err))
+      goto exit;
+   if (fclose(file))
+   {
+      file = nullptr;
+      ERROR_SET(err, errno, errno);
+   }
+   file = nullptr;
+
+   // Everything in the old snapshot was just copied to the new one, which
+   // gets mapped in its place.  Windows won't replace a file we have
+   // mapped, but will rename it, so there the old one is moved aside and
+   // stays mapped until the new one is in place.
+   //
+#if defined(_WINDOWS)
+   if (mapping.load(std::memory_order_acquire))
+   {
+      try
+      {
+         oldPath = path;
+         oldPath += ".old";
+      }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(err, nomem);
+      }
+      if (!MoveFileExA(path, oldPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+         ERROR_SET(err, win32, GetLastError());
+   }
+
+   if (!MoveFileExA(tmpPath.c_str(), path, MOVEFILE_REPLACE_EXISTING))
+   {
+      DWORD code = GetLastError();
+      if (oldPath.size())
+         MoveFileExA(oldPath.c_str(), path, 0);
+      ERROR_SET(err, win32, code);
+   }
+
+   Unmap();
+   if (oldPath.size())
+      DeleteFileA(oldPath.c_str());
+#else
+   if (rename(tmpPath.c_str(), path))
+      ERROR_SET(err, errno, errno);
+#endif
+   renamed = true;
+
+   Map(path, err);
+   ERROR_CHECK(err);
+
+exit:
+   if (file)
+      fclose(file);
+   if (!renamed && tmpPath.size())
+      remove(tmpPath.c_str());
+}
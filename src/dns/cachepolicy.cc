@@ -0,0 +1,333 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnscache.h>
+
+#include <new>
+
+namespace {
+
+// Rough average entry size, used to size the sketches from the budget.
+//
+const size_t TypicalEntrySize = 256;
+
+uint32_t
+SketchIndex(uint32_t hash, int row, size_t width)
+{
+   uint32_t h = hash + row * 0x9e3779b9U;
+   h ^= h >> 16;
+   h *= 0x85ebca6bU;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35U;
+   h ^= h >> 16;
+   return h & (width - 1);
+}
+
+uint32_t
+NextRandom(uint32_t &state)
+{
+   // xorshift32.
+   //
+   state ^= state << 13;
+   state ^= state >> 17;
+   state ^= state << 5;
+   return state;
+}
+
+} // end namespace
+
+void
+dns::Cache::SetBudget(size_t bytes)
+{
+   budget = bytes;
+
+   // Sketch widths depend on the budget.  They're allocated here rather
+   // than on first use, so that lookups never have to.  Without one,
+   // nothing displaces a live entry.
+   //
+   for (auto &shard : shards)
+   {
+      size_t width = 64;
+
+      shard.sketch.reset();
+      shard.sketchWidth = 0;
+      shard.sketchAdds = 0;
+
+      if (!budget)
+         continue;
+
+      while (width * TypicalEntrySize < ShardBudget() && width < ((size_t)1 << 24))
+         width *= 2;
+
+      shard.sketch.reset(new (std::nothrow) std::atomic<unsigned char>[width * SketchRows]());
+      if (shard.sketch)
+         shard.sketchWidth = width;
+   }
+}
+
+void
+dns::Cache::GetStats(CacheStats *stats)
+{
+   stats->Entries = 0;
+   stats->Bytes = 0;
+   stats->Resident = 0;
+   stats->Mapped = 0;
+   stats->Evictions = evictions;
+   stats->Rejections = rejections;
+   stats->Expirations = expirations;
+
+   {
+      std::lock_guard<std::mutex> lock(wheelLock);
+      stats->Resident += wheelRefs * sizeof(WheelRef);
+   }
+
+   {
+      Epoch::Guard guard;
+      auto m = mapping.load(std::memory_order_acquire);
+      if (m)
+         stats->Mapped = m->Length;
+   }
+
+   for (auto &shard : shards)
+   {
+      std::lock_guard<std::mutex> lock(shard.lock);
+      auto v = shard.live.load(std::memory_order_relaxed);
+      stats->Entries += shard.count;
+      stats->Bytes += shard.LiveBytes();
+      stats->Resident += shard.sketchWidth * SketchRows;
+      if (v)
+         stats->Resident += v->slab.capacity() + v->slots.capacity() * sizeof(Slot);
+   }
+}
+
+void
+dns::Cache::Touch(Shard &shard, uint32_t hash)
+{
+   size_t width = shard.sketchWidth;
+
+   if (!width)
+      return;
+
+   // Lookups on other cores may be counting the same cells; losing one of
+   // two racing increments is fine for an estimate.
+   //
+   for (size_t i=0; i<SketchRows; ++i)
+   {
+      auto &c = shard.sketch[i * width + SketchIndex(hash, i, width)];
+      unsigned char n = c.load(std::memory_order_relaxed);
+      if (n < SketchMax)
+         c.store(n + 1, std::memory_order_relaxed);
+   }
+
+   // Halve every counter periodically, so that names that were popular
+   // once don't keep their advantage forever.  Only the lookup that
+   // reaches the mark does it.
+   //
+   if (shard.sketchAdds.fetch_add(1, std::memory_order_relaxed) + 1 == width * 10)
+   {
+      shard.sketchAdds.store(0, std::memory_order_relaxed);
+      for (size_t i=0; i<width * SketchRows; ++i)
+      {
+         auto &c = shard.sketch[i];
+         c.store(c.load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+      }
+   }
+}
+
+unsigned
+dns::Cache::Estimate(const Shard &shard, uint32_t hash)
+{
+   size_t width = shard.sketchWidth;
+   unsigned r = SketchMax;
+
+   if (!width)
+      return 0;
+
+   for (size_t i=0; i<SketchRows; ++i)
+   {
+      unsigned c = shard.sketch[i * width + SketchIndex(hash, i, width)].load(std::memory_order_relaxed);
+      if (c < r)
+         r = c;
+   }
+   return r;
+}
+
+bool
+dns::Cache::MakeRoom(Shard &shard, uint32_t hash, size_t size, uint64_t now, const Slot *replacing)
+{
+   size_t limit = ShardBudget();
+   unsigned freq = Estimate(shard, hash);
+   auto v = shard.live.load(std::memory_order_relaxed);
+   size_t freed = 0;
+
+   if (size > limit)
+      return false;
+
+   if (replacing)
+      freed = ((const Entry*)(v->slab.data() + replacing->Offset))->Size;
+
+   while (shard.count && shard.LiveBytes() - freed + size > limit)
+   {
+      size_t mask = v->slots.size() - 1;
+      size_t i = NextRandom(shard.rng) & mask;
+      Slot *victim = nullptr;
+      unsigned victimFreq = 0;
+      bool expired = false;
+
+      // Sample the first few entries from a random point in the index,
+      // preferring anything expired, then the least frequently used.
+      //
+      for (size_t n = 0, found = 0;
+           n < v->slots.size() && found < EvictionSamples && !expired;
+           ++n, i = (i+1) & mask)
+      {
+         auto &slot = v->slots[i];
+         if (!slot.Offset || slot.Offset == Tombstone || &slot == replacing)
+            continue;
+         ++found;
+
+         auto e = (const Entry*)(v->slab.data() + slot.Offset);
+         auto f = Estimate(shard, slot.Hash);
+         expired = (e->Time + e->Ttl < now);
+         if (expired || !victim || f < victimFreq)
+         {
+            victim = &slot;
+            victimFreq = f;
+         }
+      }
+
+      if (!victim)
+         break;
+      if (!expired && freq <= victimFreq)
+         return false;
+
+      auto e = (const Entry*)(v->slab.data() + victim->Offset);
+      shard.deadBytes += e->Size;
+      --shard.count;
+      Atomic(victim->Offset).store(Tombstone, std::memory_order_release);
+      ++evictions;
+   }
+
+   return true;
+}
+
+void
+dns::Cache::Schedule(uint32_t hash, uint64_t expiry)
+{
+   uint64_t tick = expiry >> WheelShift;
+   WheelRef ref;
+   std::lock_guard<std::mutex> lock(wheelLock);
+
+   // With a budget, eviction bounds memory anyway; cap the wheel at a
+   // small fraction of it so that churn can't grow it without limit.
+   // Entries that don't make it onto the wheel wait for eviction.
+   //
+   if (budget && wheelRefs >= budget / 128)
+      return;
+
+   if (!sweepTick)
+      sweepTick = tick;
+   if (tick < sweepTick)
+      tick = sweepTick;
+
+   ref.Hash = hash;
+   ref.Expiry = (expiry > 0xffffffffU ? 0xffffffffU : expiry);
+
+   try
+   {
+      wheel[tick % WheelSize].push_back(ref);
+      ++wheelRefs;
+   }
+   catch (const std::bad_alloc&)
+   {
+   }
+}
+
+size_t
+dns::Cache::Expire(uint32_t hash, uint64_t now)
+{
+   auto &shard = ShardFor(shards, hash);
+   std::lock_guard<std::mutex> lock(shard.lock);
+   auto v = shard.live.load(std::memory_order_relaxed);
+   size_t mask = 0;
+   size_t removed = 0;
+
+   if (!v || !v->slots.size())
+      return 0;
+   mask = v->slots.size() - 1;
+
+   for (size_t i = hash & mask; v->slots[i].Offset; i = (i+1) & mask)
+   {
+      auto &slot = v->slots[i];
+      if (slot.Offset == Tombstone || slot.Hash != hash)
+         continue;
+
+      auto e = (const Entry*)(v->slab.data() + slot.Offset);
+      if (e->Time + e->Ttl < now)
+      {
+         shard.deadBytes += e->Size;
+         --shard.count;
+         Atomic(slot.Offset).store(Tombstone, std::memory_order_release);
+         ++removed;
+      }
+   }
+
+   return removed;
+}
+
+size_t
+dns::Cache::Sweep(uint64_t now, size_t maxSteps)
+{
+   size_t steps = 0;
+   size_t removed = 0;
+
+   // Free tables that writers have replaced since the last sweep.
+   //
+   Epoch::Collect();
+
+   std::lock_guard<std::mutex> lock(wheelLock);
+
+   // Only buckets wholly in the past, so everything due in one has
+   // certainly expired.
+   //
+   while (sweepTick && sweepTick < (now >> WheelShift) && steps < maxSteps)
+   {
+      auto &bucket = wheel[sweepTick % WheelSize];
+
+      while (sweepPos < bucket.size() && steps < maxSteps)
+      {
+         auto ref = bucket[sweepPos];
+         ++steps;
+
+         // Filed here for a later trip around the wheel.
+         //
+         if ((ref.Expiry >> WheelShift) > sweepTick)
+         {
+            ++sweepPos;
+            continue;
+         }
+
+         removed += Expire(ref.Hash, now);
+         bucket[sweepPos] = bucket.back();
+         bucket.pop_back();
+         --wheelRefs;
+      }
+      if (sweepPos < bucket.size())
+         break;
+
+      if (bucket.capacity() > 2 * bucket.size() + 64)
+         bucket.shrink_to_fit();
+
+      sweepPos = 0;
+      ++sweepTick;
+      ++steps;
+   }
+
+   expirations += removed;
+   return removed;
+}
@@ -0,0 +1,408 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnscache.h>
+
+#include <string.h>
+
+uint32_t
+dns::Cache::Hash(const CacheKey &key)
+{
+   // FNV-1a.
+   //
+   uint32_t h = 2166136261U;
+   auto mix = [&h] (unsigned char ch) -> void
+   {
+      h ^= ch;
+      h *= 16777619U;
+   };
+
+   for (size_t i=0; i<key.NameLength; ++i)
+      mix(key.Name[i]);
+   mix(key.Type >> 8);
+   mix(key.Type);
+   mix(key.Class >> 8);
+   mix(key.Class);
+   mix(key.Kind);
+   return h;
+}
+
+const dns::Cache::Entry *
+dns::Cache::Find(const Table &table, const CacheKey &key, uint32_t hash, Slot **slotp)
+{
+   size_t mask = table.SlotCount - 1;
+
+   if (!table.SlotCount)
+      return nullptr;
+
+   // The probe count is bounded only because a mapped table might have
+   // no empty slots; live tables always do.
+   //
+   for (size_t i = hash & mask, n = 0; n < table.SlotCount; i = (i+1) & mask, ++n)
+   {
+      auto &slot = table.Slots[i];
+
+      // A writer may tombstone or fill this slot as we look.  Whatever
+      // offset we read points at an entry that was completely written
+      // first, and stays readable until our guard is released.
+      //
+      uint32_t off = Atomic(slot.Offset).load(std::memory_order_acquire);
+      if (!off)
+         return nullptr;
+      if (off == Tombstone || Atomic(slot.Hash).load(std::memory_order_relaxed) != hash)
+         continue;
+
+      // Mapped tables come from disk, so don't trust their offsets.
+      //
+      auto e = (const Entry*)(table.Slab + off);
+      if (off + sizeof(*e) > table.SlabLength ||
+          off + e->Size > table.SlabLength ||
+          sizeof(*e) + e->NameLength + e->PayloadLength > e->Size)
+      {
+         continue;
+      }
+
+      if (e->Type == key.Type &&
+          e->Class == key.Class &&
+          e->Kind == key.Kind &&
+          e->NameLength == key.NameLength &&
+          !memcmp(e->Name(), key.Name, key.NameLength))
+      {
+         if (slotp)
+            *slotp = &slot;
+         return e;
+      }
+   }
+
+   return nullptr;
+}
+
+const dns::Cache::Entry *
+dns::Cache::Find(Shard &shard, const CacheKey &key, uint32_t hash, Slot **slotp)
+{
+   auto e = Find(shard.Live(), key, hash, slotp);
+
+   if (!e)
+      e = Find(Mapped(shard), key, hash, slotp);
+
+   return e;
+}
+
+void
+dns::Cache::Rebuild(Shard &shard, size_t nslots, size_t extra, error *err)
+{
+   auto old = shard.live.load(std::memory_order_relaxed);
+   std::unique_ptr<Version> v;
+   size_t used = 0;
+
+   try
+   {
+      size_t live = old ? old->slab.size() - shard.deadBytes : (size_t)EntryAlign;
+
+      // Leave room to grow by half again before the next copy.
+      //
+      size_t capacity = live + extra;
+      capacity += capacity / 2;
+      if (capacity < 4096)
+         capacity = 4096;
+
+      v.reset(new Version());
+      v->slots.resize(nslots);
+      v->slab.reserve(capacity);
+      v->slab.resize(EntryAlign);
+
+      for (size_t j = 0; old && j < old->slots.size(); ++j)
+      {
+         auto &slot = old->slots[j];
+         if (!slot.Offset || slot.Offset == Tombstone)
+            continue;
+
+         auto e = (const Entry*)(old->slab.data() + slot.Offset);
+         auto off = v->slab.size();
+         AppendEntry(v->slab, e);
+
+         size_t mask = nslots - 1;
+         size_t i = slot.Hash & mask;
+         while (v->slots[i].Offset)
+            i = (i+1) & mask;
+         v->slots[i].Hash = slot.Hash;
+         v->slots[i].Offset = off;
+         ++used;
+      }
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   // Lookups still in the old version may finish there.
+   //
+   shard.live.store(v.release(), std::memory_order_release);
+   if (old)
+      Epoch::Retire(old);
+
+   shard.used = used;
+   shard.count = used;
+   shard.deadBytes = 0;
+exit:;
+}
+
+bool
+dns::Cache::Lookup(
+   const CacheKey &key,
+   std::vector<char> &payload,
+   CacheEntryInfo *info,
+   error *err
+)
+{
+   auto hash = Hash(key);
+   auto &shard = ShardFor(shards, hash);
+   Epoch::Guard guard;
+   const Entry *e = nullptr;
+   uint32_t hits = 0;
+
+   Touch(shard, hash);
+
+   e = Find(shard, key, hash, nullptr);
+   if (!e)
+      goto exit;
+
+   try
+   {
+      payload.resize(e->PayloadLength);
+   }
+   catch (const std::bad_alloc&)
+   {
+      e = nullptr;
+      ERROR_SET(err, nomem);
+   }
+   memcpy(payload.data(), e->Payload(), e->PayloadLength);
+
+   if (info)
+      GetInfo(e, info);
+
+   // Popular names are looked up on every core at once; a lost count is
+   // cheaper than a locked increment.
+   //
+   hits = Atomic(e->Hits).load(std::memory_order_relaxed);
+   if (hits != 0xffffffffU)
+      Atomic(e->Hits).store(hits + 1, std::memory_order_relaxed);
+
+exit:
+   return e != nullptr;
+}
+
+void
+dns::Cache::GetInfo(const Entry *e, CacheEntryInfo *info)
+{
+   info->Time = e->Time;
+   info->Ttl = e->Ttl;
+   info->Hits = Atomic(e->Hits).load(std::memory_order_relaxed);
+   info->ResponseCode = e->ResponseCode;
+   info->Flags = Atomic(e->Flags).load(std::memory_order_relaxed);
+}
+
+void
+dns::Cache::AppendEntry(std::vector<char> &slab, const Entry *e)
+{
+   Entry copy;
+
+   memset(&copy, 0, sizeof(copy));
+   copy.Size = e->Size;
+   copy.Hash = e->Hash;
+   copy.Time = e->Time;
+   copy.Ttl = e->Ttl;
+   copy.PayloadLength = e->PayloadLength;
+   copy.Type = e->Type;
+   copy.Class = e->Class;
+   copy.NameLength = e->NameLength;
+   copy.ResponseCode = e->ResponseCode;
+   copy.Flags = Atomic(e->Flags).load(std::memory_order_relaxed);
+   copy.Hits = Atomic(e->Hits).load(std::memory_order_relaxed);
+   copy.Kind = e->Kind;
+
+   slab.insert(slab.end(), (const char*)&copy, (const char*)(&copy + 1));
+   slab.insert(slab.end(), (const char*)(e + 1), (const char*)e + e->Size);
+}
+
+bool
+dns::Cache::GetInfo(const CacheKey &key, CacheEntryInfo *info)
+{
+   auto hash = Hash(key);
+   Epoch::Guard guard;
+   auto e = Find(ShardFor(shards, hash), key, hash, nullptr);
+   if (e && info)
+      GetInfo(e, info);
+   return e != nullptr;
+}
+
+void
+dns::Cache::SetFlags(const CacheKey &key, unsigned char flags)
+{
+   auto hash = Hash(key);
+   Epoch::Guard guard;
+   auto e = Find(ShardFor(shards, hash), key, hash, nullptr);
+   if (e)
+      Atomic(e->Flags).fetch_or(flags, std::memory_order_relaxed);
+}
+
+void
+dns::Cache::ClearFlags(const CacheKey &key, unsigned char flags)
+{
+   auto hash = Hash(key);
+   Epoch::Guard guard;
+   auto e = Find(ShardFor(shards, hash), key, hash, nullptr);
+   if (e)
+      Atomic(e->Flags).fetch_and(~flags, std::memory_order_relaxed);
+}
+
+void
+dns::Cache::Insert(
+   const CacheKey &key,
+   const CacheEntryInfo &info,
+   const void *payload,
+   size_t len,
+   error *err
+)
+{
+   auto hash = Hash(key);
+   auto &shard = ShardFor(shards, hash);
+   size_t size = AlignEntry(sizeof(Entry) + key.NameLength + len);
+   size_t off = 0;
+   Version *v = nullptr;
+   Slot *slot = nullptr;
+   Entry *e = nullptr;
+   Epoch::Guard guard;
+   std::unique_lock<std::mutex> lock(shard.lock);
+
+   if (key.NameLength > 0xffff || size > 0xffffffffU / 2)
+      ERROR_SET(err, unknown, "Cache entry too large");
+
+   // A refresh the sketch turns down leaves the old entry where it is,
+   // rather than losing the name altogether.
+   //
+   if (budget)
+   {
+      Find(shard.Live(), key, hash, &slot);
+      if (!MakeRoom(shard, hash, size, info.Time, slot))
+      {
+         ++rejections;
+         goto exit;
+      }
+      slot = nullptr;
+   }
+
+   Remove(shard, key, hash);
+
+   // Grow the index at 3/4 occupancy (tombstones count, since they
+   // lengthen probe chains), and squeeze out dead slab space once it
+   // makes up half of the slab, or a quarter of the shard's budget.  A
+   // slab without room for the entry can't grow in place, since lookups
+   // may be reading it, so that takes a new version too.
+   //
+   v = shard.live.load(std::memory_order_relaxed);
+   if (!v ||
+       (shard.used + 1) * 4 > v->slots.size() * 3 ||
+       (shard.deadBytes > 4096 && shard.deadBytes * 2 > v->slab.size()) ||
+       (budget && shard.deadBytes * 4 > ShardBudget()) ||
+       v->slab.size() + size > v->slab.capacity())
+   {
+      size_t live = shard.used;
+      size_t nslots = v ? v->slots.size() : InitialSlots;
+
+      for (size_t i = 0; v && i < v->slots.size(); ++i)
+      {
+         if (v->slots[i].Offset == Tombstone)
+            --live;
+      }
+      while ((live + 1) * 2 > nslots)
+         nslots *= 2;
+
+      Rebuild(shard, nslots, size, err);
+      ERROR_CHECK(err);
+      v = shard.live.load(std::memory_order_relaxed);
+   }
+
+   off = v->slab.size();
+   if (off + size > 0xffffffffU / 2)
+      ERROR_SET(err, unknown, "Cache shard full");
+
+   // Within capacity, so nothing moves.
+   //
+   v->slab.resize(off + size);
+
+   e = (Entry*)(v->slab.data() + off);
+   memset(e, 0, sizeof(*e));
+   e->Size = size;
+   e->Hash = hash;
+   e->Time = info.Time;
+   e->Ttl = info.Ttl;
+   e->PayloadLength = len;
+   e->Type = key.Type;
+   e->Class = key.Class;
+   e->NameLength = key.NameLength;
+   e->ResponseCode = info.ResponseCode;
+   e->Flags = info.Flags;
+   e->Kind = key.Kind;
+   memcpy((char*)e->Name(), key.Name, key.NameLength);
+   if (len)
+      memcpy((char*)e->Payload(), payload, len);
+
+   {
+      size_t mask = v->slots.size() - 1;
+      size_t i = hash & mask;
+      while (v->slots[i].Offset && v->slots[i].Offset != Tombstone)
+         i = (i+1) & mask;
+      slot = &v->slots[i];
+   }
+   if (!slot->Offset)
+      ++shard.used;
+   ++shard.count;
+
+   // Publish: the release store makes the entry visible along with the
+   // offset.
+   //
+   Atomic(slot->Hash).store(hash, std::memory_order_relaxed);
+   Atomic(slot->Offset).store(off, std::memory_order_release);
+
+   // The wheel has its own lock; don't hold both.
+   //
+   lock.unlock();
+   Schedule(hash, info.Time + info.Ttl);
+exit:;
+}
+
+void
+dns::Cache::Remove(const CacheKey &key)
+{
+   auto hash = Hash(key);
+   auto &shard = ShardFor(shards, hash);
+   Epoch::Guard guard;
+   std::lock_guard<std::mutex> lock(shard.lock);
+
+   Remove(shard, key, hash);
+}
+
+void
+dns::Cache::Remove(Shard &shard, const CacheKey &key, uint32_t hash)
+{
+   Slot *slot = nullptr;
+   auto e = Find(shard.Live(), key, hash, &slot);
+   if (e)
+   {
+      shard.deadBytes += e->Size;
+      --shard.count;
+      Atomic(slot->Offset).store(Tombstone, std::memory_order_release);
+   }
+
+   // The mapping is private, so this stays in memory and never reaches
+   // the file.
+   //
+   if (Find(Mapped(shard), key, hash, &slot))
+      Atomic(slot->Offset).store(Tombstone, std::memory_order_release);
+}
@@ -0,0 +1,100 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnsmsg.h>
+
+#include <string.h>
+
+uint16_t
+dns::AdvertisedPayload(const MessageView &msg)
+{
+   if (!msg.Opt)
+      return 0;
+
+   uint16_t payload = msg.Opt->Class.Get();
+   if (payload < MinUdpPayload)
+      payload = MinUdpPayload;
+   if (payload > MaxUdpPayload)
+      payload = MaxUdpPayload;
+   return payload;
+}
+
+uint16_t
+dns::QueryPayload(const void *buf, size_t len)
+{
+   auto hdr = (const MessageHeader*)buf;
+   MessageView msg;
+   error err;
+
+   // Nearly every query without EDNS can be told apart from the header.
+   //
+   if (len < sizeof(*hdr) ||
+       hdr->Response ||
+       !hdr->AdditionalRecordCount.Get())
+   {
+      return 0;
+   }
+
+   ParseMessage(buf, len, &msg, &err);
+   if (ERROR_FAILED(&err))
+      return 0;
+
+   return AdvertisedPayload(msg);
+}
+
+bool
+dns::DnssecOk(const MessageView &msg)
+{
+   return msg.Opt && (msg.Opt->Ttl.Get() & OptDnssecOk);
+}
+
+size_t
+dns::TrailingOpt(const void *buf, size_t len, const MessageView &msg)
+{
+   if (!msg.Opt || !msg.Complete || !msg.RecordCount)
+      return len;
+
+   auto &last = msg.Records[msg.RecordCount - 1];
+   if (last.Attrs != msg.Opt ||
+       (const char*)last.Attrs->Data + last.Attrs->Length.Get() != (const char*)buf + len)
+   {
+      return len;
+   }
+
+   return last.Name.Offset();
+}
+
+size_t
+dns::StripOpt(void *buf, size_t len, const MessageView &msg)
+{
+   size_t n = TrailingOpt(buf, len, msg);
+   if (n != len)
+   {
+      auto hdr = (MessageHeader*)buf;
+      hdr->AdditionalRecordCount.Put(hdr->AdditionalRecordCount.Get() - 1);
+   }
+   return n;
+}
+
+void
+dns::WriteOpt(MessageHeader *hdr, char *out, uint16_t payload, bool dnssecOk)
+{
+   RecordAttrs attrs;
+
+   // Root owner, no extended RCODE, version 0, no options, and no flags
+   // but DO.
+   //
+   *out++ = 0;
+   memset(&attrs, 0, sizeof(attrs));
+   attrs.Type.Put((uint16_t)Type::OPT);
+   attrs.Class.Put(payload);
+   attrs.Ttl.Put(dnssecOk ? OptDnssecOk : 0);
+   memcpy(out, &attrs, offsetof(RecordAttrs, Data));
+
+   hdr->AdditionalRecordCount.Put(hdr->AdditionalRecordCount.Get() + 1);
+}
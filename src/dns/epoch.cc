@@ -0,0 +1,188 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnsepoch.h>
+
+#include <common/logger.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// Workers are capped well below this.
+//
+const int MaxReaders = 256;
+
+struct Reader
+{
+   std::atomic<uint64_t> Epoch;     // entered at, or 0 outside a guard
+   std::atomic<bool> InUse;
+};
+
+Reader readers[MaxReaders];
+std::atomic<int> readerCount(0);    // slots ever handed out
+std::atomic<uint64_t> globalEpoch(1);
+
+// Newest first, so epochs never increase along the list.
+//
+std::mutex limboLock;
+dns::Epoch::Retired *limbo = nullptr;
+
+struct ThreadState
+{
+   Reader *reader;
+   int depth;
+
+   ThreadState() : reader(nullptr), depth(0) {}
+
+   ~ThreadState()
+   {
+      if (reader)
+         reader->InUse.store(false, std::memory_order_release);
+   }
+};
+
+thread_local ThreadState self;
+
+Reader *
+Register()
+{
+   for (int i = 0; i < MaxReaders; ++i)
+   {
+      bool expected = false;
+      if (!readers[i].InUse.compare_exchange_strong(expected, true))
+         continue;
+
+      int n = readerCount.load();
+      while (n < i + 1 && !readerCount.compare_exchange_weak(n, i + 1))
+         ;
+      return &readers[i];
+   }
+
+   log_printf("epoch: more than %d threads", MaxReaders);
+   abort();
+}
+
+// Called with limboLock held, which is what keeps the epoch from moving
+// under us.
+//
+bool
+TryAdvance()
+{
+   uint64_t e = globalEpoch.load(std::memory_order_relaxed);
+   int n = readerCount.load();
+
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+
+   for (int i = 0; i < n; ++i)
+   {
+      uint64_t r = readers[i].Epoch.load(std::memory_order_acquire);
+      if (r && r != e)
+         return false;
+   }
+
+   globalEpoch.store(e + 1, std::memory_order_seq_cst);
+   return true;
+}
+
+} // end namespace
+
+void
+dns::Epoch::Enter()
+{
+   if (self.depth++)
+      return;
+   if (!self.reader)
+      self.reader = Register();
+
+   // An old epoch is fine; it only holds up reclamation until we leave.
+   // The fence keeps our reads from starting before others can see it.
+   //
+   self.reader->Epoch.store(globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void
+dns::Epoch::Leave()
+{
+   if (--self.depth)
+      return;
+   self.reader->Epoch.store(0, std::memory_order_release);
+}
+
+void
+dns::Epoch::Retire(Retired *p)
+{
+   {
+      std::lock_guard<std::mutex> lock(limboLock);
+      p->RetiredAt = globalEpoch.load(std::memory_order_relaxed);
+      p->NextRetired = limbo;
+      limbo = p;
+   }
+
+   Collect();
+}
+
+void
+dns::Epoch::Collect()
+{
+   Retired *due = nullptr;
+
+   {
+      std::lock_guard<std::mutex> lock(limboLock);
+      Retired **pp = &limbo;
+
+      if (!limbo)
+         return;
+
+      TryAdvance();
+
+      uint64_t e = globalEpoch.load(std::memory_order_relaxed);
+      while (*pp && (*pp)->RetiredAt + 2 > e)
+         pp = &(*pp)->NextRetired;
+      due = *pp;
+      *pp = nullptr;
+   }
+
+   while (due)
+   {
+      auto next = due->NextRetired;
+      delete due;
+      due = next;
+   }
+}
+
+void
+dns::Epoch::Synchronize()
+{
+   uint64_t target = 0;
+
+   assert(!self.depth);
+
+   {
+      std::lock_guard<std::mutex> lock(limboLock);
+      target = globalEpoch.load(std::memory_order_relaxed) + 2;
+   }
+
+   for (;;)
+   {
+      {
+         std::lock_guard<std::mutex> lock(limboLock);
+         TryAdvance();
+         if (globalEpoch.load(std::memory_order_relaxed) >= target)
+            break;
+      }
+      std::this_thread::yield();
+   }
+
+   Collect();
+}
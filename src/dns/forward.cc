@@ -12,6 +12,44 @@
 
 #include <string.h>
 
+// Swap whatever OPT record the client sent for ours, or none if payload
+// is 0, so every upstream query asks for the same thing whoever it's for.
+// The client's DO bit carries over; it changes what the answer holds.
+//
+template <typename Vector>
+static void
+SetUpstreamOpt(Vector &query, uint16_t payload)
+{
+   auto hdr = (dns::MessageHeader*)query.data();
+   bool dnssecOk = false;
+
+   if (query.size() < sizeof(*hdr))
+      return;
+
+   if (hdr->AdditionalRecordCount.Get())
+   {
+      dns::MessageView msg;
+      error err;
+
+      dns::ParseMessage(query.data(), query.size(), &msg, &err);
+      if (ERROR_FAILED(&err))
+         return;
+      dnssecOk = dns::DnssecOk(msg);
+      size_t n = dns::StripOpt(query.data(), query.size(), msg);
+      if (msg.Opt && n == query.size())
+         return;
+      query.resize(n);
+   }
+
+   if (payload)
+   {
+      size_t n = query.size();
+      query.resize(n + dns::OptRecordLength);
+      hdr = (dns::MessageHeader*)query.data();
+      dns::WriteOpt(hdr, query.data() + n, payload, dnssecOk);
+   }
+}
+
 static bool
 RetryResponseCode(unsigned char rc)
 {
@@ -28,10 +66,14 @@ void
 dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state, error *err)
 {
    auto &idx = state->idx;
-   std::function<void()> cancel;
+   RequestHandle cancel;
    std::weak_ptr<Server> weak = shared_from_this();
    common::Pointer<pollster::waiter> loop;
-   common::Pointer<pollster::event> timer;
+   uint32_t generation = 0;
+
+   // Whatever the last attempt was waiting for, this one replaces it.
+   //
+   state->CancelTimer();
 
    if (idx >= forwardServers.size())
    {
@@ -49,13 +91,17 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
       break;
    }
 
-   auto reply = [state, weak] (const void *buf, size_t len) -> void
+   auto reply = [state, weak] (const void *buf, size_t len, const MessageView &msg) -> void
    {
+      // The upstream's OPT record was meant for us; clients get our own.
+      //
+      len = StripOpt((void*)buf, len, msg);
+
       state->Reply(buf, len);
 
       auto rc = weak.lock();
       if (rc.get())
-         rc->CacheReply(buf, len);
+         rc->CacheReply(buf, len, state->dnssecOk);
    };
 
    auto advance = [state, weak] () -> void
@@ -66,35 +112,51 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
       error errStorage;
       error *err = &errStorage;
 
+      // Answered already; there's nothing to retry.
+      //
+      if (!state->reply.size())
+         return;
+
       state->idx++;
       state->udpExhausted = false;
 
-      if (state->idx >= rc->forwardServers.size())
+      if (state->idx < rc->forwardServers.size())
       {
-         Message msg;
-         MessageWriter writer;
+         rc->TryForwardPacket(state, err);
+         if (!ERROR_FAILED(err))
+            return;
+
+         // With nothing sent there's nothing to wait for; fail it now
+         // rather than leave clients and prefetches hanging.
+         //
+         error_clear(err);
+      }
 
-         ParseMessage(state->request.data(), state->request.size(), &msg, err);
-         ERROR_CHECK(err);
+      Arena arena;
+      Message msg(&arena);
+      MessageWriter writer(&arena);
+      ArenaVector<char> out(&arena);
+
+      ParseMessage(state->request.data(), state->request.size(), &msg, err);
+      ERROR_CHECK(err);
 
-         writer.Header->Response = 1;
-         writer.Header->ResponseCode = (unsigned)ResponseCode::ServerFailure;
-         writer.Header->RecursionAvailable = 1;
+      writer.Header->Response = 1;
+      writer.Header->ResponseCode = (unsigned)ResponseCode::ServerFailure;
+      writer.Header->RecursionAvailable = 1;
 
-         for (auto q : msg.Questions)
-         {
-            auto qq = writer.AddQuestion(err);
-            ERROR_CHECK(err);
-            qq->Name = std::move(q.Name);
-            *qq->Attrs = *q.Attrs;
-         }
-
-         auto vec = writer.Serialize(err);
-         state->Reply(vec.data(), vec.size());
-         goto exit;
+      for (auto &q : msg.Questions)
+      {
+         auto qq = writer.AddQuestion(err);
+         ERROR_CHECK(err);
+         qq->Name = std::move(q.Name);
+         *qq->Attrs = *q.Attrs;
       }
 
-      rc->TryForwardPacket(state, err);
+      out = writer.Serialize(err);
+      ERROR_CHECK(err);
+
+      state->Reply(out.data(), out.size());
+      rc->CacheReply(out.data(), out.size(), state->dnssecOk);
    exit:;
    };
 
@@ -108,7 +170,7 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
          state->request.data(),
          state->request.size(),
          nullptr,
-         (state->timeoutIdx == 0) ? [reply, weak, state, idx, advance] (const void *buf, size_t len, Message &msg, error *err) -> void
+         (state->timeoutIdx == 0) ? [reply, weak, state, idx, advance] (const void *buf, size_t len, MessageView &msg, error *err) -> void
          {
             if (msg.Header->Truncated)
             {
@@ -116,9 +178,15 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
                if (!rc.get())
                   return;
 
+               rc->stats.UpstreamTruncated++;
                state->idx = idx;
                state->udpExhausted = true;
                rc->TryForwardPacket(state, err);
+               if (ERROR_FAILED(err))
+               {
+                  error_clear(err);
+                  advance();
+               }
             }
             else if (RetryResponseCode(msg.Header->ResponseCode))
             {
@@ -126,9 +194,16 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
             }
             else
             {
-               reply(buf, len);
+               // Without EDNS, this would have been another round trip
+               // over TCP.
+               //
+               auto rc = weak.lock();
+               if (rc.get() && len > MinUdpPayload)
+                  rc->stats.UpstreamLargeUdp++;
+
+               reply(buf, len, msg);
             }
-         } : std::function<void(const void*,size_t,Message&,error*)>(),
+         } : ResponseMap::Callback(),
          &cancel,
          err
       );
@@ -141,12 +216,12 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
          state->request.data(),
          state->request.size(),
          nullptr,
-         [reply, advance] (const void *buf, size_t len, Message &msg, error *err) -> void
+         [reply, advance] (const void *buf, size_t len, MessageView &msg, error *err) -> void
          {
             if (!len || msg.Header->Truncated || RetryResponseCode(msg.Header->ResponseCode))
                advance();
             else
-               reply(buf, len);
+               reply(buf, len, msg);
          },
          &cancel,
          err
@@ -154,9 +229,13 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
       ERROR_CHECK(err);
    }
 
+   stats.UpstreamQueries++;
+   if (state->attempts++)
+      stats.UpstreamRetransmits++;
+
    try
    {
-      if (cancel)           
+      if (cancel)
          state->cancel.push_back(cancel);
    }
    catch (const std::bad_alloc&)
@@ -164,20 +243,28 @@ dns::Server::TryForwardPacket(const std::shared_ptr<ForwardClientState> &state,
       ERROR_SET(err, nomem);
    }
 
-   pollster::get_common_queue(loop.GetAddressOf(), err);
+   GetLoop(loop.GetAddressOf(), err);
    ERROR_CHECK(err);
 
+   generation = state->timerGeneration;
    loop->add_timer(
       state->udpExhausted ? 1000 : 250,
       false,
       [&] (pollster::event *ev, error *err) -> void
       {
-         ev->on_signal = [advance] (error *err) -> void
+         ev->on_signal = [state, generation, advance] (error *err) -> void
          {
+            if (state->timerGeneration != generation)
+               return;
+
+            // It's fired, so there's nothing left to remove.  This handler
+            // lives in it, so keep it around until we're done.
+            //
+            auto fired = std::move(state->timer);
             advance();
          };
       },
-      timer.GetAddressOf(),
+      state->timer.GetAddressOf(),
       err
    );
    ERROR_CHECK(err);
@@ -189,7 +276,7 @@ void
 dns::Server::TryForwardPacket(
    const struct sockaddr *addr,
    void *buf, size_t len,
-   const Message &msg,
+   const MessageView &msg,
    const std::function<void(const void *, size_t, error *)> &innerReply,
    error *err      
 )
@@ -203,7 +290,7 @@ dns::Server::TryForwardPacket(
       return;
    }
 
-   if (!msg.Questions.size())
+   if (!msg.QuestionCount)
    {
       error_set_unknown(err, "expected question");
       return;
@@ -216,37 +303,16 @@ dns::Server::TryForwardPacket(
    }
 
    uint16_t originalId;
-   std::shared_ptr<std::vector<std::function<void()>>> cancelVec;
-   int cancelIdx = 0;
-   std::function<void()> cancel;
+   RequestHandle cancel[2];      // de-dupe entry, then the forwarded request
+   int cancelCount = 0;
    bool replyWritten = false;
    std::shared_ptr<ForwardClientState> *reqp = nullptr, req;
 
-   try
-   {
-      cancelVec = std::make_shared<std::vector<std::function<void()>>>();
-      cancelVec->resize((addr ? 1 : 0) + 1);
-      cancel = [cancelVec] () -> void
-      {
-         for (auto &fn : *cancelVec)
-         {
-            if (fn)
-               fn();
-            else
-               break;
-         }
-      };
-   }
-   catch (const std::bad_alloc&)
-   {
-      ERROR_SET(err, nomem);
-   }
-
    if (addr)
    {
-      udpDeDupe.Insert(addr, msg, true, cancelVec->data()+cancelIdx, err);
+      udpDeDupe.Insert(addr, msg, true, &cancel[cancelCount], err);
       ERROR_CHECK(err);
-      ++cancelIdx;
+      ++cancelCount;
    }
 
    memcpy(&originalId, &msg.Header->Id, sizeof(msg.Header->Id));
@@ -267,16 +333,18 @@ dns::Server::TryForwardPacket(
       //
       try
       {
-         req = std::make_shared<ForwardClientState>();
+         req = std::allocate_shared<ForwardClientState>(FreeListAllocator<ForwardClientState>());
          req->request.insert(req->request.begin(), (char*)buf, (char*)buf+len);
+         req->dnssecOk = DnssecOk(msg);
+         SetUpstreamOpt(req->request, ednsBufferSize);
       }
       catch (const std::bad_alloc&)
       {
          ERROR_SET(err, nomem);
       }
-      forwardReqs.Insert(nullptr, msg, req, cancelVec->data()+cancelIdx, err);
+      forwardReqs.Insert(nullptr, msg, req, &cancel[cancelCount], err);
       ERROR_CHECK(err);
-      ++cancelIdx;
+      ++cancelCount;
    }
 
    //
@@ -297,18 +365,9 @@ dns::Server::TryForwardPacket(
       req->reply.push_back(std::move(reply));
       replyWritten = true;
 
-      if (cancelIdx)
-      {
-         if (cancelIdx == 1)
-            req->cancel.push_back(std::move(*cancelVec->data()));
-         else
-         {
-            cancelVec->resize(cancelIdx);
-            cancelVec->shrink_to_fit();
-            req->cancel.push_back(std::move(cancel));
-         }
-      }
-      cancel = std::function<void()>();
+      for (int i = 0; i < cancelCount; ++i)
+         req->cancel.push_back(cancel[i]);
+      cancelCount = 0;
    }
    catch (const std::bad_alloc&)
    {
@@ -333,8 +392,8 @@ dns::Server::TryForwardPacket(
    ERROR_CHECK(err);
 
 exit:
-   if (cancel)
-      cancel();
+   for (int i = 0; i < cancelCount; ++i)
+      cancel[i].Cancel();
 }
 
 void
@@ -371,6 +430,10 @@ void
 dns::Server::ClearForwardServers()
 {
    forwardServers.resize(0);
+   upstreamPools.clear();
+
+   std::lock_guard<std::mutex> lock(upstreamIoLock);
+   upstreamIo.resize(0);
 }
 
 void
@@ -391,10 +454,24 @@ dns::Server::ForwardClientState::Cancel()
 {
    auto rc = shared_from_this();
 
-   for (auto &fn : cancel)
+   for (auto &handle : cancel)
    {
-      fn();
+      handle.Cancel();
    }
 
    cancel.resize(0);
+   CancelTimer();
+}
+
+void
+dns::Server::ForwardClientState::CancelTimer()
+{
+   ++timerGeneration;
+
+   if (timer.Get())
+   {
+      error err;
+      timer->remove(&err);
+      timer = common::Pointer<pollster::event>();
+   }
 }
@@ -100,17 +100,18 @@ exit:
 
 bool
 dns::Server::TryLocalEntry(
-   const std::string sanitizedHostname,
-   const Message &msg,
+   const DomainName &name,
+   const MessageView &msg,
    const std::function<void(const void *, size_t, error *)> &reply
 )
 {
    error err;
-   auto recp = localEntries.find(sanitizedHostname);
+   auto recp = localEntries.find(name);
    if (recp != localEntries.end())
    {
       auto &rec = recp->second;
-      MessageWriter response;
+      Arena arena;
+      MessageWriter response(&arena);
       Type type;
       bool any;
 
@@ -118,14 +119,8 @@ dns::Server::TryLocalEntry(
 
       auto q = response.AddQuestion(&err);
       ERROR_CHECK(&err);
-      try
-      {
-         q->Name = msg.Questions[0].Name;
-      }
-      catch (const std::bad_alloc &)
-      {
-         ERROR_SET(&err, nomem);
-      }
+      msg.Questions[0].Name.ToString(q->Name, &err);
+      ERROR_CHECK(&err);
       *q->Attrs = *msg.Questions[0].Attrs;
 
       switch ((Class)q->Attrs->Class.Get())
@@ -151,7 +146,7 @@ dns::Server::TryLocalEntry(
 
             try
             {
-               answer->Name = msg.Questions[0].Name;
+               answer->Name = q->Name;
             }
             catch (const std::bad_alloc &)
             {
@@ -0,0 +1,132 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <pollster/socket.h>
+#include <pollster/pollster.h>
+
+#include <dnsmailbox.h>
+
+#include <errno.h>
+
+#if !defined(_WINDOWS)
+#include <unistd.h>
+#endif
+
+dns::Mailbox::~Mailbox()
+{
+#if !defined(_WINDOWS)
+   if (writeFd >= 0)
+      close(writeFd);
+#endif
+}
+
+void
+dns::Mailbox::Start(pollster::waiter *loop, error *err)
+{
+#if defined(_WINDOWS)
+   ERROR_SET(err, unknown, "Mailbox not supported");
+#else
+   std::weak_ptr<Mailbox> weak = shared_from_this();
+   int fds[2] = {-1, -1};
+
+   if (readFd.get())
+      goto exit;
+
+   try
+   {
+      readFd = std::make_shared<common::SocketHandle>();
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   if (pipe(fds))
+      ERROR_SET(err, errno, errno);
+   *readFd = fds[0];
+   writeFd = fds[1];
+
+   // A full pipe already has a wakeup in it, so writes never need to
+   // block.
+   //
+   set_nonblock(fds[0], true, err);
+   ERROR_CHECK(err);
+   set_nonblock(fds[1], true, err);
+   ERROR_CHECK(err);
+
+   loop->add_socket(
+      readFd,
+      false,
+      [weak] (pollster::socket_event *sev, error *err) -> void
+      {
+         sev->on_signal = [weak] (error *err) -> void
+         {
+            auto rc = weak.lock();
+            if (rc.get())
+               rc->Drain(err);
+         };
+      },
+      event.GetAddressOf(),
+      err
+   );
+   ERROR_CHECK(err);
+#endif
+exit:;
+}
+
+void
+dns::Mailbox::Post(Function &&fn, error *err)
+{
+   bool wake = false;
+
+   try
+   {
+      std::lock_guard<std::mutex> l(lock);
+      wake = pending.empty();
+      pending.push_back(std::move(fn));
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+#if !defined(_WINDOWS)
+   if (wake && writeFd >= 0)
+   {
+      char ch = 0;
+      if (write(writeFd, &ch, 1)) {}
+   }
+#endif
+exit:;
+}
+
+void
+dns::Mailbox::Drain(error *err)
+{
+   std::vector<Function> work;
+
+#if !defined(_WINDOWS)
+   // Empty the pipe before taking the queue, so that anything posted
+   // after the swap is certain to write another wakeup.
+   //
+   char buf[64];
+   while (read(readFd->Get(), buf, sizeof(buf)) > 0)
+      ;
+#endif
+
+   {
+      std::lock_guard<std::mutex> l(lock);
+      work.swap(pending);
+   }
+
+   for (auto &fn : work)
+   {
+      fn(err);
+      error_clear(err);
+   }
+}
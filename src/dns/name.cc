@@ -0,0 +1,107 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnsname.h>
+
+bool
+dns::DomainName::Assign(const char *dotted, size_t len)
+{
+   auto p = dotted;
+   auto end = dotted + len;
+   size_t n = 0;
+
+   length = 0;
+
+   while (p < end)
+   {
+      auto label = p;
+
+      p = (const char*)memchr(p, '.', end - p);
+      if (!p)
+         p = end;
+
+      size_t l = p - label;
+      if (!l || l >= 64 || n + 2 + l > MaxLength)
+         goto fail;
+
+      wire[n++] = l;
+      memcpy(wire + n, label, l);
+      n += l;
+
+      if (p < end)
+         ++p;
+   }
+   wire[n++] = 0;
+
+   length = n;
+   Finish();
+   return true;
+fail:
+   Clear();
+   return false;
+}
+
+bool
+dns::DomainName::AssignWire(const void *buf, size_t len)
+{
+   auto p = (const unsigned char*)buf;
+   size_t n = 0;
+
+   length = 0;
+
+   for (;;)
+   {
+      if (n >= len)
+         goto fail;
+
+      unsigned char l = p[n];
+      if ((l & 0xc0) || n + 1 + l > len || n + 1 + l > MaxLength)
+         goto fail;
+
+      wire[n++] = l;
+      if (!l)
+         break;
+
+      memcpy(wire + n, p + n, l);
+      n += l;
+   }
+
+   length = n;
+   Finish();
+   return true;
+fail:
+   Clear();
+   return false;
+}
+
+void
+dns::DomainName::Finish()
+{
+   // The hash is of the folded form, so that names differing only in
+   // case hash alike.
+   //
+   hash = FoldNameAndHash(wire, folded, length);
+}
+
+std::string
+dns::DomainName::ToString() const
+{
+   std::string r;
+   size_t i = 0;
+
+   while (i < length && wire[i])
+   {
+      size_t l = (unsigned char)wire[i++];
+      if (r.size())
+         r.push_back('.');
+      r.append(wire + i, l);
+      i += l;
+   }
+
+   return r;
+}
@@ -0,0 +1,373 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnsname.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+//
+// Case folding, hashing and case-insensitive comparison of names, which
+// are most of the per-byte work on a query.  Each comes in a plain C
+// version that handles eight bytes at a time, and SSE2 and AVX2 versions
+// for x86.  The one to use is picked once, on first call, from what the
+// CPU supports.
+//
+// All of them agree on the hash: the folded name is read as native-order
+// 64-bit words and mixed in one at a time.  A ragged end is the last eight
+// bytes of the name, or, for a name shorter than that, the name padded
+// with zeros.  GetNameKernels() hands out a version in particular, so
+// that bench/namekernel can check and time each one.
+//
+
+namespace {
+
+using dns::internal::NameKernelLevel;
+using dns::internal::NameKernelScalar;
+using dns::internal::NameKernelSse2;
+using dns::internal::NameKernelAvx2;
+using dns::internal::NameKernels;
+
+const uint64_t HashSeed = 0x9e3779b97f4a7c15ULL;
+const uint64_t HashMul = 0xff51afd7ed558ccdULL;
+
+inline uint64_t
+MixWord(uint64_t h, uint64_t w)
+{
+   h = (h ^ w) * HashMul;
+   return h ^ (h >> 29);
+}
+
+inline uint64_t
+FinishHash(uint64_t h, size_t n)
+{
+   h = (h ^ n) * HashMul;
+   return h ^ (h >> 32);
+}
+
+inline uint64_t
+LoadWord(const void *p)
+{
+   uint64_t w;
+   memcpy(&w, p, sizeof(w));
+   return w;
+}
+
+inline void
+StoreWord(void *p, uint64_t w)
+{
+   memcpy(p, &w, sizeof(w));
+}
+
+// Lowercase eight ASCII bytes at once.  Bytes with the high bit set are
+// left alone, and no byte carries into its neighbour.
+//
+inline uint64_t
+FoldWord(uint64_t w)
+{
+   const uint64_t ones = 0x0101010101010101ULL;
+   const uint64_t high = 0x8080808080808080ULL;
+   uint64_t low7 = w & ~high;
+   uint64_t geA = low7 + ones * (0x80 - 'A');
+   uint64_t gtZ = low7 + ones * (0x7f - 'Z');
+   uint64_t upper = (geA ^ gtZ) & ~w & high;
+   return w | (upper >> 2);
+}
+
+// Fold and hash from i to n, eight bytes at a time.  The vector versions
+// finish up with this, so a name hashes the same whichever did the bulk.
+//
+// A ragged end is done by going back for the last whole word, since
+// folding a byte twice is harmless; only names shorter than a word are
+// done a byte at a time.
+//
+uint64_t
+FoldWords(const char *in, char *out, size_t i, size_t n, bool hash, uint64_t h)
+{
+   uint64_t w = 0;
+
+   for (; i + 8 <= n; i += 8)
+   {
+      w = FoldWord(LoadWord(in + i));
+      StoreWord(out + i, w);
+      if (hash)
+         h = MixWord(h, w);
+   }
+   if (i == n)
+      return h;
+
+   if (n >= 8)
+   {
+      w = FoldWord(LoadWord(in + n - 8));
+      StoreWord(out + n - 8, w);
+   }
+   else
+   {
+      char word[8] = {0};
+      memcpy(word, in + i, n - i);
+      w = FoldWord(LoadWord(word));
+      StoreWord(word, w);
+      memcpy(out + i, word, n - i);
+   }
+   return hash ? MixWord(h, w) : h;
+}
+
+uint64_t
+FoldScalar(const char *in, char *out, size_t n, bool hash)
+{
+   uint64_t h = FoldWords(in, out, 0, n, hash, HashSeed);
+   return hash ? FinishHash(h, n) : 0;
+}
+
+bool
+EqualsScalar(const char *a, const char *b, size_t n)
+{
+   size_t i = 0;
+
+   for (; i + 8 <= n; i += 8)
+   {
+      if (FoldWord(LoadWord(a + i)) != FoldWord(LoadWord(b + i)))
+         return false;
+   }
+   if (i == n)
+      return true;
+   if (n >= 8)
+      return FoldWord(LoadWord(a + n - 8)) == FoldWord(LoadWord(b + n - 8));
+
+   char wa[8] = {0}, wb[8] = {0};
+   memcpy(wa, a + i, n - i);
+   memcpy(wb, b + i, n - i);
+   return FoldWord(LoadWord(wa)) == FoldWord(LoadWord(wb));
+}
+
+#if defined(HAVE_X86)
+
+#if defined(__GNUC__)
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+// Bytes in 'A'..'Z' are the only ones that land below -128+26 after the
+// shift, as signed.
+//
+TARGET("sse2") inline __m128i
+FoldSse2(__m128i v)
+{
+   __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - 'A')));
+   __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + 26)));
+   return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+TARGET("sse2") uint64_t
+FoldSse2(const char *in, char *out, size_t n, bool hash)
+{
+   uint64_t h = HashSeed;
+   size_t i = 0;
+
+   for (; i + 16 <= n; i += 16)
+   {
+      __m128i v = FoldSse2(_mm_loadu_si128((const __m128i*)(in + i)));
+      _mm_storeu_si128((__m128i*)(out + i), v);
+      if (hash)
+      {
+         h = MixWord(h, LoadWord(out + i));
+         h = MixWord(h, LoadWord(out + i + 8));
+      }
+   }
+   h = FoldWords(in, out, i, n, hash, h);
+   return hash ? FinishHash(h, n) : 0;
+}
+
+TARGET("sse2") bool
+EqualsSse2(const char *a, const char *b, size_t n)
+{
+   size_t i = 0;
+
+   for (; i + 16 <= n; i += 16)
+   {
+      __m128i va = FoldSse2(_mm_loadu_si128((const __m128i*)(a + i)));
+      __m128i vb = FoldSse2(_mm_loadu_si128((const __m128i*)(b + i)));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+         return false;
+   }
+   if (i == n)
+      return true;
+   if (n >= 16)
+   {
+      __m128i va = FoldSse2(_mm_loadu_si128((const __m128i*)(a + n - 16)));
+      __m128i vb = FoldSse2(_mm_loadu_si128((const __m128i*)(b + n - 16)));
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff;
+   }
+   return EqualsScalar(a, b, n);
+}
+
+TARGET("avx2") inline __m256i
+FoldAvx2(__m256i v)
+{
+   __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - 'A')));
+   __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + 26)), shifted);
+   return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+TARGET("avx2") uint64_t
+FoldAvx2(const char *in, char *out, size_t n, bool hash)
+{
+   uint64_t h = HashSeed;
+   size_t i = 0;
+
+   for (; i + 32 <= n; i += 32)
+   {
+      __m256i v = FoldAvx2(_mm256_loadu_si256((const __m256i*)(in + i)));
+      _mm256_storeu_si256((__m256i*)(out + i), v);
+      if (hash)
+      {
+         for (size_t j = 0; j < 32; j += 8)
+            h = MixWord(h, LoadWord(out + i + j));
+      }
+   }
+   if (i + 16 <= n)
+   {
+      __m128i v = FoldSse2(_mm_loadu_si128((const __m128i*)(in + i)));
+      _mm_storeu_si128((__m128i*)(out + i), v);
+      if (hash)
+      {
+         h = MixWord(h, LoadWord(out + i));
+         h = MixWord(h, LoadWord(out + i + 8));
+      }
+      i += 16;
+   }
+   h = FoldWords(in, out, i, n, hash, h);
+   return hash ? FinishHash(h, n) : 0;
+}
+
+TARGET("avx2") bool
+EqualsAvx2(const char *a, const char *b, size_t n)
+{
+   size_t i = 0;
+
+   for (; i + 32 <= n; i += 32)
+   {
+      __m256i va = FoldAvx2(_mm256_loadu_si256((const __m256i*)(a + i)));
+      __m256i vb = FoldAvx2(_mm256_loadu_si256((const __m256i*)(b + i)));
+      if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xffffffffU)
+         return false;
+   }
+   if (i == n)
+      return true;
+   if (n >= 32)
+   {
+      __m256i va = FoldAvx2(_mm256_loadu_si256((const __m256i*)(a + n - 32)));
+      __m256i vb = FoldAvx2(_mm256_loadu_si256((const __m256i*)(b + n - 32)));
+      return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) == 0xffffffffU;
+   }
+   return EqualsSse2(a, b, n);
+}
+
+#undef TARGET
+
+NameKernelLevel
+DetectCpu()
+{
+#if defined(__GNUC__)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+      return NameKernelAvx2;
+   if (__builtin_cpu_supports("sse2"))
+      return NameKernelSse2;
+   return NameKernelScalar;
+#elif defined(_MSC_VER)
+   int regs[4];
+   __cpuid(regs, 0);
+   int maxLeaf = regs[0];
+   __cpuid(regs, 1);
+   bool sse2 = (regs[3] & (1 << 26)) != 0;
+   bool osxsave = (regs[2] & (1 << 27)) != 0;
+   if (osxsave && maxLeaf >= 7 && (_xgetbv(0) & 6) == 6)
+   {
+      __cpuidex(regs, 7, 0);
+      if (regs[1] & (1 << 5))
+         return NameKernelAvx2;
+   }
+   return sse2 ? NameKernelSse2 : NameKernelScalar;
+#else
+   return NameKernelScalar;
+#endif
+}
+
+#endif
+
+NameKernels
+KernelsFor(NameKernelLevel level)
+{
+#if defined(HAVE_X86)
+   switch (level)
+   {
+   case NameKernelAvx2:
+      return NameKernels{FoldAvx2, EqualsAvx2};
+   case NameKernelSse2:
+      return NameKernels{FoldSse2, EqualsSse2};
+   default:
+      break;
+   }
+#endif
+   return NameKernels{FoldScalar, EqualsScalar};
+}
+
+const NameKernels &
+Select()
+{
+   static const NameKernels kernels = [] () -> NameKernels
+   {
+#if defined(HAVE_X86)
+      return KernelsFor(DetectCpu());
+#else
+      return KernelsFor(NameKernelScalar);
+#endif
+   }();
+   return kernels;
+}
+
+} // end namespace
+
+bool
+dns::internal::GetNameKernels(NameKernelLevel level, NameKernels *out)
+{
+#if defined(HAVE_X86)
+   if (level > DetectCpu())
+      return false;
+#else
+   if (level != NameKernelScalar)
+      return false;
+#endif
+   *out = KernelsFor(level);
+   return true;
+}
+
+void
+dns::FoldName(const char *in, char *out, size_t n)
+{
+   Select().Fold(in, out, n, false);
+}
+
+uint64_t
+dns::FoldNameAndHash(const char *in, char *out, size_t n)
+{
+   return Select().Fold(in, out, n, true);
+}
+
+bool
+dns::NameEqualsIgnoringCase(const char *a, const char *b, size_t n)
+{
+   return Select().Equals(a, b, n);
+}
@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+#include <algorithm>
+
 static inline
 uint16_t
 read16(const void *pv)
@@ -208,7 +210,7 @@ dns::ParseMessage(
 {
    auto p = (char*)buf;
 
-   if (len < sizeof(m->Header))
+   if (len < sizeof(*m->Header))
    {
       ERROR_SET(err, unknown, "out of bounds");
    }
@@ -216,12 +218,34 @@ dns::ParseMessage(
    m->Header = (MessageHeader*)buf;
    p += sizeof(*m->Header);
 
+   // Reserve up front so an arena-backed message doesn't leave a trail of
+   // outgrown arrays behind.  The counts are only trusted as far as the
+   // packet could actually hold that many entries.
+   //
+   try
+   {
+      size_t room = len - sizeof(*m->Header);
+      size_t records = m->Header->AnswerCount.Get() +
+                       m->Header->AuthorityNameCount.Get() +
+                       m->Header->AdditionalRecordCount.Get();
+      m->Questions.reserve(std::min<size_t>(m->Header->QuestionCount.Get(), room / (1 + sizeof(QuestionAttrs))));
+      m->Records.reserve(std::min<size_t>(records, room / (1 + offsetof(RecordAttrs, Data))));
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
    for (int n = m->Header->QuestionCount.Get(); n--; )
    {
       Question q;
+      NameView name(buf, len, p - (char*)buf);
       q.Attrs = (QuestionAttrs*)ParseQuestion(buf, len, p, q.Name, err);
       ERROR_CHECK(err);
 
+      if (!name.ToDomainName(&q.Domain))
+         ERROR_SET(err, unknown, "name too long");
+
       p = (char*)q.Attrs + sizeof(*q.Attrs);
 
       try
@@ -268,6 +292,209 @@ dns::ParseMessage(
 exit:;
 }
 
+namespace {
+
+const size_t MaxNameLength = 255;
+
+// Check the name at off, returning the offset just past it, or 0 if it's
+// malformed.  Compression pointers must point strictly backwards, which
+// rules out loops.
+//
+size_t
+SkipName(const unsigned char *p, size_t len, size_t off)
+{
+   size_t start = off;
+   size_t end = 0;
+   size_t total = 0;
+
+   for (;;)
+   {
+      if (off >= len)
+         return 0;
+
+      unsigned char l = p[off];
+      if ((l & 0xc0) == 0xc0)
+      {
+         if (off + 1 >= len)
+            return 0;
+
+         size_t target = ((l & 0x3f) << 8) | p[off + 1];
+         if (target >= start)
+            return 0;
+         if (!end)
+            end = off + 2;
+         start = off = target;
+         continue;
+      }
+      if (l & 0xc0)
+         return 0;
+
+      total += 1 + l;
+      if (off + 1 + l > len || total > MaxNameLength)
+         return 0;
+
+      off += 1 + l;
+      if (!l)
+         break;
+   }
+
+   return end ? end : off;
+}
+
+} // end namespace
+
+bool
+dns::NameView::LabelIterator::Next(const char **label, size_t *length)
+{
+   for (;;)
+   {
+      if (!base || offset >= len)
+         return false;
+
+      unsigned char l = base[offset];
+      if ((l & 0xc0) == 0xc0)
+      {
+         if (offset + 1 >= len || ++jumps > 128)
+            return false;
+         offset = ((l & 0x3f) << 8) | base[offset + 1];
+         continue;
+      }
+      if (!l || (l & 0xc0) || offset + 1 + l > len)
+         return false;
+
+      *label = (const char*)base + offset + 1;
+      *length = l;
+      offset += 1 + l;
+      return true;
+   }
+}
+
+size_t
+dns::NameView::ToWire(char *out, bool fold) const
+{
+   auto it = Labels();
+   const char *label = nullptr;
+   size_t l = 0;
+   size_t n = 0;
+
+   while (it.Next(&label, &l))
+   {
+      if (n + 2 + l > MaxNameLength)
+         return 0;
+
+      out[n++] = l;
+      memcpy(out + n, label, l);
+      n += l;
+   }
+   out[n++] = 0;
+
+   if (fold)
+      FoldName(out, out, n);
+   return n;
+}
+
+void
+dns::NameView::ToString(std::string &out, error *err) const
+{
+   auto it = Labels();
+   const char *label = nullptr;
+   size_t l = 0;
+
+   try
+   {
+      out.resize(0);
+      while (it.Next(&label, &l))
+      {
+         if (out.size())
+            out.push_back('.');
+         out.append(label, l);
+      }
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+exit:;
+}
+
+void
+dns::ParseMessage(
+   const void *buf,
+   size_t len,
+   dns::MessageView *m,
+   error *err
+)
+{
+   auto p = (const unsigned char*)buf;
+   size_t off = sizeof(*m->Header);
+   size_t next = 0;
+   int section = 0;
+
+   m->QuestionCount = 0;
+   m->RecordCount = 0;
+   m->Complete = true;
+   m->Opt = nullptr;
+
+   if (len < sizeof(*m->Header))
+      ERROR_SET(err, unknown, "out of bounds");
+
+   m->Header = (MessageHeader*)buf;
+
+   for (int n = m->Header->QuestionCount.Get(); n--; )
+   {
+      next = SkipName(p, len, off);
+      if (!next || next + sizeof(QuestionAttrs) > len)
+         ERROR_SET(err, unknown, "out of bounds");
+
+      if (m->QuestionCount < MessageView::MaxQuestions)
+      {
+         auto &q = m->Questions[m->QuestionCount++];
+         q.Name = NameView(buf, len, off);
+         q.Attrs = (const QuestionAttrs*)(p + next);
+      }
+      else
+      {
+         m->Complete = false;
+      }
+
+      off = next + sizeof(QuestionAttrs);
+   }
+
+   for (auto &c : {m->Header->AnswerCount, m->Header->AuthorityNameCount, m->Header->AdditionalRecordCount})
+   {
+      bool additional = (section++ == 2);
+
+      for (int n = c.Get(); n--; )
+      {
+         next = SkipName(p, len, off);
+         if (!next || next + offsetof(RecordAttrs, Data) > len)
+            ERROR_SET(err, unknown, "out of bounds");
+
+         auto attrs = (const RecordAttrs*)(p + next);
+         if (next + offsetof(RecordAttrs, Data) + attrs->Length.Get() > len)
+            ERROR_SET(err, unknown, "out of bounds");
+
+         if (additional && !m->Opt && attrs->Type.Get() == (uint16_t)Type::OPT)
+            m->Opt = attrs;
+
+         if (m->RecordCount < MessageView::MaxRecords)
+         {
+            auto &r = m->Records[m->RecordCount++];
+            r.Name = NameView(buf, len, off);
+            r.Attrs = attrs;
+         }
+         else
+         {
+            m->Complete = false;
+         }
+
+         off = next + offsetof(RecordAttrs, Data) + attrs->Length.Get();
+      }
+   }
+
+exit:;
+}
+
 #if defined(__clang__) && \
     __clang_major__ < 7 || (__clang_major__ == 7 && __clang_minor__ == 3)
 #define PRINTF_CLOSURE_HACK
@@ -438,7 +665,16 @@ dns::TypeToString(uint16_t type)
       TYPE(MINFO);
       TYPE(MX);
       TYPE(TXT);
+      TYPE(RP);
+      TYPE(AFSDB);
+      TYPE(RT);
       TYPE(AAAA);
+      TYPE(PX);
+      TYPE(SRV);
+      TYPE(KX);
+      TYPE(DNAME);
+      TYPE(OPT);
+      TYPE(RRSIG);
 #undef TYPE
    }
 
@@ -0,0 +1,114 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <dnsrdata.h>
+
+#include <string.h>
+
+namespace {
+
+const size_t MaxNameLength = 255;
+
+// Copy the possibly compressed name at off into out[MaxNameLength], in
+// wire format.  Returns the offset just past the name where it appears
+// in buf, or 0 if it is malformed.
+//
+size_t
+ReadName(const void *buf, size_t len, size_t off, char *out, size_t &n)
+{
+   auto p = (const unsigned char*)buf;
+   size_t end = 0;
+   int jumps = 0;
+
+   n = 0;
+   for (;;)
+   {
+      if (off >= len)
+         return 0;
+
+      unsigned char l = p[off];
+      if ((l & 0xc0) == 0xc0)
+      {
+         if (off + 1 >= len || ++jumps > 64)
+            return 0;
+         if (!end)
+            end = off + 2;
+         off = ((l & 0x3f) << 8) | p[off + 1];
+         continue;
+      }
+      if ((l & 0xc0) || off + 1 + l > len || n + 1 + l > MaxNameLength)
+         return 0;
+
+      out[n++] = l;
+      ++off;
+      if (!l)
+         break;
+
+      memcpy(out + n, p + off, l);
+      n += l;
+      off += l;
+   }
+
+   return end ? end : off;
+}
+
+struct Expander
+{
+   const char *msg;
+   size_t off;
+   size_t end;
+   std::vector<char> &out;
+
+   template<typename Format>
+   bool
+   Visit()
+   {
+      char name[MaxNameLength];
+      size_t n = 0;
+
+      if (off + Format::PrefixLength > end)
+         return false;
+      out.insert(out.end(), msg + off, msg + off + Format::PrefixLength);
+      off += Format::PrefixLength;
+
+      for (int i = 0; i < Format::NameCount; ++i)
+      {
+         off = ReadName(msg, end, off, name, n);
+         if (!off)
+            return false;
+         out.insert(out.end(), name, name + n);
+      }
+
+      if (off + Format::SuffixLength != end)
+         return false;
+      out.insert(out.end(), msg + off, msg + end);
+      return true;
+   }
+
+   bool
+   Opaque()
+   {
+      out.insert(out.end(), msg + off, msg + end);
+      return true;
+   }
+};
+
+} // end namespace
+
+bool
+dns::ExpandRdata(const void *msg, size_t len, const RecordAttrs *attrs, std::vector<char> &out)
+{
+   size_t off = attrs->Data - (const char*)msg;
+   size_t end = off + attrs->Length.Get();
+
+   if (end > len)
+      return false;
+
+   Expander expander{(const char*)msg, off, end, out};
+   return VisitRdata(attrs->Type.Get(), expander);
+}
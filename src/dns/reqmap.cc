@@ -17,17 +17,18 @@ dns::ResponseMap::OnResponse(
    const struct sockaddr *addr,
    const void *buf,
    size_t len,
-   Message &msg,
+   MessageView &msg,
    error *err
 )
 {
-   auto resp = reqs.Lookup(addr, msg);
+   size_t idx = 0;
+   auto resp = reqs.Lookup(addr, msg, &idx);
    if (resp)
    {
       try
       {
          auto cb = std::move(*resp);
-         reqs.Remove(msg.Header->Id.Get(), resp);
+         reqs.Remove(idx);
          if (cb)
             cb(buf, len, msg, err);
       }
@@ -42,13 +43,14 @@ exit:;
 void
 dns::ResponseMap::OnRequest(
    const struct sockaddr *addr,
-   const Message &msg,
+   const MessageView &msg,
    const Callback &cb,
-   std::function<void()> *cancel,
+   RequestHandle *cancel,
    error *err
 )
 {
-   auto resp = reqs.Lookup(addr, msg);
+   size_t idx = 0;
+   auto resp = reqs.Lookup(addr, msg, &idx);
    if (resp)
    {
       try
@@ -62,14 +64,8 @@ dns::ResponseMap::OnRequest(
 
       if (cancel)
       {
-         try
-         {
-            *cancel = reqs.CreateCancel(addr, msg);
-         }
-         catch (const std::bad_alloc&)
-         {
-            ERROR_SET(err, nomem);
-         }
+         reqs.Handle(idx, cancel, err);
+         ERROR_CHECK(err);
       }
    }
    else
@@ -79,7 +75,7 @@ dns::ResponseMap::OnRequest(
    }
 exit:
    if (ERROR_FAILED(err) && cancel)
-      *cancel = std::function<void()>();
+      cancel->Reset();
 }
 
 void
@@ -87,22 +83,22 @@ dns::ResponseMap::OnRequest(
    const struct sockaddr *addr,
    const void *buf,
    size_t len,
-   const Message *msg,
+   const MessageView *msg,
    const Callback &cb,
-   std::function<void()> *cancel,
+   RequestHandle *cancel,
    error *err
 )
 {
-   Message msgStorage;
+   MessageView view;
 
    if (!cb)
       goto exit;
 
    if (!msg)
    {
-      ParseMessage(buf, len, &msgStorage, err);
+      ParseMessage(buf, len, &view, err);
       ERROR_CHECK(err);
-      msg = &msgStorage;
+      msg = &view;
    }
 
    if (len < 2)
@@ -138,3 +134,40 @@ dns::internal::ParseAddr(const struct sockaddr *addr, int &off, size_t &len)
    return true;
 }
 
+uint64_t
+dns::internal::RequestFingerprint(
+   uint64_t nameHash,
+   uint16_t id,
+   uint16_t type,
+   uint16_t cls,
+   uint16_t flags,
+   const unsigned char *addr,
+   size_t addrLength
+)
+{
+   // FNV-1a over the rest, starting from the name's hash, then a final
+   // mix so that the low bits, which pick the slot, depend on all of it.
+   //
+   uint64_t h = nameHash ^ 14695981039346656037ULL;
+   auto mix = [&h] (unsigned char ch) -> void
+   {
+      h ^= ch;
+      h *= 1099511628211ULL;
+   };
+
+   mix(id >> 8);
+   mix(id);
+   mix(type >> 8);
+   mix(type);
+   mix(cls >> 8);
+   mix(cls);
+   mix(flags >> 8);
+   mix(flags);
+   for (size_t i = 0; i < addrLength; ++i)
+      mix(addr[i]);
+
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return h;
+}
@@ -13,6 +13,7 @@
 
 #include <common/logger.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 void
@@ -26,6 +27,20 @@ dns::Server::Initialize(error *err)
 exit:;
 }
 
+void
+dns::Server::GetLoop(pollster::waiter **loop, error *err)
+{
+   if (workerLoop.Get())
+   {
+      *loop = workerLoop.Get();
+      (*loop)->AddRef();
+   }
+   else
+   {
+      pollster::get_common_queue(loop, err);
+   }
+}
+
 void
 dns::Server::HandleMessage(
    MessageMode mode,
@@ -36,20 +51,29 @@ dns::Server::HandleMessage(
    error *err
 )
 {
-   Message msg;
+   Arena arena;
+   MessageView view;
    ResponseCode rc = ResponseCode::ServerFailure;
 
-   ParseMessage(buf, len, &msg, err);
+   // Cache hits are answered straight out of the packet.
+   //
+   if (((int)mode & (int)MessageMode::Server) && TryCache(buf, len, reply))
+      return;
+
+   // The view is all that answering from the cache or forwarding needs,
+   // and it doesn't allocate.
+   //
+   ParseMessage(buf, len, &view, err);
    if (ERROR_FAILED(err))
    {
       rc = ResponseCode::FormatError;
       goto errorReply;
    }
 
-   if (msg.Header->Response)
+   if (view.Header->Response)
    {
       if ((int)mode & (int)MessageMode::Client)
-         map.OnResponse(addr, buf, len, msg, err);
+         map.OnResponse(addr, buf, len, view, err);
       return;
    }
    else if (!((int)mode & (int)MessageMode::Server))
@@ -57,16 +81,16 @@ dns::Server::HandleMessage(
 
    // Several DNS servers reject more than one question per packet.
    //
-   if (msg.Header->QuestionCount.Get() != 1)
+   if (view.Header->QuestionCount.Get() != 1)
    {
       rc = ResponseCode::FormatError;
       goto errorReply;
    }
 
-   if (TryCache(msg, reply))
+   if (TryCache(view, reply))
       goto exit;
 
-   TryForwardPacket(addr, buf, len, msg, reply, err);
+   TryForwardPacket(addr, buf, len, view, reply, err);
    ERROR_CHECK(err);
 
 exit:;
@@ -79,23 +103,31 @@ errorReply:
        len > 2 &&
        (len < 3 || !((MessageHeader*)buf)->Response))
    {
-      MessageWriter writer;
+      MessageWriter writer(&arena);
+      ArenaVector<char> out(&arena);
 
       writer.Header->Id.Put(((MessageHeader*)buf)->Id.Get());
       writer.Header->Response = 1;
       writer.Header->ResponseCode = (unsigned)rc;
       writer.Header->RecursionAvailable = 1;
 
-      for (auto q : msg.Questions)
+      for (size_t i = 0; i < view.QuestionCount; ++i)
       {
+         auto &q = view.Questions[i];
          auto qq = writer.AddQuestion(err);
          if (ERROR_FAILED(err))
             break;
-         qq->Name = std::move(q.Name);
+         q.Name.ToString(qq->Name, err);
+         if (ERROR_FAILED(err))
+            break;
          *qq->Attrs = *q.Attrs;
       }
 
-      auto vec = writer.Serialize(err);
+      // Sized for the questions we echo, however long they are; the
+      // transport fits it to what the client can take.
+      //
+      if (!ERROR_FAILED(err))
+         out = writer.Serialize(err);
 
       if (ERROR_FAILED(err))
       {
@@ -105,7 +137,7 @@ errorReply:
       }
       else
       {
-         reply(vec.data(), vec.size(), err);
+         reply(out.data(), out.size(), err);
       }
       error_clear(err);
    }
@@ -125,9 +157,24 @@ dns::Server::AttachConfig(ConfigFileMap &map, error *err)
             const char *cmd = argv[0];
             size_t cmdlen = strlen(cmd)+1;
 #define WRAP_STRING(x) static const char str_##x [] = #x
+#define WRAP_STRING_NAMED(x, s) static const char str_##x [] = s
             WRAP_STRING(search);
             WRAP_STRING(nameserver);
+            WRAP_STRING_NAMED(cache_file, "cache-file");
+            WRAP_STRING_NAMED(cache_size, "cache-size");
+            WRAP_STRING_NAMED(cache_save_interval, "cache-save-interval");
+            WRAP_STRING_NAMED(serve_stale, "serve-stale");
+            WRAP_STRING_NAMED(stale_ttl, "stale-ttl");
+            WRAP_STRING_NAMED(servfail_ttl, "servfail-ttl");
+            WRAP_STRING(prefetch);
+            WRAP_STRING_NAMED(stats_interval, "stats-interval");
+            WRAP_STRING_NAMED(edns_buffer_size, "edns-buffer-size");
+            WRAP_STRING_NAMED(minimal_responses, "minimal-responses");
+            WRAP_STRING(workers);
+            WRAP_STRING_NAMED(io_uring, "io-uring");
+            WRAP_STRING_NAMED(upstream_sockets, "upstream-sockets");
 #undef WRAP_STRING
+#undef WRAP_STRING_NAMED
 #define CMP(x) (cmdlen == sizeof(str_##x) && !strcmp(cmd, str_##x))
             try
             {
@@ -136,6 +183,105 @@ dns::Server::AttachConfig(ConfigFileMap &map, error *err)
                   if (argc > 1)
                      searchPath = argv[1];
                }
+               else if (CMP(cache_file))
+               {
+                  if (argc > 1)
+                     cacheFile = argv[1];
+               }
+               else if (CMP(cache_size))
+               {
+                  if (argc > 1)
+                  {
+                     char *end = nullptr;
+                     unsigned long long n = strtoull(argv[1], &end, 10);
+                     switch (*end)
+                     {
+                     case 'g': case 'G': n *= 1024;
+                     case 'm': case 'M': n *= 1024;
+                     case 'k': case 'K': n *= 1024;
+                     }
+                     cache.SetBudget(n);
+                  }
+               }
+               else if (CMP(cache_save_interval))
+               {
+                  if (argc > 1)
+                     cacheSaveInterval = atoi(argv[1]);
+               }
+               else if (CMP(serve_stale))
+               {
+                  if (argc > 1)
+                     staleWindow = strtoul(argv[1], nullptr, 10);
+               }
+               else if (CMP(stale_ttl))
+               {
+                  if (argc > 1)
+                     staleTtl = strtoul(argv[1], nullptr, 10);
+               }
+               else if (CMP(servfail_ttl))
+               {
+                  if (argc > 1)
+                     servfailTtl = strtoul(argv[1], nullptr, 10);
+               }
+               else if (CMP(prefetch))
+               {
+                  if (argc > 1)
+                     prefetchPercent = strtoul(argv[1], nullptr, 10);
+                  if (argc > 2)
+                     prefetchMinHits = strtoul(argv[2], nullptr, 10);
+                  if (prefetchPercent > 100)
+                     prefetchPercent = 100;
+               }
+               else if (CMP(stats_interval))
+               {
+                  if (argc > 1)
+                     statsInterval = atoi(argv[1]);
+               }
+               else if (CMP(edns_buffer_size))
+               {
+                  // 1232 is the DNS flag day 2020 default: small enough to
+                  // get through without IP fragmentation nearly everywhere.
+                  //
+                  if (argc > 1)
+                  {
+                     unsigned long n = strtoul(argv[1], nullptr, 10);
+                     if (n && n < MinUdpPayload)
+                        n = MinUdpPayload;
+                     if (n > MaxUdpPayload)
+                        n = MaxUdpPayload;
+                     ednsBufferSize = n;
+                  }
+               }
+               else if (CMP(minimal_responses))
+               {
+                  minimalResponses = (argc < 2 || !strcmp(argv[1], "yes"));
+               }
+               else if (CMP(io_uring))
+               {
+                  ioUring = (argc < 2 || !strcmp(argv[1], "yes"));
+               }
+               else if (CMP(upstream_sockets))
+               {
+                  if (argc > 1)
+                  {
+                     upstreamSockets = atoi(argv[1]);
+                     if (upstreamSockets < 1)
+                        upstreamSockets = 1;
+                     if (upstreamSockets > 64)
+                        upstreamSockets = 64;
+                  }
+               }
+               else if (CMP(workers))
+               {
+                  if (argc > 1)
+                  {
+                     workerCount = atoi(argv[1]);
+                     if (workerCount < 1)
+                        workerCount = 1;
+                     if (workerCount > 64)
+                        workerCount = 64;
+                  }
+               }
                else if (CMP(nameserver))
                {
                   const char *proto = nullptr;
@@ -240,6 +386,7 @@ dns::Server::AttachConfig(ConfigFileMap &map, error *err)
                state.PendingActions.push_back(
                   [this, hostname, entry] (error *err) mutable -> void
                   {
+                     DomainName name;
                      auto trimDots = [&] () -> void
                      {
                         while (hostname.length() && hostname[hostname.length()-1] == '.')
@@ -265,11 +412,14 @@ dns::Server::AttachConfig(ConfigFileMap &map, error *err)
                      trimDots();
                      if (!hostname.length())
                         goto exit;
-                     hostname = SanitizeHost(hostname, err);
-                     ERROR_CHECK(err);
+                     if (!name.Assign(hostname))
+                     {
+                        log_printf("hosts: invalid name: %s", hostname.c_str());
+                        goto exit;
+                     }
                      try
                      {
-                        localEntries[hostname] = std::move(entry);
+                        localEntries[name] = std::move(entry);
                      }
                      catch (const std::bad_alloc &)
                      {
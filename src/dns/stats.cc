@@ -0,0 +1,152 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <pollster/pollster.h>
+
+#include <dnsserver.h>
+#include <dnsudp.h>
+
+#include <common/logger.h>
+
+void
+dns::Server::StartStats(error *err)
+{
+   common::Pointer<pollster::waiter> loop;
+   std::weak_ptr<Server> weak;
+
+   if (statsInterval <= 0 || statsTimer.Get())
+      goto exit;
+
+   weak = shared_from_this();
+
+   pollster::get_common_queue(loop.GetAddressOf(), err);
+   ERROR_CHECK(err);
+
+   loop->add_timer(
+      statsInterval * 1000,
+      true,
+      [weak] (pollster::event *ev, error *err) -> void
+      {
+         ev->on_signal = [weak] (error *err) -> void
+         {
+            auto rc = weak.lock();
+            if (rc.get())
+               rc->LogStats();
+         };
+      },
+      statsTimer.GetAddressOf(),
+      err
+   );
+   ERROR_CHECK(err);
+
+exit:;
+}
+
+void
+dns::Server::LogStats()
+{
+   CacheStats cs;
+   UdpCounters udp;
+   uint64_t prefetchIssued = 0, prefetchWasted = 0;
+   uint64_t upstreamLargeUdp = 0, upstreamTruncated = 0;
+   uint64_t upstreamQueries = 0, upstreamRetransmits = 0;
+   uint64_t clientTrimmed = 0, clientTruncated = 0;
+
+   cache.GetStats(&cs);
+
+   auto addUdp = [&] (UdpSocket *sock) -> void
+   {
+      udp.Reads += sock->Counters.Reads;
+      udp.DatagramsIn += sock->Counters.DatagramsIn;
+      udp.Writes += sock->Counters.Writes;
+      udp.DatagramsOut += sock->Counters.DatagramsOut;
+      udp.DatagramsDropped += sock->Counters.DatagramsDropped;
+   };
+
+   // Sum over the workers too.  Their listeners are set up before their
+   // threads start and never replaced, so they can be read from here;
+   // upstream sockets come and go under a lock.
+   //
+   auto add = [&] (Server *srv) -> void
+   {
+      for (auto sock : {srv->udpSocket.get(), srv->udp6Socket.get()})
+      {
+         if (sock)
+            addUdp(sock);
+      }
+      {
+         std::lock_guard<std::mutex> lock(srv->upstreamIoLock);
+         for (auto &sock : srv->upstreamIo)
+            addUdp(sock.get());
+      }
+      prefetchIssued += srv->stats.PrefetchIssued;
+      prefetchWasted += srv->stats.PrefetchWasted;
+      upstreamLargeUdp += srv->stats.UpstreamLargeUdp;
+      upstreamTruncated += srv->stats.UpstreamTruncated;
+      upstreamQueries += srv->stats.UpstreamQueries;
+      upstreamRetransmits += srv->stats.UpstreamRetransmits;
+      clientTrimmed += srv->stats.ClientTrimmed;
+      clientTruncated += srv->stats.ClientTruncated;
+   };
+
+   add(this);
+   for (auto &worker : workers)
+      add(worker.get());
+
+   log_printf(
+      "stats: cache: %llu entries, %llu bytes, %llu resident, %llu mapped, "
+      "%llu evictions, %llu rejected, %llu expired",
+      (unsigned long long)cs.Entries,
+      (unsigned long long)cs.Bytes,
+      (unsigned long long)cs.Resident,
+      (unsigned long long)cs.Mapped,
+      (unsigned long long)cs.Evictions,
+      (unsigned long long)cs.Rejections,
+      (unsigned long long)cs.Expirations
+   );
+   log_printf(
+      "stats: sweep: %llu ticks, %llu us average, %llu us max",
+      (unsigned long long)stats.SweepTicks,
+      (unsigned long long)(stats.SweepTicks ? stats.SweepMicros / stats.SweepTicks : 0),
+      (unsigned long long)stats.SweepMaxMicros
+   );
+   log_printf(
+      "stats: prefetch: %llu issued, %llu wasted",
+      (unsigned long long)prefetchIssued,
+      (unsigned long long)prefetchWasted
+   );
+   log_printf(
+      "stats: upstream: %llu queries, %llu retransmits",
+      (unsigned long long)upstreamQueries,
+      (unsigned long long)upstreamRetransmits
+   );
+   log_printf(
+      "stats: udp: %llu large upstream answers, %llu upstream truncated, "
+      "%llu client trimmed, %llu client truncated",
+      (unsigned long long)upstreamLargeUdp,
+      (unsigned long long)upstreamTruncated,
+      (unsigned long long)clientTrimmed,
+      (unsigned long long)clientTruncated
+   );
+   log_printf(
+      "stats: udp io: %llu datagrams in %llu reads, %llu datagrams out in %llu writes, %llu dropped",
+      (unsigned long long)udp.DatagramsIn,
+      (unsigned long long)udp.Reads,
+      (unsigned long long)udp.DatagramsOut,
+      (unsigned long long)udp.Writes,
+      (unsigned long long)udp.DatagramsDropped
+   );
+   // Arenas keep their free lists per thread; this is the primary's.
+   // Other heap allocations, such as names, aren't counted.
+   //
+   log_printf(
+      "stats: arena blocks: %llu from the heap, %llu recycled",
+      (unsigned long long)Arena::Counters.BlockMallocs,
+      (unsigned long long)Arena::Counters.BlockReuses
+   );
+}
@@ -16,24 +16,80 @@
 
 namespace {
 
+// advertise, if nonzero, is the payload size for an OPT record added to
+// the end, for clients that sent one.  With minimal, positive answers
+// are cut down to the answer section, as for UDP.
+//
 void
-WriteTcp(const std::shared_ptr<pollster::StreamSocket> &fd, const void *buf, size_t len, error *err)
+WriteTcp(
+   const std::shared_ptr<pollster::StreamSocket> &fd,
+   const void *buf,
+   size_t len,
+   uint16_t advertise,
+   bool minimal,
+   error *err
+)
 {
-   if (fd.get())
+   dns::MessageHeader hdr;
+   dns::MessageView msg;
+   error parseErr;
+   char opt[dns::OptRecordLength];
+   size_t extra = advertise ? sizeof(opt) : 0;
+   size_t body = len;
+   bool keptOpt = false;
+   bool trimmed = false, truncated = false;
+
+   if (!fd.get())
+      return;
+
+   if (len < sizeof(hdr) || (!extra && !minimal && len <= 65535))
    {
-      if (len > 65535)
-      {
-         auto hdr = (dns::MessageHeader*)buf;
-         hdr->Truncated = 1;
-         len = 65535;
-      }
       unsigned char lenpkt[] =
       {
          (unsigned char)(len >> 8), (unsigned char)len
       };
       fd->Write(lenpkt, sizeof(lenpkt));
       fd->Write(buf, len);
+      return;
+   }
+
+   // The response may be shared with other clients, so changes go in a
+   // copy of the header.
+   //
+   dns::ParseMessage(buf, len, &msg, &parseErr);
+   if (!ERROR_FAILED(&parseErr))
+   {
+      body = dns::TrailingOpt(buf, len, msg);
+      keptOpt = (msg.Opt && body == len);
+      body = dns::FitResponse(buf, body, msg, 65535 - extra, minimal, &hdr, &trimmed, &truncated);
+      if (body < len)
+         keptOpt = false;
+   }
+   else
+   {
+      memcpy(&hdr, buf, sizeof(hdr));
+      if (len + extra > 65535)
+      {
+         hdr.Truncated = 1;
+         body = 65535 - extra;
+      }
    }
+
+   if (keptOpt)
+      extra = 0;
+   if (extra)
+      dns::WriteOpt(&hdr, opt, advertise);
+
+   size_t total = body + extra;
+   unsigned char lenpkt[] =
+   {
+      (unsigned char)(total >> 8), (unsigned char)total
+   };
+   fd->Write(lenpkt, sizeof(lenpkt));
+   fd->Write(&hdr, sizeof(hdr));
+   fd->Write((const char*)buf + sizeof(hdr), body - sizeof(hdr));
+   if (extra)
+      fd->Write(opt, extra);
 }
 
 template <typename OnClose>
@@ -101,14 +157,22 @@ CreateTcp(
          if (!srv.get())
             break;
 
+         // There's no size to respect over TCP, but a client that sent
+         // an OPT record gets one back.
+         //
+         uint16_t advertise = 0;
+         bool minimal = srv->MinimalResponses();
+         if (srv->EdnsBufferSize() && dns::QueryPayload((char*)buf+2, plen))
+            advertise = srv->EdnsBufferSize();
+
          srv->HandleMessage(
             mode,
             (char*)buf+2, plen,
             nullptr,
             state->map,
-            [state] (const void *buf, size_t len, error *err) -> void
+            [state, advertise, minimal] (const void *buf, size_t len, error *err) -> void
             {
-               WriteTcp(state->fd, buf, len, err);
+               WriteTcp(state->fd, buf, len, advertise, minimal, err);
             },
             err
          );
@@ -204,12 +268,18 @@ dns::Server::SendTcp(
    const std::shared_ptr<ForwardServerState> &state,
    const void *buf,
    size_t len,
-   const Message *msg,
+   const MessageView *msg,
    const ResponseMap::Callback &cb,
-   std::function<void()> *cancel,
+   RequestHandle *cancel,
    error *err
 )
 {
+   if (primary)
+   {
+      SendTcpViaPrimary(state, buf, len, cb, cancel, err);
+      return;
+   }
+
    if (!state->tcpSocket.get())
    {
       try
@@ -271,7 +341,7 @@ dns::Server::SendTcp(
          ERROR_SET(err, nomem);
       }
    }
-   WriteTcp(state->tcpSocket, buf, len, err);
+   WriteTcp(state->tcpSocket, buf, len, 0, false, err);
    ERROR_CHECK(err);
    state->tcpMap->OnRequest(nullptr, buf, len, msg, cb, cancel, err);
    ERROR_CHECK(err);
@@ -11,68 +11,328 @@
 
 #include <dnsserver.h>
 #include <dnsmsg.h>
+#include <dnsudp.h>
+#include <dnsuring.h>
+
+#include <common/logger.h>
+
+#include <errno.h>
+#include <string.h>
 
 using pollster::sendrecv_retval;
 
 namespace {
 
+// Send a response the way the client asked for it: within its payload
+// size, or 512 bytes without EDNS, and with our OPT record in place of
+// whatever the response came with.  What doesn't fit is cut between
+// records; see FitResponse().
+//
 void
 WriteUdp(
-   const std::shared_ptr<common::SocketHandle> &fd,
+   dns::UdpSocket &sock,
    const struct sockaddr *addr,
    const void *buf,
    size_t len,
+   uint16_t payload,
+   uint16_t advertise,
+   bool minimal,
+   bool *trimmed,
+   bool *truncated,
    error *err
 )
 {
-   sendrecv_retval r = 0;
+   char out[dns::MaxUdpPayload];
+   auto hdr = (dns::MessageHeader*)out;
+   dns::MessageView msg;
+   error parseErr;
+   size_t limit = payload ? payload : dns::MinUdpPayload;
+   size_t room = limit - (payload ? dns::OptRecordLength : 0);
+   size_t body = len;
+
+   *trimmed = false;
+   *truncated = false;
 
-   if (len > 512)
+   if (!payload &&
+       !minimal &&
+       len <= limit &&
+       len >= sizeof(*hdr) &&
+       !((const dns::MessageHeader*)buf)->AdditionalRecordCount.Get())
    {
-      auto hdr = (dns::MessageHeader*)buf;
-      hdr->Truncated = 1;
-      len = 512;
+      sock.Send(addr, buf, len, err);
+      return;
    }
 
-   if ((r = sendto(fd->Get(), buf, len, 0, addr, pollster::socklen(addr))) < 0)
+   dns::ParseMessage(buf, len, &msg, &parseErr);
+   if (ERROR_FAILED(&parseErr))
    {
-      ERROR_SET(err, socket);
+      // Not ours to fix; pass it on as it is, within the limit.
+      //
+      body = len < limit ? len : limit;
+      memcpy(out, buf, body);
+      if (body < len && body >= sizeof(*hdr))
+      {
+         hdr->Truncated = 1;
+         *truncated = true;
+      }
+      sock.Send(addr, out, body, err);
+      return;
    }
-exit:;
+
+   body = dns::TrailingOpt(buf, len, msg);
+   bool keptOpt = (msg.Opt && body == len);
+   body = dns::FitResponse(buf, body, msg, room, minimal, hdr, trimmed, truncated);
+   if (body < len)
+      keptOpt = false;
+   memcpy(out + sizeof(*hdr), (const char*)buf + sizeof(*hdr), body - sizeof(*hdr));
+
+   // An OPT we couldn't take out still answers the client's.
+   //
+   if (payload && !keptOpt)
+   {
+      dns::WriteOpt(hdr, out + body, advertise);
+      body += dns::OptRecordLength;
+   }
+
+   sock.Send(addr, out, body, err);
+}
+
+// Whether a failed send means the socket can't take more right now, so
+// the rest of a batch would fail the same way, rather than that one
+// datagram or its destination was refused.
+//
+bool
+SocketFull()
+{
+#if defined(_WINDOWS)
+   int e = WSAGetLastError();
+   return e == WSAEWOULDBLOCK || e == WSAENOBUFS;
+#else
+   return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+#endif
 }
 
 } // end namespace
 
+void
+dns::UdpSocket::Send(const struct sockaddr *addr, const void *buf, size_t len, error *err)
+{
+   Datagram *d = nullptr;
+
+   if (depth && len <= sizeof(d->data))
+   {
+      if (queued == MaxBatch)
+      {
+         Flush(err);
+         ERROR_CHECK(err);
+      }
+
+      try
+      {
+         if (out.size() < MaxBatch)
+            out.resize(MaxBatch);
+      }
+      catch (const std::bad_alloc&)
+      {
+         goto sendNow;
+      }
+
+      d = &out[queued++];
+      if (addr)
+         memcpy(&d->addr, addr, pollster::socklen(addr));
+      else
+         d->addr.sa.sa_family = AF_UNSPEC;
+      memcpy(d->data, buf, len);
+      d->len = len;
+      goto exit;
+   }
+
+sendNow:
+   ++Counters.Writes;
+   ++Counters.DatagramsOut;
+   if (sendto(Fd->Get(), (const char*)buf, len, 0, addr, addr ? pollster::socklen(addr) : 0) < 0)
+      ERROR_SET(err, socket);
+exit:;
+}
+
+void
+dns::UdpSocket::Flush(error *err)
+{
+   size_t sent = 0;
+
+   if (Ring && queued)
+   {
+      Counters.Writes += Ring->Send(out.data(), queued, err);
+      Counters.DatagramsOut += queued;
+      sent = queued;
+      goto exit;
+   }
+
+   while (sent < queued)
+   {
+#if defined(__linux__)
+      struct mmsghdr hdrs[MaxBatch];
+      struct iovec iov[MaxBatch];
+      size_t n = queued - sent;
+      int r = 0;
+
+      memset(hdrs, 0, sizeof(hdrs[0]) * n);
+      for (size_t i = 0; i < n; ++i)
+      {
+         auto &d = out[sent + i];
+         iov[i].iov_base = d.data;
+         iov[i].iov_len = d.len;
+         hdrs[i].msg_hdr.msg_iov = &iov[i];
+         hdrs[i].msg_hdr.msg_iovlen = 1;
+         hdrs[i].msg_hdr.msg_name = (void*)d.Name();
+         hdrs[i].msg_hdr.msg_namelen = d.NameLength();
+      }
+
+      ++Counters.Writes;
+      r = sendmmsg(Fd->Get(), hdrs, n, 0);
+      if (r < 0 && errno == EINTR)
+         continue;
+
+      // sendmmsg() only fails outright on the first datagram.  One bad
+      // destination shouldn't cost everyone after it their replies, so
+      // skip it and carry on, unless the socket itself is full.
+      //
+      if (r <= 0)
+      {
+         if (r < 0 && SocketFull())
+            ERROR_SET(err, socket);
+         ++Counters.DatagramsDropped;
+         ++sent;
+         continue;
+      }
+      Counters.DatagramsOut += r;
+      sent += r;
+#else
+      auto &d = out[sent++];
+      ++Counters.Writes;
+      if (sendto(Fd->Get(), d.data, d.len, 0, d.Name(), d.NameLength()) < 0)
+      {
+         if (SocketFull())
+            ERROR_SET(err, socket);
+         ++Counters.DatagramsDropped;
+         continue;
+      }
+      ++Counters.DatagramsOut;
+#endif
+   }
+
+exit:
+   // Whatever didn't go out is dropped, as a lost datagram would be.
+   //
+   if (sent < queued)
+      Counters.DatagramsDropped += queued - sent;
+   queued = 0;
+}
+
+size_t
+dns::UdpSocket::Receive(error *err)
+{
+   size_t n = 0;
+
+   try
+   {
+      if (in.size() < MaxBatch)
+         in.resize(MaxBatch);
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   if (Ring)
+   {
+      n = Ring->Receive(in.data(), MaxBatch, err);
+      if (!n)
+         goto exit;
+      goto received;
+   }
+
+#if defined(__linux__)
+   {
+      struct mmsghdr hdrs[MaxBatch];
+      struct iovec iov[MaxBatch];
+      int r = 0;
+
+      memset(hdrs, 0, sizeof(hdrs));
+      for (size_t i = 0; i < MaxBatch; ++i)
+      {
+         auto &d = in[i];
+         iov[i].iov_base = d.data;
+         iov[i].iov_len = sizeof(d.data);
+         hdrs[i].msg_hdr.msg_iov = &iov[i];
+         hdrs[i].msg_hdr.msg_iovlen = 1;
+         hdrs[i].msg_hdr.msg_name = &d.addr;
+         hdrs[i].msg_hdr.msg_namelen = sizeof(d.addr);
+      }
+
+      r = recvmmsg(Fd->Get(), hdrs, MaxBatch, 0, nullptr);
+      if (r <= 0)
+         goto exit;
+
+      for (int i = 0; i < r; ++i)
+         in[i].len = hdrs[i].msg_len;
+      n = r;
+   }
+#else
+   while (n < MaxBatch)
+   {
+      auto &d = in[n];
+#if defined(_WINDOWS)
+      int
+#else
+      socklen_t
+#endif
+      addrlen = sizeof(d.addr);
+      sendrecv_retval r = recvfrom(Fd->Get(), d.data, sizeof(d.data), 0, &d.addr.sa, &addrlen);
+      if (r <= 0)
+         break;
+      d.len = r;
+      ++n;
+   }
+   if (!n)
+      goto exit;
+#endif
+
+received:
+   ++Counters.Reads;
+   Counters.DatagramsIn += n;
+exit:
+   return n;
+}
+
 void
 dns::Server::StartUdp(int af, MessageMode mode, error *err)
 {
    std::weak_ptr<Server> weak = shared_from_this();
    std::shared_ptr<common::SocketHandle> fd;
+   std::shared_ptr<UdpSocket> sock;
    common::Pointer<pollster::waiter> loop;
    common::Pointer<pollster::socket_event> sev;
-   union u_addr
-   {
-      struct sockaddr sa;
-      struct sockaddr_in sin;
-      struct sockaddr_in6 sin6;
-   };
-   u_addr addr;
+   UdpSocket::Address addr;
    ResponseMap *map = nullptr;
+   uint16_t port = 53;
 
    memset(&addr, 0, sizeof(addr));
 
-   pollster::get_common_queue(loop.GetAddressOf(), err);
+   GetLoop(loop.GetAddressOf(), err);
    ERROR_CHECK(err);
 
    try
    {
       fd = std::make_shared<common::SocketHandle>();
+      sock = std::make_shared<UdpSocket>();
    }
    catch (const std::bad_alloc&)
    {
       ERROR_SET(err, nomem);
    }
 
+   sock->Fd = fd;
    *fd = socket(af, SOCK_DGRAM, 0);
    if (!fd->Valid())
       ERROR_SET(err, socket);
@@ -82,69 +342,133 @@ dns::Server::StartUdp(int af, MessageMode mode, error *err)
    switch (af)
    {
    case AF_INET:
-      addr.sin.sin_port = htons(53);
+      addr.sin.sin_port = htons(port);
       map = &udpResp;
       break;
    case AF_INET6:
-      addr.sin6.sin6_port = htons(53);
+      addr.sin6.sin6_port = htons(port);
       map = &udp6Resp;
       break;
    }
 
+   // Every worker binds its own listener; the kernel picks one for each
+   // client.  FreeBSD only balances the load with SO_REUSEPORT_LB.
+   //
+   if (workerCount > 1)
+   {
+      int one = 1;
+#if defined(SO_REUSEPORT_LB)
+      if (setsockopt(fd->Get(), SOL_SOCKET, SO_REUSEPORT_LB, (const char*)&one, sizeof(one)))
+         ERROR_SET(err, socket);
+#elif defined(SO_REUSEPORT)
+      if (setsockopt(fd->Get(), SOL_SOCKET, SO_REUSEPORT, (const char*)&one, sizeof(one)))
+         ERROR_SET(err, socket);
+#endif
+   }
+
    if (bind(fd->Get(), &addr.sa, pollster::socklen(&addr.sa)))
       ERROR_SET(err, socket);
 
    set_nonblock(fd->Get(), true, err);
    ERROR_CHECK(err);
 
+   // The listener's wakeups come from the ring, when there is one.
+   //
+   if (ioUring)
+   {
+      std::shared_ptr<UdpRing> ring;
+      error ringErr;
+
+      try
+      {
+         ring = std::make_shared<UdpRing>();
+      }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(err, nomem);
+      }
+
+      ring->Start(fd, &ringErr);
+      if (ERROR_FAILED(&ringErr))
+         log_printf("udp: io_uring unavailable, falling back to poll");
+      else
+         sock->Ring = ring;
+   }
+
    switch (af)
    {
    case AF_INET:
-      udpSocket = fd;
+      udpSocket = sock;
       break;
    case AF_INET6:
-      udp6Socket = fd;
+      udp6Socket = sock;
    }
 
    loop->add_socket(
-      fd,
+      sock->Ring ? sock->Ring->Fd() : fd,
       false,
-      [fd, map, weak, mode] (pollster::socket_event *sev, error *err) -> void
+      [sock, map, weak, mode] (pollster::socket_event *sev, error *err) -> void
       {
-         sev->on_signal = [fd, map, weak, mode] (error *err) -> void
+         sev->on_signal = [sock, map, weak, mode] (error *err) -> void
          {
-            char buf[512];
-            u_addr addr;
-            #if defined(_WINDOWS)
-            int
-            #else
-            socklen_t
-            #endif
-            addrlen = sizeof(addr);
-            sendrecv_retval r;
+            error flushErr;
+            size_t n = 0;
 
             auto rc = weak.lock();
             if (!rc.get())
                ERROR_SET(err, unknown, "Server object destroyed");
 
-            while ((r = recvfrom(fd->Get(), buf, sizeof(buf), 0, &addr.sa, &addrlen)) > 0)
+            // Replies and upstream queries from this whole wakeup go out
+            // together at the end.
+            //
+            sock->BeginBatch();
+            rc->BeginUpstreamBatch();
+
+            while ((n = sock->Receive(err)) > 0)
             {
-               rc->HandleMessage(
-                  mode,
-                  buf, r,
-                  &addr.sa,
-                  *map,
-                  [fd, addr, weak] (const void *buf, size_t len, error *err) -> void
-                  {
-                     auto rc = weak.lock();
-                     if (!rc.get())
-                        return;
-                     WriteUdp(fd, &addr.sa, buf, len, err);
-                  },
-                  err
-               );
-               ERROR_CHECK(err);
+               for (size_t i = 0; i < n; ++i)
+               {
+                  auto &d = sock->Received()[i];
+                  auto addr = d.addr;
+
+                  uint16_t payload = rc->ednsBufferSize ? QueryPayload(d.data, d.len) : 0;
+                  if (payload > rc->ednsBufferSize)
+                     payload = rc->ednsBufferSize;
+
+                  rc->HandleMessage(
+                     mode,
+                     d.data, d.len,
+                     &addr.sa,
+                     *map,
+                     [sock, addr, weak, payload] (const void *buf, size_t len, error *err) -> void
+                     {
+                        bool trimmed = false, truncated = false;
+                        auto rc = weak.lock();
+                        if (!rc.get())
+                           return;
+                        WriteUdp(
+                           *sock, &addr.sa,
+                           buf, len,
+                           payload, rc->ednsBufferSize, rc->minimalResponses,
+                           &trimmed, &truncated,
+                           err
+                        );
+                        if (trimmed)
+                           rc->stats.ClientTrimmed++;
+                        if (truncated)
+                           rc->stats.ClientTruncated++;
+                     },
+                     err
+                  );
+                  if (ERROR_FAILED(err))
+                     break;
+               }
+               if (ERROR_FAILED(err) || n < UdpSocket::MaxBatch)
+                  break;
             }
+
+            rc->EndUpstreamBatch(ERROR_FAILED(err) ? &flushErr : err);
+            sock->EndBatch(ERROR_FAILED(err) ? &flushErr : err);
          exit:;
          };
       },
@@ -159,39 +483,29 @@ dns::Server::SendUdp(
    const std::shared_ptr<ForwardServerState> &state,
    const void *buf,
    size_t len,
-   const Message *msg,
+   const MessageView *msg,
    const ResponseMap::Callback &cb,
-   std::function<void()> *cancel,
+   RequestHandle *cancel,
    error *err
 )
 {
-   auto addr = (const struct sockaddr*)state->sockaddr.data();
-   std::shared_ptr<common::SocketHandle> *fdp = nullptr;
-   ResponseMap *mapp = nullptr;
-   switch (addr->sa_family)
+   std::shared_ptr<UpstreamSocket> up;
+
+   switch (((const struct sockaddr*)state->sockaddr.data())->sa_family)
    {
    case AF_INET:
-      fdp = &udpSocket;
-      mapp = &udpResp;
-      break;
    case AF_INET6:
-      fdp = &udp6Socket;
-      mapp = &udp6Resp;
       break;
    default:
-      error_set_unknown(err, "Invalid family");
-      return;
+      ERROR_SET(err, unknown, "Invalid family");
    }
-   auto &fd = *fdp;
-   auto &map = *mapp;
-   if (!fd->Valid())
-   {
-      StartUdp(addr->sa_family, MessageMode::Client, err);
-      ERROR_CHECK(err);
-   }
-   WriteUdp(fd, addr, buf, len, err);
+
+   GetUpstreamSocket(state, &up, err);
+   ERROR_CHECK(err);
+   BatchUpstream(up->sock);
+   up->sock->Send(nullptr, buf, len, err);
    ERROR_CHECK(err);
-   map.OnRequest(addr, buf, len, msg, cb, cancel, err);
+   up->map.OnRequest(nullptr, buf, len, msg, cb, cancel, err);
    ERROR_CHECK(err);
 exit:;
 }
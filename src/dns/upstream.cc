@@ -0,0 +1,266 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <pollster/socket.h>
+#include <pollster/pollster.h>
+
+#include <dnsserver.h>
+#include <dnsmsg.h>
+#include <dnsudp.h>
+
+#include <string.h>
+#include <algorithm>
+
+namespace {
+
+// Tries at a random port before letting the kernel choose.
+//
+const int PortTries = 16;
+
+} // end namespace
+
+void
+dns::Server::GetUpstreamSocket(
+   const std::shared_ptr<ForwardServerState> &state,
+   std::shared_ptr<UpstreamSocket> *out,
+   error *err
+)
+{
+   UpstreamPool *pool = nullptr;
+
+   try
+   {
+      pool = &upstreamPools[state.get()];
+      if (!pool->server)
+         pool->server = state;
+      pool->sockets.reserve(upstreamSockets);
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   if (pool->sockets.size() < (size_t)upstreamSockets)
+   {
+      OpenUpstreamSocket((const struct sockaddr*)state->sockaddr.data(), out, err);
+      if (!ERROR_FAILED(err))
+      {
+         pool->sockets.push_back(*out);
+         goto exit;
+      }
+
+      // Out of descriptors, say; the ones we have will do.
+      //
+      if (!pool->sockets.size())
+         goto exit;
+      error_clear(err);
+   }
+
+   *out = pool->sockets[pool->next++ % pool->sockets.size()];
+exit:;
+}
+
+void
+dns::Server::OpenUpstreamSocket(
+   const struct sockaddr *addr,
+   std::shared_ptr<UpstreamSocket> *out,
+   error *err
+)
+{
+   std::weak_ptr<Server> weak = shared_from_this();
+   std::shared_ptr<common::SocketHandle> fd;
+   std::shared_ptr<UpstreamSocket> up;
+   common::Pointer<pollster::waiter> loop;
+   common::Pointer<pollster::socket_event> sev;
+   UdpSocket::Address local;
+   int tries = 0;
+
+   memset(&local, 0, sizeof(local));
+
+   GetLoop(loop.GetAddressOf(), err);
+   ERROR_CHECK(err);
+
+   try
+   {
+      fd = std::make_shared<common::SocketHandle>();
+      up = std::make_shared<UpstreamSocket>();
+      up->sock = std::make_shared<UdpSocket>();
+
+      std::lock_guard<std::mutex> lock(upstreamIoLock);
+      upstreamIo.reserve(upstreamIo.size() + 1);
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   up->sock->Fd = fd;
+   *fd = socket(addr->sa_family, SOCK_DGRAM, 0);
+   if (!fd->Valid())
+      ERROR_SET(err, socket);
+
+   pollster::sockaddr_set_af(&local.sa, addr->sa_family);
+
+   // An answer has to guess the port as well as the ID.
+   //
+   for (tries = 0; tries < PortTries; ++tries)
+   {
+      uint16_t port = 0;
+
+      rng_generate(rng, &port, sizeof(port), err);
+      ERROR_CHECK(err);
+      if (port < 1024)
+         continue;
+
+      switch (addr->sa_family)
+      {
+      case AF_INET:
+         local.sin.sin_port = htons(port);
+         break;
+      case AF_INET6:
+         local.sin6.sin6_port = htons(port);
+         break;
+      }
+
+      if (!bind(fd->Get(), &local.sa, pollster::socklen(&local.sa)))
+         break;
+   }
+
+   if (tries == PortTries)
+   {
+      switch (addr->sa_family)
+      {
+      case AF_INET:
+         local.sin.sin_port = 0;
+         break;
+      case AF_INET6:
+         local.sin6.sin6_port = 0;
+         break;
+      }
+
+      if (bind(fd->Get(), &local.sa, pollster::socklen(&local.sa)))
+         ERROR_SET(err, socket);
+   }
+
+   if (connect(fd->Get(), addr, pollster::socklen(addr)))
+      ERROR_SET(err, socket);
+
+   set_nonblock(fd->Get(), true, err);
+   ERROR_CHECK(err);
+
+   loop->add_socket(
+      fd,
+      false,
+      [up, weak] (pollster::socket_event *sev, error *err) -> void
+      {
+         sev->on_signal = [up, weak] (error *err) -> void
+         {
+            auto rc = weak.lock();
+            if (!rc.get())
+               ERROR_SET(err, unknown, "Server object destroyed");
+
+            rc->HandleUpstreamReplies(*up, err);
+         exit:;
+         };
+      },
+      sev.GetAddressOf(),
+      err
+   );
+   ERROR_CHECK(err);
+
+   {
+      std::lock_guard<std::mutex> lock(upstreamIoLock);
+      upstreamIo.push_back(up->sock);
+   }
+
+   *out = std::move(up);
+exit:;
+}
+
+void
+dns::Server::HandleUpstreamReplies(UpstreamSocket &up, error *err)
+{
+   error flushErr;
+   size_t n = 0;
+
+   // Answers often go to several waiting clients; they leave together.
+   //
+   for (auto sock : {udpSocket.get(), udp6Socket.get()})
+   {
+      if (sock)
+         sock->BeginBatch();
+   }
+
+   while ((n = up.sock->Receive(err)) > 0)
+   {
+      for (size_t i = 0; i < n; ++i)
+      {
+         auto &d = up.sock->Received()[i];
+         MessageView msg;
+         error parseErr;
+
+         ParseMessage(d.data, d.len, &msg, &parseErr);
+         if (ERROR_FAILED(&parseErr) || !msg.Header->Response)
+            continue;
+
+         // Only the upstream can send to this socket, so the address
+         // tells us nothing more.
+         //
+         up.map.OnResponse(nullptr, d.data, d.len, msg, err);
+         if (ERROR_FAILED(err))
+            break;
+      }
+      if (ERROR_FAILED(err) || n < UdpSocket::MaxBatch)
+         break;
+   }
+
+   for (auto sock : {udpSocket.get(), udp6Socket.get()})
+   {
+      if (sock)
+         sock->EndBatch(ERROR_FAILED(err) ? &flushErr : err);
+   }
+}
+
+void
+dns::Server::EndUpstreamBatch(error *err)
+{
+   error flushErr;
+
+   if (--upstreamBatchDepth)
+      goto exit;
+
+   for (auto &sock : upstreamBatch)
+      sock->EndBatch(ERROR_FAILED(err) ? &flushErr : err);
+   upstreamBatch.resize(0);
+exit:;
+}
+
+// Open a batch on a pool socket for as long as the upstream batch lasts,
+// if there is one and the socket isn't in it yet.
+//
+void
+dns::Server::BatchUpstream(const std::shared_ptr<UdpSocket> &sock)
+{
+   if (!upstreamBatchDepth ||
+       std::find(upstreamBatch.begin(), upstreamBatch.end(), sock) != upstreamBatch.end())
+   {
+      return;
+   }
+
+   try
+   {
+      upstreamBatch.push_back(sock);
+   }
+   catch (const std::bad_alloc&)
+   {
+      // It'll send at once, as outside a batch.
+      //
+      return;
+   }
+   sock->BeginBatch();
+}
@@ -0,0 +1,542 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <pollster/socket.h>
+
+#include <dnsuring.h>
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT)
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
+#if defined(HAVE_URING)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+namespace {
+
+const uint16_t BufferGroup = 0;
+
+// user_data of each submission.
+//
+const uint64_t RecvTag = 1;
+const uint64_t CancelTag = 2;
+const uint64_t SendTag = 1 << 16;   // plus the slot
+
+// Each receive buffer holds the kernel's header, room for the address,
+// and the largest datagram we accept.
+//
+const size_t BufferSize =
+   (sizeof(io_uring_recvmsg_out) + sizeof(dns::UdpSocket::Address) + dns::MaxUdpPayload + 63) & ~(size_t)63;
+
+int
+Setup(unsigned entries, io_uring_params *params)
+{
+   return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int
+Enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   return syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+int
+Register(int fd, unsigned op, void *arg, unsigned n)
+{
+   return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+// Ring indices are shared with the kernel.
+//
+template<typename T>
+std::atomic<T> &
+Shared(T *p)
+{
+   static_assert(sizeof(std::atomic<T>) == sizeof(T), "atomic has a different size");
+   return *(std::atomic<T>*)p;
+}
+
+} // end namespace
+
+struct dns::UdpRing::Rings
+{
+   struct SendSlot
+   {
+      UdpSocket::Address addr;
+      struct iovec iov;
+      struct msghdr hdr;
+      char data[MaxUdpPayload];
+   };
+
+   int ringFd;
+   int sock;
+   void *ring;
+   size_t ringLength;
+   io_uring_sqe *sqes;
+   size_t sqesLength;
+   unsigned *sqHead, *sqTail, *sqArray;
+   unsigned sqMask, sqEntries;
+   unsigned *cqHead, *cqTail;
+   unsigned cqMask;
+   io_uring_cqe *cqes;
+   io_uring_buf_ring *bufRing;
+   size_t bufRingLength;
+   uint16_t bufTail;
+   std::vector<char> buffers;
+   struct msghdr recvHdr;
+   std::vector<SendSlot> slots;
+   std::vector<unsigned> freeSlots;
+   unsigned toSubmit;
+   unsigned inFlight;      // the receive, if armed, and sends
+   bool armed;
+
+   Rings()
+      : ringFd(-1),
+        sock(-1),
+        ring(nullptr),
+        ringLength(0),
+        sqes(nullptr),
+        sqesLength(0),
+        sqHead(nullptr), sqTail(nullptr), sqArray(nullptr),
+        sqMask(0), sqEntries(0),
+        cqHead(nullptr), cqTail(nullptr),
+        cqMask(0),
+        cqes(nullptr),
+        bufRing(nullptr),
+        bufRingLength(0),
+        bufTail(0),
+        toSubmit(0),
+        inFlight(0),
+        armed(false)
+   {
+      memset(&recvHdr, 0, sizeof(recvHdr));
+   }
+
+   ~Rings();
+
+   // A zeroed entry at the tail of the submission queue, or nullptr if
+   // it's full; Queue() makes it part of the next Submit().
+   //
+   io_uring_sqe *
+   NextSqe()
+   {
+      unsigned head = Shared(sqHead).load(std::memory_order_acquire);
+      unsigned tail = *sqTail;
+      if (tail - head >= sqEntries)
+         return nullptr;
+      auto sqe = &sqes[tail & sqMask];
+      memset(sqe, 0, sizeof(*sqe));
+      return sqe;
+   }
+
+   void
+   Queue()
+   {
+      unsigned tail = *sqTail;
+      sqArray[tail & sqMask] = tail & sqMask;
+      Shared(sqTail).store(tail + 1, std::memory_order_release);
+      ++toSubmit;
+   }
+
+   size_t
+   Submit(error *err)
+   {
+      size_t calls = 0;
+
+      while (toSubmit)
+      {
+         int r = 0;
+
+         ++calls;
+         r = Enter(ringFd, toSubmit, 0, 0);
+         if (r < 0 && errno == EINTR)
+            continue;
+         if (r < 0 && (errno == EAGAIN || errno == EBUSY))
+            break;      // still queued; goes with the next submit
+         if (r < 0)
+            ERROR_SET(err, errno, errno);
+         if (!r)
+            break;
+         toSubmit -= r;
+      }
+   exit:
+      return calls;
+   }
+
+   void
+   Arm()
+   {
+      auto sqe = NextSqe();
+      if (!sqe)
+         return;
+
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->fd = sock;
+      sqe->addr = (uintptr_t)&recvHdr;
+      sqe->len = 1;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BufferGroup;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->user_data = RecvTag;
+      Queue();
+
+      armed = true;
+      ++inFlight;
+   }
+
+   // Give a buffer back to the kernel, once PublishBuffers() is called.
+   //
+   void
+   Recycle(unsigned bid)
+   {
+      // Not bufRing->bufs: in C++ the header's flexible array comes out
+      // past an empty struct, 8 bytes from where the kernel looks.
+      //
+      auto &b = ((io_uring_buf*)bufRing)[bufTail & (BufferCount - 1)];
+      b.addr = (uintptr_t)(buffers.data() + bid * BufferSize);
+      b.len = BufferSize;
+      b.bid = bid;
+      ++bufTail;
+   }
+
+   void
+   PublishBuffers()
+   {
+      Shared(&bufRing->tail).store(bufTail, std::memory_order_release);
+   }
+};
+
+dns::UdpRing::Rings::~Rings()
+{
+   // The kernel may still write to our buffers and read our send slots;
+   // cancel everything and wait for it to let go before they're freed.
+   //
+   if (ringFd >= 0 && ring && inFlight)
+   {
+      auto sqe = NextSqe();
+      if (sqe)
+      {
+         sqe->opcode = IORING_OP_ASYNC_CANCEL;
+         sqe->fd = -1;
+         sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+         sqe->user_data = CancelTag;
+         Queue();
+      }
+
+      while (inFlight)
+      {
+         unsigned head = *cqHead;
+         unsigned tail = Shared(cqTail).load(std::memory_order_acquire);
+
+         for (; head != tail; ++head)
+         {
+            auto cqe = &cqes[head & cqMask];
+            if (cqe->user_data >= SendTag ||
+                (cqe->user_data == RecvTag && !(cqe->flags & IORING_CQE_F_MORE)))
+            {
+               --inFlight;
+            }
+         }
+         Shared(cqHead).store(head, std::memory_order_release);
+
+         if (inFlight &&
+             Enter(ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS) < 0 &&
+             errno != EINTR)
+         {
+            break;
+         }
+         toSubmit = 0;
+      }
+   }
+
+   if (bufRing)
+      munmap(bufRing, bufRingLength);
+   if (sqes)
+      munmap(sqes, sqesLength);
+   if (ring)
+      munmap(ring, ringLength);
+}
+
+#endif
+
+dns::UdpRing::UdpRing()
+{
+}
+
+dns::UdpRing::~UdpRing()
+{
+   // Rings first, while the ring descriptor is still open.
+   //
+   rings.reset();
+}
+
+void
+dns::UdpRing::Start(const std::shared_ptr<common::SocketHandle> &sock, error *err)
+{
+#if !defined(HAVE_URING)
+   ERROR_SET(err, unknown, "io_uring not supported");
+#else
+   io_uring_params params;
+   io_uring_buf_reg reg;
+   std::unique_ptr<Rings> r;
+   char *base = nullptr;
+   int ringFd = -1;
+
+   memset(&params, 0, sizeof(params));
+   memset(&reg, 0, sizeof(reg));
+
+   try
+   {
+      r.reset(new Rings());
+      r->buffers.resize(BufferCount * BufferSize);
+      r->slots.resize(SendSlots);
+      r->freeSlots.reserve(SendSlots);
+      for (unsigned i = 0; i < SendSlots; ++i)
+         r->freeSlots.push_back(i);
+      fd = std::make_shared<common::SocketHandle>();
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   r->sock = sock->Get();
+
+   ringFd = Setup(Entries, &params);
+   if (ringFd < 0)
+      ERROR_SET(err, errno, errno);
+   *fd = ringFd;
+   r->ringFd = ringFd;
+
+   if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+      ERROR_SET(err, unknown, "io_uring too old");
+
+   r->ringLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   if (r->ringLength < params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe))
+      r->ringLength = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+   r->ring = mmap(nullptr, r->ringLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+   if (r->ring == MAP_FAILED)
+   {
+      r->ring = nullptr;
+      ERROR_SET(err, errno, errno);
+   }
+
+   r->sqesLength = params.sq_entries * sizeof(io_uring_sqe);
+   r->sqes = (io_uring_sqe*)mmap(nullptr, r->sqesLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+   if (r->sqes == MAP_FAILED)
+   {
+      r->sqes = nullptr;
+      ERROR_SET(err, errno, errno);
+   }
+
+   base = (char*)r->ring;
+   r->sqHead = (unsigned*)(base + params.sq_off.head);
+   r->sqTail = (unsigned*)(base + params.sq_off.tail);
+   r->sqArray = (unsigned*)(base + params.sq_off.array);
+   r->sqMask = *(unsigned*)(base + params.sq_off.ring_mask);
+   r->sqEntries = *(unsigned*)(base + params.sq_off.ring_entries);
+   r->cqHead = (unsigned*)(base + params.cq_off.head);
+   r->cqTail = (unsigned*)(base + params.cq_off.tail);
+   r->cqMask = *(unsigned*)(base + params.cq_off.ring_mask);
+   r->cqes = (io_uring_cqe*)(base + params.cq_off.cqes);
+
+   // Provided buffers: the kernel takes one per datagram as it arrives.
+   //
+   r->bufRingLength = BufferCount * sizeof(io_uring_buf);
+   r->bufRing = (io_uring_buf_ring*)mmap(nullptr, r->bufRingLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (r->bufRing == MAP_FAILED)
+   {
+      r->bufRing = nullptr;
+      ERROR_SET(err, errno, errno);
+   }
+
+   reg.ring_addr = (uintptr_t)r->bufRing;
+   reg.ring_entries = BufferCount;
+   reg.bgid = BufferGroup;
+   if (Register(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+      ERROR_SET(err, errno, errno);
+
+   for (unsigned i = 0; i < BufferCount; ++i)
+      r->Recycle(i);
+   r->PublishBuffers();
+
+   r->recvHdr.msg_namelen = sizeof(UdpSocket::Address);
+
+   r->Arm();
+   r->Submit(err);
+   ERROR_CHECK(err);
+
+   // Kernels before 6.0 accept the submission but fail it at once.
+   //
+   {
+      unsigned head = *r->cqHead;
+      unsigned tail = Shared(r->cqTail).load(std::memory_order_acquire);
+
+      if (head != tail)
+      {
+         auto cqe = &r->cqes[head & r->cqMask];
+         if (cqe->user_data == RecvTag && cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE))
+         {
+            int e = -cqe->res;
+            --r->inFlight;
+            r->armed = false;
+            Shared(r->cqHead).store(head + 1, std::memory_order_release);
+            ERROR_SET(err, errno, e);
+         }
+      }
+   }
+
+   rings = std::move(r);
+#endif
+exit:
+#if defined(HAVE_URING)
+   // A half-built ring goes first, as in the destructor, so that it can
+   // still cancel and wait on the descriptor before fd closes it.
+   //
+   r.reset();
+#endif
+   if (ERROR_FAILED(err))
+      fd.reset();
+}
+
+size_t
+dns::UdpRing::Receive(UdpSocket::Datagram *out, size_t max, error *err)
+{
+   size_t n = 0;
+#if defined(HAVE_URING)
+   auto r = rings.get();
+   unsigned head = *r->cqHead;
+   unsigned tail = Shared(r->cqTail).load(std::memory_order_acquire);
+   bool recycled = false;
+
+   for (; head != tail; ++head)
+   {
+      auto cqe = &r->cqes[head & r->cqMask];
+
+      if (cqe->user_data >= SendTag)
+      {
+         // Reserved up front, so this doesn't allocate.
+         //
+         r->freeSlots.push_back(cqe->user_data - SendTag);
+         --r->inFlight;
+         continue;
+      }
+      if (cqe->user_data != RecvTag)
+         continue;
+      if (n == max)
+         break;
+
+      // The kernel stops a multishot receive when it runs out of buffers,
+      // among other things; it's re-armed below.
+      //
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+      {
+         r->armed = false;
+         --r->inFlight;
+      }
+      if (!(cqe->flags & IORING_CQE_F_BUFFER))
+         continue;
+
+      unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      auto buf = r->buffers.data() + bid * BufferSize;
+      auto msg = (const io_uring_recvmsg_out*)buf;
+      size_t nameRoom = r->recvHdr.msg_namelen;
+      size_t off = sizeof(*msg) + nameRoom + r->recvHdr.msg_controllen;
+
+      if (cqe->res >= 0 &&
+          (size_t)cqe->res >= off &&
+          !(msg->flags & MSG_TRUNC) &&
+          msg->payloadlen <= sizeof(out[n].data) &&
+          off + msg->payloadlen <= (size_t)cqe->res)
+      {
+         auto &d = out[n++];
+         memset(&d.addr, 0, sizeof(d.addr));
+         memcpy(&d.addr, buf + sizeof(*msg), msg->namelen < nameRoom ? msg->namelen : nameRoom);
+         memcpy(d.data, buf + off, msg->payloadlen);
+         d.len = msg->payloadlen;
+      }
+
+      r->Recycle(bid);
+      recycled = true;
+   }
+
+   Shared(r->cqHead).store(head, std::memory_order_release);
+   if (recycled)
+      r->PublishBuffers();
+
+   if (!r->armed)
+   {
+      r->Arm();
+      r->Submit(err);
+   }
+#endif
+   return n;
+}
+
+size_t
+dns::UdpRing::Send(const UdpSocket::Datagram *d, size_t n, error *err)
+{
+   size_t calls = 0;
+#if defined(HAVE_URING)
+   auto r = rings.get();
+
+   for (size_t i = 0; i < n; ++i)
+   {
+      io_uring_sqe *sqe = r->freeSlots.size() ? r->NextSqe() : nullptr;
+
+      // Everything in flight already; send this one the plain way.
+      //
+      if (!sqe)
+      {
+         ++calls;
+         sendto(r->sock, d[i].data, d[i].len, 0, d[i].Name(), d[i].NameLength());
+         continue;
+      }
+
+      unsigned idx = r->freeSlots.back();
+      r->freeSlots.pop_back();
+
+      auto &slot = r->slots[idx];
+      memcpy(&slot.addr, &d[i].addr, sizeof(slot.addr));
+      memcpy(slot.data, d[i].data, d[i].len);
+      slot.iov.iov_base = slot.data;
+      slot.iov.iov_len = d[i].len;
+      memset(&slot.hdr, 0, sizeof(slot.hdr));
+      slot.hdr.msg_name = d[i].Name() ? &slot.addr : nullptr;
+      slot.hdr.msg_namelen = d[i].NameLength();
+      slot.hdr.msg_iov = &slot.iov;
+      slot.hdr.msg_iovlen = 1;
+
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = r->sock;
+      sqe->addr = (uintptr_t)&slot.hdr;
+      sqe->len = 1;
+      sqe->user_data = SendTag + idx;
+      r->Queue();
+      ++r->inFlight;
+   }
+
+   calls += r->Submit(err);
+#endif
+   return calls;
+}
@@ -0,0 +1,246 @@
+/*
+ Copyright (C) 2020 Andrew Sveikauskas
+
+ Permission to use, copy, modify, and distribute this software for any
+ purpose with or without fee is hereby granted, provided that the above
+ copyright notice and this permission notice appear in all copies.
+*/
+
+#include <pollster/socket.h>
+#include <pollster/pollster.h>
+
+#include <dnsserver.h>
+#include <dnsmailbox.h>
+#include <dnsmsg.h>
+
+#include <common/logger.h>
+
+#include <system_error>
+#include <thread>
+
+void
+dns::Server::StartWorkers(error *err)
+{
+#if defined(_WINDOWS)
+   if (workerCount > 1)
+   {
+      log_printf("workers: not supported on this platform");
+      workerCount = 1;
+   }
+#else
+   common::Pointer<pollster::waiter> loop;
+
+   if (workerCount <= 1 || primary || workers.size())
+      goto exit;
+
+   // Workers post their TCP queries here.
+   //
+   try
+   {
+      mailbox = std::make_shared<Mailbox>();
+   }
+   catch (const std::bad_alloc&)
+   {
+      ERROR_SET(err, nomem);
+   }
+
+   pollster::get_common_queue(loop.GetAddressOf(), err);
+   ERROR_CHECK(err);
+
+   mailbox->Start(loop.Get(), err);
+   ERROR_CHECK(err);
+
+   for (int i = 1; i < workerCount; ++i)
+   {
+      std::shared_ptr<Server> worker;
+
+      try
+      {
+         worker = std::make_shared<Server>(sharedCache);
+         worker->mailbox = std::make_shared<Mailbox>();
+
+         worker->primary = this;
+         worker->workerCount = workerCount;
+         worker->searchPath = searchPath;
+         worker->forwardServers = forwardServers;
+         worker->localEntries = localEntries;
+         worker->staleWindow = staleWindow;
+         worker->staleTtl = staleTtl;
+         worker->servfailTtl = servfailTtl;
+         worker->prefetchPercent = prefetchPercent;
+         worker->prefetchMinHits = prefetchMinHits;
+         worker->ednsBufferSize = ednsBufferSize;
+         worker->minimalResponses = minimalResponses;
+         worker->ioUring = ioUring;
+         worker->upstreamSockets = upstreamSockets;
+
+         workers.push_back(worker);
+      }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(err, nomem);
+      }
+
+      pollster::create(worker->workerLoop.GetAddressOf(), err);
+      ERROR_CHECK(err);
+
+      worker->Initialize(err);
+      ERROR_CHECK(err);
+
+      worker->mailbox->Start(worker->workerLoop.Get(), err);
+      ERROR_CHECK(err);
+
+      // The loop isn't running yet, so this is safe from here.
+      //
+      worker->StartUdp(AF_INET, err);
+      ERROR_CHECK(err);
+      worker->StartUdp(AF_INET6, err);
+      if (ERROR_FAILED(err))
+         error_clear(err);
+
+      try
+      {
+         workerThreads.emplace_back(
+            [worker] () -> void
+            {
+               error err;
+
+               while (!worker->stopping.load())
+               {
+                  worker->workerLoop->exec(&err);
+                  if (ERROR_FAILED(&err))
+                  {
+                     log_printf("workers: event loop failed");
+                     break;
+                  }
+               }
+            }
+         );
+      }
+      catch (const std::system_error&)
+      {
+         ERROR_SET(err, unknown, "Could not start worker thread");
+      }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(err, nomem);
+      }
+   }
+#endif
+exit:;
+}
+
+void
+dns::Server::StopWorkers()
+{
+   // Threads are added to workerThreads in the same order as workers.
+   //
+   for (size_t i = 0; i < workerThreads.size(); ++i)
+   {
+      auto &worker = workers[i];
+      error err;
+
+      worker->stopping = true;
+
+      // Anything posted wakes the loop, which then sees the flag.
+      //
+      worker->mailbox->Post([] (error *err) -> void {}, &err);
+      if (ERROR_FAILED(&err))
+      {
+         log_printf("workers: could not wake worker %d to stop it", (int)i + 1);
+         workerThreads[i].detach();
+      }
+   }
+
+   for (auto &thread : workerThreads)
+   {
+      if (thread.joinable())
+         thread.join();
+   }
+   workerThreads.clear();
+}
+
+void
+dns::Server::SendTcpViaPrimary(
+   const std::shared_ptr<ForwardServerState> &state,
+   const void *buf,
+   size_t len,
+   const ResponseMap::Callback &cb,
+   RequestHandle *cancel,
+   error *err
+)
+{
+   Server *primary = this->primary;
+   std::weak_ptr<Server> weak = shared_from_this();
+   std::weak_ptr<Mailbox> replyTo = mailbox;
+   RequestHandle handle;
+
+   if (!cancel)
+      cancel = &handle;
+
+   // The callback stays here; only the query and the answer cross over.
+   //
+   primaryResp.OnRequest(nullptr, buf, len, nullptr, cb, cancel, err);
+   ERROR_CHECK(err);
+
+   try
+   {
+      std::vector<char> query((const char*)buf, (const char*)buf + len);
+
+      primary->mailbox->Post(
+         [primary, state, query, weak, replyTo] (error *err) -> void
+         {
+            primary->SendTcp(
+               state,
+               query.data(),
+               query.size(),
+               nullptr,
+               [weak, replyTo] (const void *buf, size_t len, MessageView &, error *err) -> void
+               {
+                  auto mailbox = replyTo.lock();
+                  if (!mailbox.get() || !len)
+                     return;
+
+                  try
+                  {
+                     std::vector<char> response((const char*)buf, (const char*)buf + len);
+
+                     mailbox->Post(
+                        [weak, response] (error *err) -> void
+                        {
+                           MessageView msg;
+
+                           auto rc = weak.lock();
+                           if (!rc.get())
+                              return;
+
+                           ParseMessage(response.data(), response.size(), &msg, err);
+                           if (ERROR_FAILED(err))
+                              return;
+
+                           rc->primaryResp.OnResponse(nullptr, response.data(), response.size(), msg, err);
+                        },
+                        err
+                     );
+                  }
+                  catch (const std::bad_alloc&)
+                  {
+                     error_set_nomem(err);
+                  }
+               },
+               nullptr,
+               err
+            );
+         },
+         err
+      );
+   }
+   catch (const std::bad_alloc&)
+   {
+      error_set_nomem(err);
+   }
+
+   if (ERROR_FAILED(err))
+      cancel->Cancel();
+exit:;
+}
@@ -8,9 +8,9 @@
 
 #include <dnsproto.h>
 #include <dnsmsg.h>
+#include <dnsrdata.h>
 
-#include <algorithm>
-#include <map>
+#include <string.h>
 
 void
 dns::I16::Put(uint16_t value)
@@ -33,119 +33,489 @@ dns::I32::Put(uint32_t value)
 namespace
 {
 
-struct StringTable
+const size_t MaxLabels = 128;
+
+struct Label
+{
+   const char *Data;
+   size_t Length;
+};
+
+//
+// Where earlier names were written, for compression.  Every suffix of
+// every name goes in, keyed on a hash built up label by label from the
+// right, so finding the longest earlier suffix costs one probe per label.
+// A hit is checked against the message itself, so a collision costs a
+// comparison rather than a wrong pointer.  It is small enough to live on
+// the stack; once it fills up, later names just compress less.
+//
+class CompressionTable
 {
-   struct MapComp
+public:
+   CompressionTable() : fill(0) { memset(slots, 0, sizeof(slots)); }
+
+   // Offset of an earlier copy of labels[0..n), or 0 if there isn't one.
+   //
+   uint16_t
+   Find(uint32_t hash, const char *msg, const Label *labels, size_t n) const
    {
-      bool operator()(const char *a, const char *b) const { return strcmp(a,b) < 0; };
+      for (size_t i = hash & (Size - 1); slots[i].Offset; i = (i + 1) & (Size - 1))
+      {
+         if (slots[i].Hash == hash && Matches(msg, slots[i].Offset, labels, n))
+            return slots[i].Offset;
+      }
+      return 0;
+   }
+
+   void
+   Insert(uint32_t hash, size_t offset)
+   {
+      // Past this, a pointer can't reach it.
+      //
+      if (fill >= MaxFill || offset >= 0x4000)
+         return;
+
+      size_t i = hash & (Size - 1);
+      while (slots[i].Offset)
+         i = (i + 1) & (Size - 1);
+      slots[i].Hash = hash;
+      slots[i].Offset = offset;
+      ++fill;
+   }
+
+private:
+   enum
+   {
+      Size = 256,
+      MaxFill = Size * 3 / 4,
    };
-   std::map<const char *, int, MapComp> priorOffsets;
-   int OnInsert(const char *string, int currentOffset)
+
+   struct Slot
    {
-      auto existing = priorOffsets.find(string);
-      if (existing != priorOffsets.end())
+      uint32_t Hash;
+      uint16_t Offset;     // 0 is the header, so never a name
+   };
+
+   Slot slots[Size];
+   size_t fill;
+
+   static bool
+   Matches(const char *msg, size_t off, const Label *labels, size_t n)
+   {
+      auto p = (const unsigned char*)msg;
+
+      for (size_t i = 0; ; ++i)
       {
-         return existing->second;
+         unsigned char l = p[off];
+
+         // Anything we wrote is well-formed and only points backwards.
+         //
+         while ((l & 0xc0) == 0xc0)
+         {
+            off = ((l & 0x3f) << 8) | p[off + 1];
+            l = p[off];
+         }
+
+         if (i == n)
+            return !l;
+         if (l != labels[i].Length || memcmp(p + off + 1, labels[i].Data, l))
+            return false;
+         off += 1 + l;
+      }
+   }
+};
+
+// Hash each suffix of a name, right to left.
+//
+// Only a label's length and its first and last eight bytes go into the
+// hash.  That is plenty to keep probes short, and Find() checks the rest.
+//
+void
+HashSuffixes(const Label *labels, size_t n, uint32_t *hashes)
+{
+   uint64_t h = 0;
+
+   for (size_t i = n; i--; )
+   {
+      auto data = labels[i].Data;
+      size_t l = labels[i].Length;
+      uint64_t first = 0, last = 0;
+
+      if (l >= sizeof(first))
+      {
+         memcpy(&first, data, sizeof(first));
+         memcpy(&last, data + l - sizeof(last), sizeof(last));
+      }
+      else
+      {
+         for (size_t j = 0; j < l; ++j)
+            first = (first << 8) | (unsigned char)data[j];
       }
-      priorOffsets[string] = currentOffset;
+
+      h = (h ^ l) * 0xff51afd7ed558ccdULL;
+      h = (h ^ first) * 0xc4ceb9fe1a85ec53ULL;
+      h = (h ^ last) * 0xff51afd7ed558ccdULL;
+      h ^= h >> 32;
+      hashes[i] = (uint32_t)h;
+   }
+}
+
+// Split a dotted name into labels.  Returns the number of labels, or -1
+// if the name can't be encoded.
+//
+int
+SplitName(const std::string &name, Label *labels)
+{
+   auto p = name.data();
+   size_t len = name.length();
+   size_t n = 0;
+   size_t start = 0;
+
+   if (len && p[len - 1] == '.')
+      --len;
+   if (!len)
+      return 0;
+   if (len + 2 > 255)
       return -1;
+
+   for (size_t i = 0; i <= len; ++i)
+   {
+      if (i < len && p[i] != '.')
+         continue;
+
+      size_t l = i - start;
+      if (!l || l >= 64 || n == MaxLabels)
+         return -1;
+
+      labels[n].Data = p + start;
+      labels[n].Length = l;
+      ++n;
+      start = i + 1;
+   }
+
+   return n;
+}
+
+// Same for an uncompressed wire-format name at the start of buf, also
+// giving its length there.
+//
+int
+SplitWire(const char *buf, size_t len, Label *labels, size_t &wireLength)
+{
+   auto p = (const unsigned char*)buf;
+   size_t off = 0;
+   size_t n = 0;
+
+   for (;;)
+   {
+      if (off >= len || off >= 255)
+         return -1;
+
+      unsigned char l = p[off++];
+      if (!l)
+         break;
+      if ((l & 0xc0) || off + l > len || n == MaxLabels)
+         return -1;
+
+      labels[n].Data = buf + off;
+      labels[n].Length = l;
+      ++n;
+      off += l;
+   }
+
+   wireLength = off;
+   return n;
+}
+
+// Bounds-checked appends to the caller's buffer.
+//
+class Output
+{
+public:
+   Output(char *buf, size_t len) : buf(buf), len(len), off(0) {}
+
+   size_t
+   Offset() const { return off; }
+
+   const char *
+   Data() const { return buf; }
+
+   // Room for n more bytes, or nullptr.
+   //
+   char *
+   Reserve(size_t n)
+   {
+      if (n > len - off)
+         return nullptr;
+      auto p = buf + off;
+      off += n;
+      return p;
+   }
+
+   bool
+   Put(const void *p, size_t n)
+   {
+      auto q = Reserve(n);
+      if (q)
+         memcpy(q, p, n);
+      return q != nullptr;
    }
+
+private:
+   char *buf;
+   size_t len;
+   size_t off;
 };
 
-} // end namespace
+// Write out a split name, pointing back at an earlier copy of as much of
+// it as possible, if compress is set.
+//
+void
+WriteLabels(
+   const Label *labels,
+   int n,
+   bool compress,
+   Output &out,
+   CompressionTable &table,
+   error *err
+)
+{
+   uint32_t hashes[MaxLabels];
+   int k = 0;
+   uint16_t prior = 0;
+   char *p = nullptr;
 
-std::vector<char>
-dns::MessageWriter::Serialize(error *err)
+   // The longest suffix that was written before...
+   //
+   if (compress)
+   {
+      HashSuffixes(labels, n, hashes);
+      for (; k < n; ++k)
+      {
+         prior = table.Find(hashes[k], out.Data(), labels + k, n - k);
+         if (prior)
+            break;
+      }
+   }
+   else
+   {
+      k = n;
+   }
+
+   // ... and everything in front of it.  Labels are contiguous with one
+   // byte between them, a dot or a length, so they can be copied in one
+   // go and the lengths patched in.
+   //
+   if (k)
+   {
+      auto first = labels[0].Data;
+      size_t span = labels[k - 1].Data + labels[k - 1].Length - first;
+      size_t off = out.Offset();
+
+      p = out.Reserve(1 + span);
+      if (!p)
+         goto overflow;
+      p[0] = labels[0].Length;
+      memcpy(p + 1, first, span);
+
+      for (int i = 0; i < k; ++i)
+      {
+         size_t rel = labels[i].Data - first;
+         p[rel] = labels[i].Length;
+         if (compress)
+            table.Insert(hashes[i], off + rel);
+      }
+   }
+
+   if (prior)
+   {
+      p = out.Reserve(2);
+      if (!p)
+         goto overflow;
+      p[0] = (char)(0xc0U | (prior >> 8));
+      p[1] = (char)(prior & 0xff);
+   }
+   else
+   {
+      p = out.Reserve(1);
+      if (!p)
+         goto overflow;
+      p[0] = 0;
+   }
+exit:
+   return;
+overflow:
+   ERROR_SET(err, unknown, "Message too long");
+}
+
+void
+WriteName(const std::string &name, Output &out, CompressionTable &table, error *err)
 {
-   std::vector<char> r;
-   StringTable table;
+   Label labels[MaxLabels];
+   int n = SplitName(name, labels);
 
-   try
+   if (n < 0)
+      ERROR_SET(err, unknown, "Invalid length");
+
+   WriteLabels(labels, n, true, out, table, err);
+exit:;
+}
+
+// Writes RDATA with any names in it compressed, for types that allow it.
+// Visit() returns false without setting err, and without writing, if the
+// RDATA doesn't match its format; then it should go out as it is.
+//
+struct RdataWriter
+{
+   const char *rdata;
+   size_t len;
+   Output &out;
+   CompressionTable &table;
+   error *err;
+
+   template<typename Format>
+   bool
+   Visit()
    {
-      auto hdr = (const char*)Header;
-      r.insert(r.end(), hdr, hdr+sizeof(*Header));
+      Label labels[MaxLabels];
+      size_t off = Format::PrefixLength;
 
-      auto writeNameComponents = [&] (const char *p, size_t len) -> void
+      // Check it all before writing anything, so that nothing half
+      // written goes into the compression table.
+      //
+      if (off > len)
+         return false;
+      for (int i = 0; i < Format::NameCount; ++i)
       {
-         while (len)
-         {
-            size_t l = len;
-            int shift = 0;
-
-            int priorOffset = table.OnInsert(p, r.size());
-            if (priorOffset >= 0)
-            {
-               unsigned char sz[] =
-               {
-                  (unsigned char)(0xc0U | (priorOffset >> 8)),
-                  (unsigned char)(priorOffset & 0xff),
-               };
-               r.push_back(sz[0]);
-               r.push_back(sz[1]);
-               return;
-            }
-
-            auto q = p;
-            while (q < p+len && *q != '.')
-               ++q;
-            if (q < p+len && *q == '.')
-            {
-               l = q-p;
-               shift = 1;
-            }
-
-            if (l >= 64)
-            {
-               error_set_unknown(err, "Invalid length");
-               return;
-            }
-
-            r.push_back((char)l);
-            r.insert(r.end(), p, p+l);
-
-            l += shift;
-            p += l;
-            len -= l;
-         }
+         size_t n = 0;
+         if (SplitWire(rdata + off, len - off, labels, n) < 0)
+            return false;
+         off += n;
+      }
+      if (off + Format::SuffixLength != len)
+         return false;
 
-         r.push_back(0);
-      };
+      off = Format::PrefixLength;
+      if (!out.Put(rdata, off))
+         goto overflow;
 
-      auto writeName = [&] (const std::string &str) -> void
+      for (int i = 0; i < Format::NameCount; ++i)
       {
-         writeNameComponents(str.c_str(), str.length());
-      };
+         size_t n = 0;
+         int nlabels = SplitWire(rdata + off, len - off, labels, n);
+         WriteLabels(labels, nlabels, Format::Compress, out, table, err);
+         if (ERROR_FAILED(err))
+            return false;
+         off += n;
+      }
 
-      for (auto &q : Questions)
+      if (!out.Put(rdata + off, Format::SuffixLength))
+         goto overflow;
+      return true;
+   overflow:
+      error_set_unknown(err, "Message too long");
+      return false;
+   }
+
+   bool
+   Opaque()
+   {
+      if (!out.Put(rdata, len))
       {
-         auto p = (const char*)q.Attrs;
-         writeName(q.Name);
-         ERROR_CHECK(err);
-         r.insert(r.end(), p, p+sizeof(*q.Attrs));
+         error_set_unknown(err, "Message too long");
+         return false;
       }
+      return true;
+   }
+};
 
-      for (auto rlist : {&answerReqs, &authorityReqs, &additlRecs})
+} // end namespace
+
+size_t
+dns::MessageWriter::SerializedSizeBound() const
+{
+   size_t n = sizeof(*Header);
+   for (auto &q : Questions)
+      n += q.Name.length() + 2 + sizeof(*q.Attrs);
+   for (auto rlist : {&answerReqs, &authorityReqs, &additlRecs})
+   {
+      for (auto &rr : *rlist)
+         n += rr.Name.length() + 2 + offsetof(RecordAttrs, Data) + rr.Attrs->Length.Get();
+   }
+   return n;
+}
+
+size_t
+dns::MessageWriter::Serialize(char *buf, size_t len, error *err)
+{
+   Output out(buf, len);
+   CompressionTable table;
+
+   if (!out.Put(Header, sizeof(*Header)))
+      goto overflow;
+
+   for (auto &q : Questions)
+   {
+      WriteName(q.Name, out, table, err);
+      ERROR_CHECK(err);
+      if (!out.Put(q.Attrs, sizeof(*q.Attrs)))
+         goto overflow;
+   }
+
+   for (auto rlist : {&answerReqs, &authorityReqs, &additlRecs})
+   {
+      for (auto &rr : *rlist)
       {
-         for (auto &rr : *rlist)
+         WriteName(rr.Name, out, table, err);
+         ERROR_CHECK(err);
+
+         auto attrs = (RecordAttrs*)out.Reserve(offsetof(RecordAttrs, Data));
+         if (!attrs)
+            goto overflow;
+         memcpy(attrs, rr.Attrs, offsetof(RecordAttrs, Data));
+
+         size_t start = out.Offset();
+         RdataWriter writer{rr.Attrs->Data, rr.Attrs->Length.Get(), out, table, err};
+         if (!VisitRdata(rr.Attrs->Type.Get(), writer))
          {
-            auto p = (const char*)rr.Attrs;
-            writeName(rr.Name);
             ERROR_CHECK(err);
-            r.insert(r.end(), p, p+offsetof(RecordAttrs, Data)+rr.Attrs->Length.Get());
+            if (!out.Put(rr.Attrs->Data, rr.Attrs->Length.Get()))
+               goto overflow;
          }
+         attrs->Length.Put(out.Offset() - start);
       }
    }
+
+exit:
+   return ERROR_FAILED(err) ? 0 : out.Offset();
+overflow:
+   ERROR_SET(err, unknown, "Message too long");
+}
+
+dns::ArenaVector<char>
+dns::MessageWriter::Serialize(error *err)
+{
+   ArenaVector<char> r(arena);
+   size_t n = 0;
+
+   try
+   {
+      r.resize(SerializedSizeBound());
+   }
    catch (const std::bad_alloc&)
    {
       ERROR_SET(err, nomem);
    }
 
+   n = Serialize(r.data(), r.size(), err);
+   ERROR_CHECK(err);
 exit:
+   r.resize(n);
    return r;
 }
 
 dns::Record *
-dns::MessageWriter::AddRecord(Record *&ptr, std::vector<Record> &vec, I16 &count, uint16_t payload, error *err)
+dns::MessageWriter::AddRecord(Record *&ptr, ArenaVector<Record> &vec, I16 &count, uint16_t payload, error *err)
 {
    Record *r = nullptr;
    auto oldAttrs = rattrs.data();
@@ -234,3 +604,117 @@ dns::MessageWriter::AddQuestion(error *err)
 exit:
    return r;
 }
+
+namespace {
+
+bool
+SameRRset(const dns::RecordView &a, const dns::RecordView &b)
+{
+   char x[dns::DomainName::MaxLength], y[dns::DomainName::MaxLength];
+   size_t n = 0;
+
+   if (a.Attrs->Type.Get() != b.Attrs->Type.Get() ||
+       a.Attrs->Class.Get() != b.Attrs->Class.Get())
+   {
+      return false;
+   }
+
+   n = a.Name.ToWire(x, true);
+   return n && n == b.Name.ToWire(y, true) && !memcmp(x, y, n);
+}
+
+} // end namespace
+
+size_t
+dns::FitResponse(
+   const void *buf,
+   size_t len,
+   const MessageView &msg,
+   size_t room,
+   bool minimal,
+   MessageHeader *hdr,
+   bool *trimmed,
+   bool *truncated
+)
+{
+   auto p = (const char*)buf;
+   size_t an = msg.Header->AnswerCount.Get();
+   size_t ns = msg.Header->AuthorityNameCount.Get();
+   size_t total = 0;
+   size_t keep = 0;
+   size_t qend = len;
+
+   memcpy(hdr, buf, sizeof(*hdr));
+   *trimmed = false;
+   *truncated = false;
+
+   // Where the first n records end; records past len, like an OPT record
+   // that was cut off, don't count.
+   //
+   auto end = [&] (size_t n) -> size_t
+   {
+      if (!n)
+         return qend;
+      auto attrs = msg.Records[n - 1].Attrs;
+      return (const char*)attrs->Data + attrs->Length.Get() - p;
+   };
+
+   if (msg.RecordCount)
+      qend = msg.Records[0].Name.Offset();
+
+   if (!msg.Complete)
+   {
+      // Records we can't see can't be weighed one by one.
+      //
+      if (len <= room && !minimal)
+         return len;
+      keep = 0;
+      goto truncate;
+   }
+
+   total = msg.RecordCount;
+   while (total && end(total) > len)
+      --total;
+
+   keep = total;
+   if (minimal &&
+       an &&
+       hdr->ResponseCode == (unsigned)ResponseCode::NoError &&
+       keep > an)
+   {
+      keep = an;
+   }
+
+   if (end(keep) > room)
+   {
+      size_t k = keep;
+
+      while (k > an + ns && end(k) > room)
+         --k;
+      while (k > an + ns && k < keep && SameRRset(msg.Records[k - 1], msg.Records[k]))
+         --k;
+      keep = k;
+
+      if (end(keep) > room)
+         keep = keep < an ? keep : an;
+      if (end(keep) > room)
+      {
+         keep = 0;
+         goto truncate;
+      }
+      *trimmed = true;
+   }
+
+   hdr->AnswerCount.Put(keep < an ? keep : an);
+   hdr->AuthorityNameCount.Put(keep > an ? (keep - an < ns ? keep - an : ns) : 0);
+   hdr->AdditionalRecordCount.Put(keep > an + ns ? keep - an - ns : 0);
+   return end(keep);
+
+truncate:
+   hdr->Truncated = 1;
+   hdr->AnswerCount.Put(0);
+   hdr->AuthorityNameCount.Put(0);
+   hdr->AdditionalRecordCount.Put(0);
+   *truncated = true;
+   return qend < room ? qend : room;
+}
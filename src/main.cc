@@ -25,11 +25,23 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
+#include <signal.h>
 #endif
 
 static
 char *get_config_file(error *err);
 
+#if !defined(_WINDOWS)
+static int shutdownPipe[2] = {-1, -1};
+
+static void
+on_shutdown_signal(int sig)
+{
+   char ch = sig;
+   if (write(shutdownPipe[1], &ch, 1)) {}
+}
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -143,6 +155,9 @@ main(int argc, char **argv)
    if (ERROR_FAILED(&err))
       error_clear(&err);
 
+   srv->StartWorkers(&err);
+   ERROR_CHECK(&err);
+
    srv->StartTcp(nullptr, &err);
    ERROR_CHECK(&err);
 
@@ -260,6 +275,64 @@ main(int argc, char **argv)
    }
 #endif
 
+   // After chroot, so that the snapshot path means the same thing here
+   // as when it gets written later.
+   //
+   srv->StartCacheSnapshots(&err);
+   ERROR_CHECK(&err);
+
+   srv->StartCacheSweep(&err);
+   ERROR_CHECK(&err);
+
+   srv->StartStats(&err);
+   ERROR_CHECK(&err);
+
+#if !defined(_WINDOWS)
+   // Catch SIGINT and SIGTERM through a pipe so that the cache can be
+   // written out from the event loop on the way down.
+   //
+   if (!pipe(shutdownPipe))
+   {
+      std::shared_ptr<common::SocketHandle> fd;
+      common::Pointer<pollster::socket_event> sev;
+
+      try
+      {
+         fd = std::make_shared<common::SocketHandle>();
+      }
+      catch (const std::bad_alloc&)
+      {
+         ERROR_SET(&err, nomem);
+      }
+      *fd = shutdownPipe[0];
+
+      loop->add_socket(
+         fd,
+         false,
+         [srv] (pollster::socket_event *sev, error *err) -> void
+         {
+            sev->on_signal = [srv] (error *err) -> void
+            {
+               // The workers share the cache, so they go first.
+               //
+               srv->StopWorkers();
+
+               srv->SaveCache(err);
+               if (ERROR_FAILED(err))
+                  log_printf("Failed to write cache snapshot");
+               exit(0);
+            };
+         },
+         sev.GetAddressOf(),
+         &err
+      );
+      ERROR_CHECK(&err);
+
+      signal(SIGINT, on_shutdown_signal);
+      signal(SIGTERM, on_shutdown_signal);
+   }
+#endif
+
    for (;;)
    {
       loop->exec(&err);